@@ -0,0 +1,64 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bytes of the cache key kept in a record; longer keys are cut short */
+#define ACCESS_LOG_KEY_SIZE 220
+
+/* The first bytes of every access log file, followed by the size of a record
+ * as a 32-bit number and four bytes of padding */
+#define ACCESS_LOG_MAGIC "PRXALOG1"
+
+/* Where the response to a request came from */
+typedef enum access_outcome_t {
+  ACCESS_HIT,
+  ACCESS_FRONT_HIT,
+  ACCESS_STALE_HIT,
+  ACCESS_NEGATIVE_HIT,
+  ACCESS_MISS,
+  ACCESS_REVALIDATION,
+  ACCESS_SHED,
+  ACCESS_ERROR,
+  ACCESS_OUTCOMES
+} access_outcome_t;
+
+/* One request as written to the access log, in the byte order of the host.
+ * Timings are in microseconds, and 0 for stages the request skipped. */
+typedef struct access_record_t {
+  // Wall clock time the request arrived, in nanoseconds since the epoch
+  uint64_t time;
+  // Bytes sent to the client
+  uint64_t bytes;
+  // From arrival until the response was sent
+  uint32_t total_us;
+  // From arrival until the cache was looked up
+  uint32_t lookup_us;
+  // Resolving and connecting to the origin
+  uint32_t connect_us;
+  // From sending the request to the origin until its first byte
+  uint32_t ttfb_us;
+  // Status sent to the client, or 0 if none was
+  uint16_t status;
+  // An access_outcome_t
+  uint8_t outcome;
+  uint8_t padding;
+  // The cache key, padded with NUL bytes
+  char key[ACCESS_LOG_KEY_SIZE];
+} access_record_t;
+
+// Starts logging to the file at path on a background thread, moving it to
+// path.1 (replacing any older one) whenever it would grow past max_size
+// bytes. Returns whether the file could be opened.
+bool access_log_open(char* path, size_t max_size);
+// Queues a record for the log without blocking. Returns whether it was
+// queued: records are dropped when the log is not open or cannot keep up.
+bool access_log_write(access_record_t* record);
+// Writes every queued record to the file
+void access_log_flush(void);
+// Returns the name of an outcome
+const char* access_log_outcome_name(access_outcome_t outcome);
+
+#endif // ACCESS_LOG_H
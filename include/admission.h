@@ -0,0 +1,30 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The classes of work that need an origin fetch. Cache hits never go through
+ * admission at all. */
+typedef enum admission_class_t {
+  // A client is waiting on the fetch; it may queue for a slot
+  ADMISSION_CLIENT,
+  // Nobody is waiting (refreshes, prefetches); it only takes a slot no
+  // client is queueing for
+  ADMISSION_BACKGROUND
+} admission_class_t;
+
+/* The origin fetches one group of threads may have in flight */
+typedef struct admission_t admission_t;
+
+// Creates a gate letting max_active fetches through at once, or any number
+// if max_active is 0. Client fetches queue for at most max_delay
+// milliseconds before they are shed.
+admission_t* admission_init(size_t max_active, long max_delay);
+// Reserves a slot for a fetch of the given class, queueing for it if the
+// class allows. Returns false if the fetch is shed.
+bool admission_acquire(admission_t* gate, admission_class_t class);
+// Gives back a slot reserved by admission_acquire
+void admission_release(admission_t* gate);
+
+#endif // ADMISSION_H
@@ -0,0 +1,29 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Bytes in each block of an arena; larger allocations get a block of their
+ * own */
+#define ARENA_BLOCK_SIZE 16384
+
+/* Memory for short-lived allocations that are all freed at once */
+typedef struct arena_t arena_t;
+
+// Creates an empty arena
+arena_t* arena_create(void);
+// Frees the arena and everything allocated from it
+void arena_free(arena_t* arena);
+// Returns size bytes from the arena, aligned for any type. They stay valid
+// until the arena is reset or freed.
+void* arena_alloc(arena_t* arena, size_t size);
+// Returns a copy of the first length bytes of str, '\0'-terminated, from the
+// arena
+char* arena_strndup(arena_t* arena, char* str, size_t length);
+// Returns a copy of str from the arena
+char* arena_strdup(arena_t* arena, char* str);
+// Frees everything allocated from the arena at once, keeping its first block
+// for the allocations that follow
+void arena_reset(arena_t* arena);
+
+#endif // ARENA_H
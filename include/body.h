@@ -0,0 +1,44 @@
+#ifndef BODY_H
+#define BODY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Smallest response body that is shared between cache entries; smaller ones
+ * stay with their headers */
+#define BODY_MIN_SHARED 256
+
+/* A response body stored once for every cache entry whose body has the same
+ * bytes */
+typedef struct body_t body_t;
+
+/* The bodies of one cache, found by their fingerprints. A store is not
+ * thread-safe: its cache serializes every call with its write lock, while
+ * readers only read the bytes of bodies they hold a reference to. */
+typedef struct body_store_t body_store_t;
+
+// Creates an empty store
+body_store_t* body_store_init(void);
+// Frees a store, along with any bodies still in it
+void body_store_free(body_store_t* store);
+// Returns a fast 64-bit fingerprint of length bytes at data
+uint64_t body_fingerprint(uint8_t* data, size_t length);
+// Returns the body in store with the length bytes at data, whose fingerprint
+// is fingerprint, with a reference added to it. If there is none, stores a
+// copy of the bytes and sets *added.
+body_t* body_intern(body_store_t* store, uint64_t fingerprint, uint8_t* data,
+                    size_t length, bool* added);
+// Drops a reference to a body (which may be NULL), freeing it if it was the
+// last one. Returns the bytes freed: the length of the body if it was freed,
+// and 0 otherwise.
+size_t body_release(body_t* body);
+// Returns the bytes of a body
+uint8_t* body_data(body_t* body);
+// Returns the length of a body
+size_t body_length(body_t* body);
+// Returns the bytes the bodies of a store would take up again if every
+// reference had its own copy
+size_t body_shared_bytes(body_store_t* store);
+
+#endif // BODY_H
@@ -0,0 +1,36 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "hash.h"
+
+/* Share of the memory stalled on (the "some avg10" of memory.pressure, in
+ * percent) above which the cache budget is cut */
+#define BUDGET_HIGH_PRESSURE 10.0
+
+/* Share of the memory stalled on below which the cache budget grows back */
+#define BUDGET_LOW_PRESSURE 1.0
+
+/* Adapts the capacity of a set of caches to the memory of a cgroup */
+typedef struct budget_t budget_t;
+
+// Parses the contents of a cgroup v2 memory.pressure file into the share of
+// the last 10 seconds some task was stalled on memory, in percent. Returns
+// whether successful.
+bool budget_parse_pressure(char* text, double* avg10);
+// Returns the cache budget that follows current at the given pressure: cut
+// by a quarter when the pressure is high, grown by step when it is low, and
+// kept otherwise, then kept between floor and ceiling (floor winning)
+size_t budget_next(size_t current, size_t floor, size_t ceiling, size_t step,
+                   double pressure);
+// Starts adapting the capacities of count caches to the memory of the cgroup
+// v2 directory cgroup (or of the proxy's own cgroup if NULL) every interval
+// milliseconds. The capacities they have now are the most they get, and set
+// their shares of the budget. Returns NULL if the memory pressure of the
+// cgroup cannot be read.
+budget_t* budget_start(char* cgroup, hash_t** caches, size_t count,
+                       long interval);
+
+#endif // BUDGET_H
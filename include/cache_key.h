@@ -0,0 +1,33 @@
+#ifndef CACHE_KEY_H
+#define CACHE_KEY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+/* Longest value of a request header that selects a variant */
+#define MAX_VARIANT_VALUE 256
+
+// Returns the canonical form of a "host[:port]" string, allocated from
+// arena: the host lowercased and the default port 80 dropped
+char* cache_key_host(arena_t* arena, char* host);
+// Returns the cache key of a request for path on host, allocated from arena:
+// the canonical host followed by the path. If sort_query, the query
+// parameters are sorted, and parameters named in strip (comma-separated
+// names, where a trailing * matches any name starting with the rest) are
+// dropped, unless strip is NULL.
+char* cache_key_make(arena_t* arena, char* host, char* path, bool sort_query,
+                     char* strip);
+// Returns whether key is the key of a variant rather than of a URL
+bool cache_key_is_variant(char* key);
+// Returns the length of the URL part of key, without its variant headers
+size_t cache_key_url_length(char* key);
+// Returns the key of the variant of the URL of key that a request selects
+// when the response varies on vary (see freshness_t), allocated from arena.
+// The values of the headers are taken from headers, a request head, or from
+// key itself if headers is NULL. The key ends with those headers as request
+// header lines.
+char* cache_key_variant(arena_t* arena, char* key, char* vary, char* headers);
+
+#endif // CACHE_KEY_H
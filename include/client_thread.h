@@ -1,6 +1,10 @@
 #ifndef CLIENT_THREAD_H
 #define CLIENT_THREAD_H
 
+#include "admission.h"
+#include "hash.h"
+#include "resolver.h"
+
 /* If you want verbose output on error,
  * #define VERBOSE. */
 
@@ -10,8 +14,41 @@
 # define verbose_printf(...)
 #endif
 
-/* Given a clientfd, handles the HTTP request sent on
- * cfd and sends the result back on cfd */
-void *handle_request(void *cfd);
+/* Defines the maximum object size for the data buffer*/
+#define MAX_OBJECT_SIZE 102400
+
+/* What the connections accepted on one listener share: the cache serving
+ * them, the origins they have requests in flight to, the resolver looking up
+ * those origins and the entries they are refreshing in the background. In per-core mode every core has its own, so
+ * the hot path never takes a lock another core uses. */
+typedef struct proxy_shard_t proxy_shard_t;
+
+/* An accepted client connection and the shard that serves it */
+typedef struct connection_t {
+    int client_fd;
+    proxy_shard_t *shard;
+} connection_t;
+
+/* Creates a shard serving its connections from cache. Origin failures and
+ * error responses are remembered in negative for config.negative_ttl. cpu is
+ * the CPU its threads are pinned to, or -1. origin_concurrency is the number
+ * of requests the shard may have in flight to one origin, or 0 for no limit,
+ * and admission lets its fetches from all origins through. Origin host names
+ * are looked up with resolver. Shards must all be created before the first
+ * connection is handled. */
+proxy_shard_t *shard_init(hash_t *cache, hash_t *negative, int cpu,
+                          size_t origin_concurrency, admission_t *admission,
+                          resolver_t *resolver);
+
+/* Starts warming up the caches of all shards with the URLs listed in the
+ * file at path, one "host[:port]/path" per line, in the background (see
+ * config.warm_up_concurrency). Until config.warm_up_ready percent of them
+ * are done, the proxy's /ready page answers 503. Returns false if the file
+ * cannot be read. */
+bool start_warm_up(char *path);
+
+/* Given a malloced connection_t, handles the HTTP request sent on its
+ * client_fd and sends the result back on client_fd. Frees the connection. */
+void *handle_request(void *connection);
 
 #endif
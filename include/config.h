@@ -0,0 +1,140 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+
+/* Default grace window for serving stale responses while they are refreshed */
+#define DEFAULT_STALE_WHILE_REVALIDATE 30
+
+/* Default grace window for serving stale responses when the origin fails */
+#define DEFAULT_STALE_IF_ERROR 300
+
+/* Default time allowed for connecting to an origin, in milliseconds */
+#define DEFAULT_CONNECT_TIMEOUT 5000
+
+/* Default time allowed between sending a request and the first byte of the
+ * response, in milliseconds */
+#define DEFAULT_FIRST_BYTE_TIMEOUT 30000
+
+/* Default time allowed between two reads of a response, in milliseconds */
+#define DEFAULT_IDLE_TIMEOUT 30000
+
+/* Default number of requests that may be in flight to a single origin */
+#define DEFAULT_ORIGIN_CONCURRENCY 64
+
+/* Default seconds an origin failure or error response is remembered */
+#define DEFAULT_NEGATIVE_TTL 5
+
+/* Default bytes of remembered failures and error responses */
+#define DEFAULT_NEGATIVE_CACHE_SIZE 131072
+
+/* Default response statuses remembered for the negative TTL */
+#define DEFAULT_NEGATIVE_STATUSES "404,410,500,502,503,504"
+
+/* Default number of requests that may be fetching from origins at once */
+#define DEFAULT_MISS_CONCURRENCY 256
+
+/* Default time a miss may queue for a fetch slot before it is shed, in
+ * milliseconds */
+#define DEFAULT_MISS_QUEUE_DELAY 2000
+
+/* Default bytes prefetched for the resources of one page */
+#define DEFAULT_PREFETCH_BUDGET 1048576
+
+/* Default percentages of the cache size the background reclaimer starts and
+ * stops evicting at */
+#define DEFAULT_HIGH_WATERMARK 98
+#define DEFAULT_LOW_WATERMARK 94
+
+/* Default number of threads warming up the cache at startup */
+#define DEFAULT_WARM_UP_CONCURRENCY 16
+
+/* Default percentage of the warm-up done before the proxy reports ready */
+#define DEFAULT_WARM_UP_READY 90
+
+/* Default bytes an access log file grows to before it is rotated */
+#define DEFAULT_ACCESS_LOG_SIZE 67108864
+
+/* Runtime options of the proxy, set from the command line in proxy.c */
+typedef struct proxy_config_t {
+  // Seconds a stale response is served while being refreshed in the
+  // background, unless the origin specified stale-while-revalidate
+  long stale_while_revalidate;
+  // Seconds a stale response is served when the origin is down or answers
+  // with a server error, unless the origin specified stale-if-error
+  long stale_if_error;
+  // Milliseconds allowed for connecting to an origin
+  long connect_timeout;
+  // Milliseconds allowed until the first byte of the origin's response
+  long first_byte_timeout;
+  // Milliseconds allowed between two reads from the origin
+  long idle_timeout;
+  // Requests that may be in flight to one origin at once, or 0 for no limit
+  long origin_concurrency;
+  // Requests that may be fetching from any origin at once, or 0 for no
+  // limit. Cache hits do not count.
+  long miss_concurrency;
+  // Milliseconds a miss may queue for one of those before it is shed
+  long miss_queue_delay;
+  // Bytes the cache may hold in total
+  long cache_size;
+  // Percentages of the cache size above which a background thread starts
+  // evicting, and at which it stops. Inserts only evict themselves once the
+  // cache is full. A high watermark of 0 leaves all eviction to inserts.
+  long high_watermark;
+  long low_watermark;
+  // Threads resolving host names, split between the shards
+  long dns_threads;
+  // The DNS server to query directly ("address[:port]" or "system"), or NULL
+  // to resolve names with getaddrinfo
+  char *dns_server;
+  // Whether every CPU runs its own listener, accept loop and cache shard
+  bool per_core;
+  // Whether connections are accepted through an io_uring multishot accept
+  // (if available)
+  bool uring_accept;
+  // Seconds origin failures and error responses are remembered, so requests
+  // are answered with them instead of trying the origin again, or 0 to
+  // always try again
+  long negative_ttl;
+  // Bytes the remembered failures and error responses may take in total
+  long negative_cache_size;
+  // Comma-separated response statuses that are remembered
+  char *negative_statuses;
+  // Threads that may prefetch the resources of cached HTML pages at once,
+  // or 0 not to prefetch
+  long prefetch_concurrency;
+  // Bytes prefetched at most for the resources of one page
+  long prefetch_budget;
+  // Whether the query parameters of a URL are sorted in its cache key
+  bool sort_query;
+  // Comma-separated query parameters left out of cache keys (a trailing *
+  // matches any parameter starting with the rest), or NULL for none
+  char *strip_query_params;
+  // File requests are logged to in binary (see access_log.h), or NULL not to
+  // log them
+  char *access_log;
+  // Bytes the access log grows to before it is moved to access_log.1
+  long access_log_size;
+  // Whether the cache budget shrinks under memory pressure (up to
+  // cache_size), see budget.c
+  bool adaptive_cache;
+  // The cgroup v2 directory whose memory the cache budget adapts to, or
+  // NULL for the proxy's own cgroup
+  char *cgroup;
+  // File listing URLs fetched into the cache at startup, or NULL for none
+  char *warm_up;
+  // Threads fetching them
+  long warm_up_concurrency;
+  // Bytes fetched at most across all shards, or 0 for the cache size
+  long warm_up_budget;
+  // Percentage of them done before the proxy reports that it is ready
+  long warm_up_ready;
+} proxy_config_t;
+
+/* Defines a global configuration across the program. This configuration is
+ * initialized in proxy.c.
+ */
+extern proxy_config_t config;
+
+#endif // CONFIG_H
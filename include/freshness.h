@@ -0,0 +1,63 @@
+#ifndef FRESHNESS_H
+#define FRESHNESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Longest entity tag we keep for revalidation; longer tags are dropped */
+#define MAX_ETAG_LENGTH 128
+
+/* Longest Vary header we keep; responses varying on more are not stored */
+#define MAX_VARY_LENGTH 128
+
+/* Lifetime given to responses that carry no freshness information at all */
+#define DEFAULT_FRESHNESS_LIFETIME 300
+
+/* Upper bound on the heuristic lifetime derived from Last-Modified */
+#define MAX_HEURISTIC_LIFETIME 86400
+
+/* Freshness metadata stored alongside every cached response */
+typedef struct freshness_t {
+  // Time at which the response was received or last revalidated
+  time_t stored_at;
+  // Time after which the response is stale
+  time_t expires_at;
+  // Seconds the response stays fresh after the origin generated it
+  long lifetime;
+  // Value of the Last-Modified header, or 0 if there was none
+  time_t last_modified;
+  // Value of the ETag header (including quotes), or "" if there was none
+  char etag[MAX_ETAG_LENGTH];
+  // Seconds the response may be served stale while it is revalidated in the
+  // background (stale-while-revalidate), or -1 if the origin did not say
+  long stale_while_revalidate;
+  // Seconds the response may be served stale when the origin fails
+  // (stale-if-error), or -1 if the origin did not say
+  long stale_if_error;
+  // Whether the origin forbade serving the response stale at all
+  bool must_revalidate;
+  // The request headers the response varies on, lowercased and separated by
+  // commas without spaces, or "" if it had no Vary header
+  char vary[MAX_VARY_LENGTH];
+} freshness_t;
+
+// Computes the freshness metadata of a complete response received at now.
+// Returns whether the response may be stored in a shared cache at all.
+bool freshness_parse(uint8_t* response, size_t length, time_t now,
+                     freshness_t* meta);
+// Updates meta with the headers of a 304 Not Modified response received at
+// now. Validators, directives and a lifetime missing from the 304 are kept
+// from the stored response.
+void freshness_update(freshness_t* meta, uint8_t* response, size_t length,
+                      time_t now);
+// Returns whether a response with the given metadata is still fresh at now
+bool freshness_is_fresh(freshness_t* meta, time_t now);
+// Returns whether a stale response may still be served at now when it may be
+// served for window seconds after it expired
+bool freshness_within_stale_window(freshness_t* meta, time_t now, long window);
+// Returns whether the response can be revalidated with a conditional request
+bool freshness_has_validator(freshness_t* meta);
+
+#endif // FRESHNESS_H
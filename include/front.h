@@ -0,0 +1,19 @@
+#ifndef FRONT_H
+#define FRONT_H
+
+#include "buffer.h"
+#include "freshness.h"
+#include "hash.h"
+
+/* Largest response a front cache keeps a copy of */
+#define FRONT_MAX_OBJECT 16384
+
+// Returns a copy of the response front caches hold for key of table, setting
+// *meta to its freshness metadata, or NULL if the front cache of the calling
+// CPU has no current copy of it
+buffer_t* front_get(hash_t* table, char* key, freshness_t* meta);
+// Notes a hit on key in table. Keys that keep being hit on the calling CPU
+// are copied into its front cache.
+void front_note_hit(hash_t* table, char* key);
+
+#endif // FRONT_H
@@ -5,6 +5,9 @@
 #include <stdint.h>
 #include "queue.h"
 
+/* Defines the maximum cache size for the proxy cache */
+#define MAX_CACHE_SIZE 1048756
+
 /* An unresizahle hash table with default TABLE_SIZE */
 typedef struct hash_t hash_t;
 
@@ -12,8 +15,18 @@ typedef struct hash_t hash_t;
 // the queue for each bucket; sets the number of buckets to be TABLE_SIZE,
 // and initializes a read-write lock
 hash_t *hash_init(void);
+// Initializes a new hash table like hash_init, but holding at most capacity
+// bytes instead of the default maximum cache size
+hash_t *hash_init_with_capacity(size_t capacity);
 // Returns the cache size
 size_t get_cache_size(hash_t* hash_table);
+// Returns the most bytes the cache may hold
+size_t get_cache_capacity(hash_t* hash_table);
+// Returns the bytes the cache saves by storing identical bodies once
+size_t get_dedup_bytes(hash_t* hash_table);
+// Sets the most bytes the cache may hold from now on. Entries over it are
+// only evicted by later inserts or by hash_remove.
+void hash_set_capacity(hash_t* hash_table, size_t capacity);
 // Frees a given hash_t pointer
 void hash_free(hash_t* hash_table);
 // Returns the hash number of a given key
@@ -24,9 +37,30 @@ size_t get_hash_id(hash_t* hash_table, char* key);
 bool contains(hash_t* hash_table, char* key);
 // Returns the value associated with a key from the hash_table
 buffer_t* get(hash_t* hash_table, char* key);
+// Returns the value associated with a key and copies its freshness metadata
+// into meta
+buffer_t* get_with_meta(hash_t* hash_table, char* key, freshness_t* meta);
+// Returns the value associated with a key like get_with_meta, unless it is
+// larger than max_length, and marks the entry hot so that replacing,
+// evicting or refreshing it advances the hot epoch. Sets *epoch to the hot
+// epoch the copy is current for.
+buffer_t* get_hot(hash_t* hash_table, char* key, size_t max_length,
+                  freshness_t* meta, uint64_t* epoch);
+// Replaces the freshness metadata of a cached key after revalidation.
+// Returns whether the key was found.
+bool hash_refresh(hash_t* hash_table, char* key, freshness_t* meta);
 // Removes an element from the hash table
 void hash_remove(hash_t* hash_table);
+// Starts a background thread that evicts from the table whenever it holds
+// more than high_watermark percent of its capacity, until it holds at most
+// low_watermark percent. hash_free stops it.
+void hash_start_reclaimer(hash_t* hash_table, unsigned low_watermark,
+                          unsigned high_watermark);
 // Inserts a node element into the hash table given a key and a value
 void insert(hash_t* hash_table, char* key, buffer_t* value);
+// Inserts a key and value along with the freshness metadata of the response,
+// replacing any existing entry for the key
+void insert_with_meta(hash_t* hash_table, char* key, buffer_t* value,
+                      freshness_t* meta);
 
 #endif // HASH_H
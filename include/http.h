@@ -0,0 +1,45 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Size of a buffer large enough to hold a formatted HTTP date */
+#define HTTP_DATE_SIZE 32
+
+/* What a Range header asks of a body */
+typedef enum http_range_t {
+  // No range we support: the whole body is sent as usual
+  HTTP_RANGE_IGNORED,
+  // A range that overlaps the body
+  HTTP_RANGE_SATISFIABLE,
+  // A range entirely past the end of the body (416 Range Not Satisfiable)
+  HTTP_RANGE_UNSATISFIABLE
+} http_range_t;
+
+// Returns the status code of an HTTP response, or -1 if the status line is
+// malformed or incomplete
+int http_status_code(uint8_t* data, size_t length);
+// Returns the offset just past the "\r\n\r\n" ending the header block, or 0 if
+// the header block is not complete yet
+size_t http_header_end(uint8_t* data, size_t length);
+// Copies the trimmed value of the first header called name (case insensitive)
+// into value. Returns whether the header was found.
+bool http_get_header(uint8_t* data, size_t length, char* name, char* value,
+                     size_t value_size);
+// Parses an HTTP date (IMF-fixdate, RFC 850 or asctime). Returns -1 on error.
+time_t http_parse_date(char* str);
+// Formats a time as an IMF-fixdate into out, which must hold HTTP_DATE_SIZE
+void http_format_date(time_t time, char* out);
+// Resolves the value of a Range header against a body of length bytes,
+// setting *first and *last to the offsets of the first and last byte asked
+// for if it is satisfiable. Only a single range of bytes is supported.
+http_range_t http_parse_range(char* value, size_t length, size_t* first,
+                              size_t* last);
+// Returns whether the validator in the value of an If-Range header (an
+// entity tag or a date) matches a response, so that a range of it may be sent
+bool http_if_range_matches(uint8_t* data, size_t length, char* if_range);
+
+#endif // HTTP_H
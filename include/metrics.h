@@ -0,0 +1,73 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffer.h"
+
+/* Event counters kept by the proxy */
+typedef enum metric_counter_t {
+  METRIC_REQUESTS,
+  METRIC_HITS,
+  METRIC_FRONT_HITS,
+  METRIC_STALE_HITS,
+  METRIC_MISSES,
+  METRIC_REVALIDATIONS,
+  METRIC_NOT_MODIFIED,
+  METRIC_PARTIAL_RESPONSES,
+  METRIC_NEGATIVE_HITS,
+  METRIC_PREFETCHES,
+  METRIC_EVICTIONS,
+  METRIC_INLINE_EVICTIONS,
+  METRIC_DEDUP_HITS,
+  METRIC_BYTES_SERVED,
+  METRIC_BYTES_FETCHED,
+  METRIC_UPSTREAM_ERRORS,
+  METRIC_UPSTREAM_TIMEOUTS,
+  METRIC_ORIGIN_REJECTED,
+  METRIC_SHED_MISSES,
+  METRIC_ACCESS_LOG_DROPPED,
+  METRIC_COUNTERS
+} metric_counter_t;
+
+/* Latency histograms kept by the proxy, all recorded in nanoseconds */
+typedef enum metric_histogram_t {
+  METRIC_REQUEST_LATENCY,
+  METRIC_UPSTREAM_DNS,
+  METRIC_UPSTREAM_CONNECT,
+  METRIC_UPSTREAM_TTFB,
+  METRIC_LOCK_WAIT,
+  METRIC_ADMISSION_WAIT,
+  METRIC_HISTOGRAMS
+} metric_histogram_t;
+
+/* Point-in-time values set by whoever owns them */
+typedef enum metric_gauge_t {
+  METRIC_CACHE_BYTES,
+  METRIC_CACHE_BUDGET,
+  METRIC_DEDUP_BYTES,
+  METRIC_GAUGES
+} metric_gauge_t;
+
+// Returns the current time of a monotonic clock in nanoseconds
+uint64_t metrics_now(void);
+// Makes the calling thread record into the shard of cpu, for threads that
+// only ever run on that CPU
+void metrics_bind_cpu(int cpu);
+// Adds amount to a counter
+void metrics_add(metric_counter_t counter, uint64_t amount);
+// Records a latency sample, in nanoseconds
+void metrics_record(metric_histogram_t histogram, uint64_t nanoseconds);
+// Records the time elapsed since start, as returned by metrics_now
+void metrics_record_since(metric_histogram_t histogram, uint64_t start);
+// Sets a gauge to value
+void metrics_set(metric_gauge_t gauge, uint64_t value);
+// Returns the sum of a counter over all threads
+uint64_t metrics_total(metric_counter_t counter);
+// Appends every metric to out, either as plain text or in the Prometheus
+// text exposition format
+void metrics_render(buffer_t* out, bool prometheus);
+
+#endif // METRICS_H
@@ -0,0 +1,22 @@
+#ifndef ORIGIN_H
+#define ORIGIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The requests currently in flight to one origin server */
+typedef struct origin_t origin_t;
+
+/* The origins with requests in flight from one group of threads */
+typedef struct origin_table_t origin_table_t;
+
+// Creates an empty origin table
+origin_table_t* origin_table_init(void);
+// Reserves one of the max_active connection slots of the origin named by
+// host ("hostname[:port]") in table. Returns NULL if all of them are taken.
+// A max_active of 0 means no limit.
+origin_t* origin_acquire(origin_table_t* table, char* host, size_t max_active);
+// Gives back a slot reserved by origin_acquire
+void origin_release(origin_t* origin);
+
+#endif // ORIGIN_H
@@ -0,0 +1,20 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Most resources of one page that are prefetched */
+#define MAX_PREFETCH_LINKS 32
+
+/* Longest path of a resource that is prefetched */
+#define MAX_PREFETCH_PATH 1024
+
+// Finds the resources an HTML page embeds (the src of any element and the
+// href of link elements) that are on the same origin as the page, whose
+// "host[:port]" is host and whose path is path. Stores up to max of their
+// paths, each malloced, in paths and returns how many were stored.
+size_t prefetch_find_links(uint8_t* html, size_t length, char* host,
+                           char* path, char** paths, size_t max);
+
+#endif // PREFETCH_H
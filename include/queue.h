@@ -3,7 +3,9 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include "body.h"
 #include "buffer.h"
+#include "freshness.h"
 
 typedef struct node_t node_t;
 
@@ -19,8 +21,26 @@ typedef struct queue_t {
 node_t* node_init(char* key, buffer_t* value);
 // Frees the given node
 void node_free(node_t* node);
+// Returns the body a node shares with others, or NULL if its value is the
+// whole response
+body_t* get_body(node_t* node);
+// Makes a node hold a reference to a shared body, which follows the bytes of
+// its value. Freeing the node releases it.
+void set_body(node_t* node, body_t* body);
+// Returns the length of the whole response of a node, its body included
+size_t get_length(node_t* node);
+// Returns the freshness metadata of a node
+freshness_t* get_meta(node_t* node);
 // Returns the timestamp of a node
-clock_t get_timestamp(node_t* node);
+uint64_t get_timestamp(node_t* node);
+// Marks a node as copied into front caches (see front.c), so that freeing it
+// or changing its metadata advances the hot epoch
+void mark_hot(node_t* node);
+// Advances the hot epoch if the node is hot, for when its metadata changes
+void node_changed(node_t* node);
+// Returns the hot epoch, which advances whenever a hot node is freed or
+// changed
+uint64_t get_hot_epoch(void);
 // Initializes a new queue with NULL head and tail pointers
 queue_t* queue_init();
 // Frees a given queue pointer by iterating over every node and calling node_free
@@ -37,8 +57,12 @@ void enqueue(queue_t* queue, node_t* node);
 // the minimum timestamp
 node_t* find_least_recent_node(queue_t* queue);
 // Removes the least recently used element in a queue by checking each timestamp
-// and returns the buffer size of the value removed.
+// and returns the bytes freed: the buffer size of the value removed, plus the
+// length of its body unless another node still shares it.
 size_t queue_remove(queue_t* queue);
+// Removes the node with the given key and returns the bytes freed like
+// queue_remove, or 0 if no node has the key.
+size_t queue_delete(queue_t* queue, char* key);
 
 // Functions used to test the node and queue implementation
 node_t* get_next_node(node_t* node);
@@ -0,0 +1,51 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+/* Most addresses a lookup returns; the rest are dropped */
+#define MAX_RESOLVED_ADDRESSES 16
+
+/* Default number of threads resolving names for each resolver */
+#define DEFAULT_DNS_THREADS 4
+
+/* Time a DNS server gets to answer a query before it is sent again, and the
+ * number of times it is sent, when querying a DNS server directly */
+#define DNS_QUERY_TIMEOUT 1000
+#define DNS_QUERY_ATTEMPTS 2
+
+/* The addresses of a host, in the order they should be tried */
+typedef struct resolved_t {
+  size_t count;
+  struct sockaddr_storage addresses[MAX_RESOLVED_ADDRESSES];
+  socklen_t lengths[MAX_RESOLVED_ADDRESSES];
+} resolved_t;
+
+/* A pool of threads that resolve host names */
+typedef struct resolver_t resolver_t;
+
+/* A name being resolved by a resolver */
+typedef struct lookup_t lookup_t;
+
+// Starts a resolver with the given number of threads. If dns_server is not
+// NULL, names are resolved by querying that DNS server ("address[:port]",
+// or "system" for the first nameserver in /etc/resolv.conf) directly over UDP
+// instead of with getaddrinfo. Returns NULL if dns_server is invalid.
+resolver_t* resolver_init(size_t threads, char* dns_server);
+// Starts resolving hostname in the background. A lookup of the same name
+// that is already in flight is shared instead of starting another one.
+lookup_t* resolver_start(resolver_t* resolver, char* hostname);
+// Returns a file descriptor that becomes readable once the lookup is done,
+// for callers waiting on other file descriptors at the same time
+int resolver_fd(lookup_t* lookup);
+// Waits for a lookup to finish and releases it. On success, fills in result
+// with its addresses, all with the given port, and returns 0. Otherwise
+// returns the EAI_* error code getaddrinfo would have returned.
+int resolver_finish(lookup_t* lookup, int port, resolved_t* result);
+// Resolves hostname, blocking until done, and returns like resolver_finish
+int resolver_lookup(resolver_t* resolver, char* hostname, int port,
+                    resolved_t* result);
+
+#endif // RESOLVER_H
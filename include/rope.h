@@ -0,0 +1,34 @@
+#ifndef ROPE_H
+#define ROPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffer.h"
+
+/* Bytes held by one chunk of a rope */
+#define ROPE_CHUNK_SIZE 16384
+
+/* Byte sequence made of a chain of fixed-size chunks, which never moves the
+ * bytes it already holds */
+typedef struct rope_t rope_t;
+
+/* Creates an empty rope */
+rope_t *rope_create(void);
+/* Frees the rope, giving its chunks back to the pool */
+void rope_free(rope_t *);
+/* Get the number of bytes in the rope */
+size_t rope_length(rope_t *);
+/* Returns the free space at the end of the rope, at least one byte, and sets
+ * *available to its size. Bytes written there are added by rope_commit. */
+uint8_t *rope_reserve(rope_t *, size_t *available);
+/* Adds length bytes written to the space returned by rope_reserve */
+void rope_commit(rope_t *, size_t length);
+/* Append byte array to rope */
+void rope_append_bytes(rope_t *, uint8_t *bytes, size_t length);
+/* Drops all bytes of the rope, keeping one chunk for the next ones */
+void rope_clear(rope_t *);
+/* Copies the bytes of the rope into a buffer of exactly their length */
+buffer_t *rope_flatten(rope_t *);
+
+#endif // ROPE_H
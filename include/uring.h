@@ -0,0 +1,14 @@
+#ifndef URING_H
+#define URING_H
+
+/* Accepts connections on a listening socket through io_uring */
+typedef struct uring_acceptor_t uring_acceptor_t;
+
+// Sets up an io_uring with a multishot accept on listen_fd. Returns NULL if
+// io_uring is not available, in which case the caller should use accept.
+uring_acceptor_t* uring_acceptor_init(int listen_fd);
+// Returns the next accepted connection, or -1 with errno set on error. Falls
+// back to accept if the kernel turns out not to support multishot accept.
+int uring_accept(uring_acceptor_t* acceptor);
+
+#endif // URING_H
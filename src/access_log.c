@@ -0,0 +1,232 @@
+/*
+ * access_log.c - A binary access log that never blocks a request.
+ *
+ * Requests only copy their fixed-size record into a bounded ring and return.
+ * The ring is a lock-free multi-producer queue: every slot carries a
+ * sequence number that says whether it is free for the producer that claims
+ * its position or holds a record for the consumer, so producers only contend
+ * on the atomic increment of the tail. When the ring is full the record is
+ * dropped and counted instead of waiting for room.
+ *
+ * A single background thread drains the ring in batches with one write per
+ * batch, and rotates the file by renaming it to path.1 when it grows past
+ * its maximum size. Every file starts with a small header, so that
+ * log-decode can check that it understands the records that follow.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "metrics.h"
+
+/* Number of records the ring holds, a power of two */
+#define RING_SLOTS 4096
+
+/* Most records written at once */
+#define BATCH_RECORDS 64
+
+/* Time the drain thread sleeps when the ring is empty, in nanoseconds */
+#define DRAIN_INTERVAL 10000000
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct slot_t {
+  // Equal to the position of the slot when it is free, and one more when it
+  // holds the record of that position
+  uint64_t sequence;
+  access_record_t record;
+} slot_t;
+
+static slot_t ring[RING_SLOTS];
+
+/* The next position producers claim, on a cache line of its own */
+static uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* The next position the consumer reads, on a cache line of its own */
+static uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Whether the log was opened, so that records are queued */
+static bool opened = false;
+
+/* Serializes draining between the drain thread and access_log_flush */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* log_path;
+static size_t log_max_size;
+static int log_fd = -1;
+static size_t log_size;
+
+static const char* outcome_names[ACCESS_OUTCOMES] = {
+  [ACCESS_HIT] = "hit",
+  [ACCESS_FRONT_HIT] = "front_hit",
+  [ACCESS_STALE_HIT] = "stale_hit",
+  [ACCESS_NEGATIVE_HIT] = "negative_hit",
+  [ACCESS_MISS] = "miss",
+  [ACCESS_REVALIDATION] = "revalidation",
+  [ACCESS_SHED] = "shed",
+  [ACCESS_ERROR] = "error",
+};
+
+const char* access_log_outcome_name(access_outcome_t outcome) {
+  return outcome < ACCESS_OUTCOMES ? outcome_names[outcome] : "unknown";
+}
+
+/* Writes all of length bytes to the log file. Returns whether successful */
+static bool write_all(uint8_t* bytes, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(log_fd, bytes, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += written;
+    length -= written;
+    log_size += written;
+  }
+  return true;
+}
+
+/* Opens a new log file at log_path and writes its header. Returns whether
+ * successful */
+static bool open_file(void) {
+  log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                0644);
+  if (log_fd < 0) {
+    return false;
+  }
+  log_size = 0;
+  uint8_t header[16] = { 0 };
+  memcpy(header, ACCESS_LOG_MAGIC, strlen(ACCESS_LOG_MAGIC));
+  uint32_t record_size = sizeof(access_record_t);
+  memcpy(header + strlen(ACCESS_LOG_MAGIC), &record_size, sizeof(record_size));
+  return write_all(header, sizeof(header));
+}
+
+/* Moves the log file to log_path.1 and starts a new one */
+static void rotate(void) {
+  close(log_fd);
+  size_t length = strlen(log_path) + strlen(".1") + 1;
+  char* rotated = malloc(length);
+  if (rotated != NULL) {
+    snprintf(rotated, length, "%s.1", log_path);
+    if (rename(log_path, rotated) < 0) {
+      perror("Access log rotation");
+    }
+    free(rotated);
+  }
+  if (!open_file()) {
+    perror("Access log");
+  }
+}
+
+/* Writes the queued records to the file, in batches. Must be called with
+ * drain_lock held. Returns how many records were taken from the ring. */
+static size_t drain(void) {
+  access_record_t batch[BATCH_RECORDS];
+  size_t total = 0;
+  while (true) {
+    size_t count = 0;
+    while (count < BATCH_RECORDS) {
+      slot_t* slot = &ring[head % RING_SLOTS];
+      if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != head + 1) {
+        break;
+      }
+      batch[count++] = slot->record;
+      // Frees the slot for the producer that claims it a lap later
+      __atomic_store_n(&slot->sequence, head + RING_SLOTS, __ATOMIC_RELEASE);
+      head++;
+    }
+    if (count == 0) {
+      return total;
+    }
+    total += count;
+    size_t length = count * sizeof(access_record_t);
+    if (log_fd >= 0 && log_size + length > log_max_size) {
+      rotate();
+    }
+    if (log_fd < 0 || !write_all((uint8_t*) batch, length)) {
+      metrics_add(METRIC_ACCESS_LOG_DROPPED, count);
+    }
+  }
+}
+
+/* Drains the ring forever, sleeping while it is empty */
+static void* drain_loop(void* arg) {
+  (void) arg;
+  struct timespec interval = { 0, DRAIN_INTERVAL };
+  while (true) {
+    pthread_mutex_lock(&drain_lock);
+    size_t drained = drain();
+    pthread_mutex_unlock(&drain_lock);
+    if (drained == 0) {
+      nanosleep(&interval, NULL);
+    }
+  }
+  return NULL;
+}
+
+bool access_log_open(char* path, size_t max_size) {
+  for (uint64_t i = 0; i < RING_SLOTS; i++) {
+    ring[i].sequence = i;
+  }
+  log_path = path;
+  log_max_size = max_size;
+  if (!open_file()) {
+    return false;
+  }
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, drain_loop, NULL) != 0) {
+    return false;
+  }
+  pthread_detach(tid);
+  __atomic_store_n(&opened, true, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool access_log_write(access_record_t* record) {
+  if (!__atomic_load_n(&opened, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  uint64_t position = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+  slot_t* slot;
+  while (true) {
+    slot = &ring[position % RING_SLOTS];
+    uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    int64_t difference = (int64_t) (sequence - position);
+    if (difference == 0) {
+      // The slot is free; claim its position unless another producer did
+      if (__atomic_compare_exchange_n(&tail, &position, position + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    }
+    else if (difference < 0) {
+      // The slot still holds the record of the previous lap: full
+      metrics_add(METRIC_ACCESS_LOG_DROPPED, 1);
+      return false;
+    }
+    else {
+      position = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    }
+  }
+  slot->record = *record;
+  __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+void access_log_flush(void) {
+  if (!__atomic_load_n(&opened, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  pthread_mutex_lock(&drain_lock);
+  drain();
+  pthread_mutex_unlock(&drain_lock);
+}
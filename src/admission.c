@@ -0,0 +1,104 @@
+/*
+ * admission.c - Admission control for requests that go to an origin.
+ *
+ * Cache hits are cheap and answered right away, but every miss holds a thread
+ * and a connection for as long as the origin takes. Under overload, misses
+ * piling up on slow origins would eat the threads and CPU that hits need, so
+ * they are let through a gate with a fixed number of slots. A client miss
+ * that finds no free slot queues for one, and is shed once it has queued for
+ * longer than the configured delay, since by then the client is better off
+ * with a quick error (or a stale copy) than with waiting even longer.
+ * Background fetches have the lowest priority: they never queue, and never
+ * take a slot a client is queueing for.
+ *
+ * The per-origin limit (see origin.c) still applies on top of this one.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "admission.h"
+#include "metrics.h"
+
+struct admission_t {
+  // Slots in total, or 0 for no limit, and slots taken
+  size_t max_active;
+  size_t active;
+  // Client fetches queueing for a slot
+  size_t waiting;
+  // Milliseconds a client fetch may queue
+  long max_delay;
+  pthread_mutex_t lock;
+  // Signalled whenever a slot is given back
+  pthread_cond_t released;
+};
+
+admission_t* admission_init(size_t max_active, long max_delay) {
+  admission_t* gate = malloc(sizeof(admission_t));
+  assert(gate != NULL);
+  gate->max_active = max_active;
+  gate->active = 0;
+  gate->waiting = 0;
+  gate->max_delay = max_delay;
+  pthread_mutex_init(&gate->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&gate->released, &attr);
+  pthread_condattr_destroy(&attr);
+  return gate;
+}
+
+bool admission_acquire(admission_t* gate, admission_class_t class) {
+  if (gate->max_active == 0) {
+    return true;
+  }
+  pthread_mutex_lock(&gate->lock);
+  if (gate->active < gate->max_active &&
+      (class == ADMISSION_CLIENT || gate->waiting == 0)) {
+    gate->active++;
+    pthread_mutex_unlock(&gate->lock);
+    return true;
+  }
+  if (class == ADMISSION_BACKGROUND) {
+    pthread_mutex_unlock(&gate->lock);
+    return false;
+  }
+
+  uint64_t start = metrics_now();
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += gate->max_delay / 1000;
+  deadline.tv_nsec += (gate->max_delay % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  gate->waiting++;
+  int err = 0;
+  while (gate->active >= gate->max_active && err == 0) {
+    err = pthread_cond_timedwait(&gate->released, &gate->lock, &deadline);
+  }
+  gate->waiting--;
+  bool admitted = gate->active < gate->max_active;
+  if (admitted) {
+    gate->active++;
+  }
+  pthread_mutex_unlock(&gate->lock);
+  metrics_record_since(METRIC_ADMISSION_WAIT, start);
+  return admitted;
+}
+
+void admission_release(admission_t* gate) {
+  if (gate->max_active == 0) {
+    return;
+  }
+  pthread_mutex_lock(&gate->lock);
+  gate->active--;
+  if (gate->waiting > 0) {
+    pthread_cond_signal(&gate->released);
+  }
+  pthread_mutex_unlock(&gate->lock);
+}
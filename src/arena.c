@@ -0,0 +1,113 @@
+/*
+ * arena.c - Bump allocation for the short-lived memory of a request.
+ *
+ * Handling a request allocates a handful of small strings (the host, the
+ * path, the cache key and its variants) that all die when the request is
+ * answered. Taking each from malloc and giving it back costs a trip into the
+ * allocator, which many threads share. An arena hands them out from a block
+ * by bumping a pointer instead, and frees them all at once when the request
+ * is done, keeping its first block for the next request of the same thread.
+ *
+ * Nothing that outlives the request may come from an arena: the cache copies
+ * the keys it stores, and entries kept for background work are malloced.
+ */
+
+#include <assert.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/* Alignment of every allocation, enough for any type */
+#define ARENA_ALIGNMENT alignof(max_align_t)
+
+typedef struct block_t {
+  struct block_t* next;
+  // Bytes of data in use and available
+  size_t used;
+  size_t size;
+  alignas(max_align_t) uint8_t data[];
+} block_t;
+
+struct arena_t {
+  // The block allocations are taken from, followed by the full ones
+  block_t* blocks;
+  // The block kept when the arena is reset
+  block_t* first;
+};
+
+static block_t* block_create(size_t size, block_t* next) {
+  block_t* block = malloc(sizeof(block_t) + size);
+  assert(block != NULL);
+  block->next = next;
+  block->used = 0;
+  block->size = size;
+  return block;
+}
+
+arena_t* arena_create(void) {
+  arena_t* arena = malloc(sizeof(arena_t));
+  assert(arena != NULL);
+  arena->blocks = block_create(ARENA_BLOCK_SIZE, NULL);
+  arena->first = arena->blocks;
+  return arena;
+}
+
+void arena_free(arena_t* arena) {
+  if (!arena) {
+    return;
+  }
+  block_t* block = arena->blocks;
+  while (block != NULL) {
+    block_t* next = block->next;
+    free(block);
+    block = next;
+  }
+  free(arena);
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+  block_t* block = arena->blocks;
+  if (block->size - block->used < size) {
+    if (size > ARENA_BLOCK_SIZE / 4) {
+      // A large allocation gets a block of its own behind the current one,
+      // which stays in use for the small allocations
+      block->next = block_create(size, block->next);
+      block->next->used = size;
+      return block->next->data;
+    }
+    block = block_create(ARENA_BLOCK_SIZE, block);
+    arena->blocks = block;
+  }
+  void* memory = block->data + block->used;
+  block->used += size;
+  return memory;
+}
+
+char* arena_strndup(arena_t* arena, char* str, size_t length) {
+  char* copy = arena_alloc(arena, length + 1);
+  memcpy(copy, str, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+char* arena_strdup(arena_t* arena, char* str) {
+  return arena_strndup(arena, str, strlen(str));
+}
+
+void arena_reset(arena_t* arena) {
+  block_t* block = arena->blocks;
+  while (block != NULL) {
+    block_t* next = block->next;
+    if (block != arena->first) {
+      free(block);
+    }
+    block = next;
+  }
+  arena->first->next = NULL;
+  arena->first->used = 0;
+  arena->blocks = arena->first;
+}
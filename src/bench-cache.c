@@ -0,0 +1,258 @@
+/*
+ * bench-cache.c - Multi-threaded microbenchmark of the hash_t cache.
+ *
+ * The first part drives get and insert from 1, 2, 4, ... up to -t threads at
+ * once on realistic URL keys with Zipf popularity and a mix of small and large
+ * objects, and reports the throughput and tail latency of each operation. It
+ * is sized so the cache overflows, so inserts also pay for their evictions.
+ * This shows the cost of table_lock contention and of copy_buffer on hits.
+ *
+ * The second part measures a single hash_remove as the number of cached
+ * entries grows, which shows the cost of the full-table LRU scan.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "hash.h"
+#include "metrics.h"
+
+#define KEY_SIZE 128
+
+/* Largest object the benchmark inserts */
+#define MAX_VALUE_SIZE 100000
+
+/* Latencies of one kind of operation recorded by one thread */
+typedef struct samples_t {
+  uint64_t* values;
+  size_t count;
+  size_t capacity;
+} samples_t;
+
+typedef struct worker_t {
+  pthread_t tid;
+  uint64_t rng;
+  samples_t gets;
+  samples_t inserts;
+} worker_t;
+
+static hash_t* cache;
+static char (*keys)[KEY_SIZE];
+static size_t* sizes;
+static double* zipf_cdf;
+static size_t key_count = 2000;
+static int get_percent = 90;
+static double seconds = 1;
+static volatile bool running;
+static uint8_t pattern[MAX_VALUE_SIZE];
+
+/* xorshift64* generator, returns a uniform double in [0, 1) */
+static double next_uniform(uint64_t* state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return (*state * 2685821657736338717ULL >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t draw_key(uint64_t* rng) {
+  double u = next_uniform(rng);
+  size_t low = 0, high = key_count - 1;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (zipf_cdf[mid] < u) {
+      low = mid + 1;
+    }
+    else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+static void add_sample(samples_t* samples, uint64_t value) {
+  if (samples->count == samples->capacity) {
+    samples->capacity = samples->capacity ? samples->capacity * 2 : 4096;
+    samples->values = realloc(samples->values,
+                              samples->capacity * sizeof(uint64_t));
+    assert(samples->values != NULL);
+  }
+  samples->values[samples->count++] = value;
+}
+
+/* Returns a buffer of the given size, as a fetched response would be */
+static buffer_t* make_value(size_t size) {
+  buffer_t* value = buffer_create(size);
+  buffer_append_bytes(value, pattern, size);
+  return value;
+}
+
+static void* run_worker(void* arg) {
+  worker_t* worker = arg;
+  while (running) {
+    size_t key = draw_key(&worker->rng);
+    if (next_uniform(&worker->rng) * 100 < get_percent) {
+      uint64_t start = metrics_now();
+      buffer_t* value = get(cache, keys[key]);
+      add_sample(&worker->gets, metrics_now() - start);
+      buffer_free(value);
+    }
+    else {
+      // Building the value is not part of the measured insert
+      buffer_t* value = make_value(sizes[key]);
+      uint64_t start = metrics_now();
+      insert(cache, keys[key], value);
+      add_sample(&worker->inserts, metrics_now() - start);
+    }
+  }
+  return NULL;
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Merges the samples of every worker, sorts them and prints percentiles */
+static void report(const char* name, worker_t* workers, int threads,
+                   bool inserts) {
+  size_t count = 0;
+  for (int i = 0; i < threads; i++) {
+    count += (inserts ? &workers[i].inserts : &workers[i].gets)->count;
+  }
+  uint64_t* all = malloc((count + 1) * sizeof(uint64_t));
+  assert(all != NULL);
+  size_t merged = 0;
+  for (int i = 0; i < threads; i++) {
+    samples_t* samples = inserts ? &workers[i].inserts : &workers[i].gets;
+    memcpy(all + merged, samples->values, samples->count * sizeof(uint64_t));
+    merged += samples->count;
+    free(samples->values);
+  }
+  qsort(all, count, sizeof(uint64_t), compare_u64);
+  if (count == 0) {
+    printf("  %-7s no samples\n", name);
+  }
+  else {
+    printf("  %-7s %9.0f ops/s  p50=%.2fus p99=%.2fus p999=%.2fus "
+           "max=%.2fus\n", name, count / seconds, all[count / 2] / 1e3,
+           all[(size_t) (count * 0.99)] / 1e3,
+           all[(size_t) (count * 0.999)] / 1e3, all[count - 1] / 1e3);
+  }
+  free(all);
+}
+
+static void run_threads(int threads) {
+  worker_t* workers = calloc(threads, sizeof(worker_t));
+  assert(workers != NULL);
+  uint64_t evictions = metrics_total(METRIC_EVICTIONS);
+  running = true;
+  for (int i = 0; i < threads; i++) {
+    workers[i].rng = (i + 1) * 0x9E3779B97F4A7C15ULL;
+    pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]);
+  }
+  usleep(seconds * 1e6);
+  running = false;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].tid, NULL);
+  }
+  printf("%d thread%s, %lu evictions, %zu bytes cached\n", threads,
+         threads == 1 ? "" : "s",
+         metrics_total(METRIC_EVICTIONS) - evictions, get_cache_size(cache));
+  report("get", workers, threads, false);
+  report("insert", workers, threads, true);
+  free(workers);
+}
+
+/* Measures hash_remove with a cache holding population small entries */
+static void measure_eviction(size_t population) {
+  hash_t* table = hash_init();
+  char key[KEY_SIZE];
+  for (size_t i = 0; i < population; i++) {
+    snprintf(key, sizeof(key), "evict.example.com/%zu", i);
+    insert(table, key, make_value(64));
+  }
+  size_t removes = population / 4 < 200 ? population / 4 : 200;
+  uint64_t start = metrics_now();
+  for (size_t i = 0; i < removes; i++) {
+    hash_remove(table);
+  }
+  uint64_t elapsed = metrics_now() - start;
+  printf("  %6zu entries: %8.2fus per hash_remove\n", population,
+         elapsed / 1e3 / removes);
+  hash_free(table);
+}
+
+static void usage(char* program) {
+  printf("Usage: %s [-t max-threads] [-d seconds] [-k keys] [-g get-percent]\n",
+         program);
+  exit(1);
+}
+
+int main(int argc, char* argv[]) {
+  int max_threads = 8;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:d:k:g:")) != -1) {
+    switch (opt) {
+      case 't': max_threads = atoi(optarg); break;
+      case 'd': seconds = atof(optarg); break;
+      case 'k': key_count = strtoul(optarg, NULL, 10); break;
+      case 'g': get_percent = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || max_threads <= 0 || key_count == 0 || seconds <= 0) {
+    usage(argv[0]);
+  }
+
+  for (size_t i = 0; i < MAX_VALUE_SIZE; i++) {
+    pattern[i] = 'a' + i % 26;
+  }
+
+  // URL keys with realistic lengths, 80% small objects and 20% large ones
+  uint64_t rng = 24;
+  keys = malloc(key_count * KEY_SIZE);
+  sizes = malloc(key_count * sizeof(size_t));
+  zipf_cdf = malloc(key_count * sizeof(double));
+  assert(keys != NULL && sizes != NULL && zipf_cdf != NULL);
+  double total = 0;
+  for (size_t i = 0; i < key_count; i++) {
+    snprintf(keys[i], KEY_SIZE, "www.site%zu.example.com/static/assets/%zu/"
+             "bundle.min.js?v=%zu", i % 97, i, i * 7919 % 1000);
+    bool large = next_uniform(&rng) < 0.2;
+    sizes[i] = large ? 20000 + next_uniform(&rng) * 80000
+                     : 500 + next_uniform(&rng) * 7500;
+    total += 1.0 / (i + 1);
+    zipf_cdf[i] = total;
+  }
+  for (size_t i = 0; i < key_count; i++) {
+    zipf_cdf[i] /= total;
+  }
+
+  cache = hash_init();
+  for (size_t i = 0; i < key_count; i++) {
+    insert(cache, keys[i], make_value(sizes[i]));
+  }
+  printf("%zu keys, %d%% gets, %.1f s per run\n", key_count, get_percent,
+         seconds);
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    run_threads(threads);
+  }
+  hash_free(cache);
+
+  printf("eviction cost by cache population\n");
+  for (size_t population = 256; population <= 8192; population *= 2) {
+    measure_eviction(population);
+  }
+
+  free(zipf_cdf);
+  free(sizes);
+  free(keys);
+}
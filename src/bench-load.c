@@ -0,0 +1,433 @@
+/*
+ * bench-load.c - A closed- and open-loop HTTP load generator for the proxy.
+ *
+ * Every request asks the proxy for an object of bench-origin, picked from a
+ * fixed key space with Zipf popularity. The size of every object is drawn once
+ * from the configured size distribution, so the same key always has the same
+ * size, just like a real object would.
+ *
+ * In closed-loop mode (the default) every connection thread sends its next
+ * request as soon as the previous one completes. In open-loop mode (-r) the
+ * requests arrive on a Poisson schedule at the given rate no matter how fast
+ * the proxy answers, and latency is measured from the scheduled arrival time,
+ * so a proxy that falls behind is not hidden by coordinated omission.
+ *
+ * The hit ratio is computed from how many objects the origin served during the
+ * run, which it reports on GET /count.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REQUEST_SIZE 512
+#define RESPONSE_CHUNK 65536
+
+/* Distributions object sizes can be drawn from */
+typedef enum size_kind_t { SIZE_FIXED, SIZE_UNIFORM, SIZE_PARETO } size_kind_t;
+
+typedef struct options_t {
+    int proxy_port;
+    int origin_port;
+    int concurrency;
+    long requests;
+    double duration;
+    double rate;
+    size_t keys;
+    double zipf;
+    size_kind_t size_kind;
+    double size_args[3];
+    uint64_t seed;
+} options_t;
+
+/* Latencies recorded by one connection thread */
+typedef struct worker_t {
+    pthread_t tid;
+    uint64_t rng;
+    uint64_t *latencies;
+    size_t count;
+    size_t capacity;
+    uint64_t errors;
+    uint64_t bytes;
+} worker_t;
+
+static options_t options = {
+    .concurrency = 16,
+    .requests = 10000,
+    .keys = 1000,
+    .zipf = 0.99,
+    .size_kind = SIZE_PARETO,
+    .size_args = { 1024, 1.2, 1048576 },
+    .seed = 24,
+};
+
+static size_t *object_sizes;
+static double *zipf_cdf;
+static double *arrivals;
+static uint64_t start_ns;
+static uint64_t deadline_ns;
+static long next_request = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* xorshift64* generator, returns a uniform double in [0, 1) */
+static double next_uniform(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * 2685821657736338717ULL >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Draws the size of one object from the configured distribution */
+static size_t draw_size(uint64_t *rng) {
+    double *args = options.size_args;
+    double size;
+    switch (options.size_kind) {
+        case SIZE_UNIFORM:
+            size = args[0] + next_uniform(rng) * (args[1] - args[0] + 1);
+            break;
+        case SIZE_PARETO:
+            size = args[0] / pow(1.0 - next_uniform(rng), 1.0 / args[1]);
+            if (size > args[2]) {
+                size = args[2];
+            }
+            break;
+        default:
+            size = args[0];
+    }
+    return (size_t) size;
+}
+
+/* Picks a key index following the Zipf popularity */
+static size_t draw_key(uint64_t *rng) {
+    double u = next_uniform(rng);
+    size_t low = 0, high = options.keys - 1;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (zipf_cdf[mid] < u) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static int connect_local(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Sends request on a new connection to port and reads the whole response.
+ * Returns the number of bytes received, or -1 on error. */
+static long fetch(int port, char *request, char *first_bytes, size_t size) {
+    int fd = connect_local(port);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t length = strlen(request);
+    if (write(fd, request, length) != (ssize_t) length) {
+        close(fd);
+        return -1;
+    }
+    long total = 0;
+    char buf[RESPONSE_CHUNK];
+    while (true) {
+        ssize_t bytes_read = read(fd, buf, sizeof(buf));
+        if (bytes_read < 0) {
+            close(fd);
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        if (first_bytes != NULL && (size_t) total < size - 1) {
+            size_t copied = size - 1 - total;
+            if (copied > (size_t) bytes_read) {
+                copied = bytes_read;
+            }
+            memcpy(first_bytes + total, buf, copied);
+            first_bytes[total + copied] = '\0';
+        }
+        total += bytes_read;
+    }
+    close(fd);
+    return total;
+}
+
+/* Returns how many objects the origin has served so far */
+static long origin_count(void) {
+    char response[256] = "";
+    if (fetch(options.origin_port, "GET /count HTTP/1.0\r\n\r\n", response,
+              sizeof(response)) < 0) {
+        return -1;
+    }
+    char *body = strstr(response, "\r\n\r\n");
+    return body != NULL ? atol(body + 4) : -1;
+}
+
+static void record(worker_t *worker, uint64_t latency) {
+    if (worker->count == worker->capacity) {
+        worker->capacity = worker->capacity ? worker->capacity * 2 : 1024;
+        worker->latencies = realloc(worker->latencies,
+                                    worker->capacity * sizeof(uint64_t));
+        assert(worker->latencies != NULL);
+    }
+    worker->latencies[worker->count++] = latency;
+}
+
+static void *run_worker(void *arg) {
+    worker_t *worker = arg;
+    char request[REQUEST_SIZE];
+    char status[32];
+    while (true) {
+        long index = __atomic_fetch_add(&next_request, 1, __ATOMIC_RELAXED);
+        uint64_t begin;
+        if (arrivals != NULL) {
+            if (index >= options.requests) {
+                break;
+            }
+            /* Wait for the scheduled arrival, and measure from it */
+            begin = start_ns + (uint64_t) (arrivals[index] * 1e9);
+            uint64_t now = now_ns();
+            if (begin > now) {
+                struct timespec wait = {
+                    (begin - now) / 1000000000, (begin - now) % 1000000000
+                };
+                nanosleep(&wait, NULL);
+            }
+        }
+        else {
+            begin = now_ns();
+            if (deadline_ns ? begin >= deadline_ns
+                            : index >= options.requests) {
+                break;
+            }
+        }
+
+        size_t key = draw_key(&worker->rng);
+        snprintf(request, sizeof(request),
+                 "GET http://127.0.0.1:%d/obj/%zu?size=%zu HTTP/1.0\r\n"
+                 "Host: 127.0.0.1:%d\r\n\r\n",
+                 options.origin_port, key, object_sizes[key],
+                 options.origin_port);
+        long received = fetch(options.proxy_port, request, status,
+                              sizeof(status));
+        if (received < 0 || strncmp(status, "HTTP/1.", 7) != 0 ||
+            strncmp(status + 8, " 200", 4) != 0) {
+            worker->errors++;
+            continue;
+        }
+        worker->bytes += received;
+        record(worker, now_ns() - begin);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(uint64_t *sorted, size_t count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t index = (size_t) (p * count);
+    if (index >= count) {
+        index = count - 1;
+    }
+    return sorted[index] / 1e6;
+}
+
+static bool parse_sizes(char *spec) {
+    char *kind = strtok(spec, ":");
+    if (kind == NULL) {
+        return false;
+    }
+    int expected;
+    if (strcmp(kind, "fixed") == 0) {
+        options.size_kind = SIZE_FIXED;
+        expected = 1;
+    }
+    else if (strcmp(kind, "uniform") == 0) {
+        options.size_kind = SIZE_UNIFORM;
+        expected = 2;
+    }
+    else if (strcmp(kind, "pareto") == 0) {
+        options.size_kind = SIZE_PARETO;
+        expected = 3;
+    }
+    else {
+        return false;
+    }
+    for (int i = 0; i < expected; i++) {
+        char *arg = strtok(NULL, ":");
+        if (arg == NULL) {
+            return false;
+        }
+        options.size_args[i] = atof(arg);
+    }
+    return strtok(NULL, ":") == NULL;
+}
+
+static void usage(char *program) {
+    printf("Usage: %s [options] <proxy-port> <origin-port>\n"
+           "Options:\n"
+           "  -c <connections>  concurrent connections (default 16)\n"
+           "  -n <requests>     number of requests (default 10000)\n"
+           "  -d <seconds>      run closed loop for a duration instead of -n\n"
+           "  -r <rate>         open loop at rate requests/s (Poisson)\n"
+           "  -k <keys>         number of distinct objects (default 1000)\n"
+           "  -z <exponent>     Zipf exponent, 0 is uniform (default 0.99)\n"
+           "  -s <sizes>        fixed:N, uniform:MIN:MAX or\n"
+           "                    pareto:MIN:ALPHA:MAX (default "
+           "pareto:1024:1.2:1048576)\n"
+           "  -S <seed>         random seed (default 24)\n", program);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:d:r:k:z:s:S:")) != -1) {
+        switch (opt) {
+            case 'c': options.concurrency = atoi(optarg); break;
+            case 'n': options.requests = atol(optarg); break;
+            case 'd': options.duration = atof(optarg); break;
+            case 'r': options.rate = atof(optarg); break;
+            case 'k': options.keys = strtoul(optarg, NULL, 10); break;
+            case 'z': options.zipf = atof(optarg); break;
+            case 's':
+                if (!parse_sizes(optarg)) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'S': options.seed = strtoull(optarg, NULL, 10); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2 || options.concurrency <= 0 || options.keys == 0) {
+        usage(argv[0]);
+    }
+    options.proxy_port = atoi(argv[optind]);
+    options.origin_port = atoi(argv[optind + 1]);
+
+    /* Fix the size of every object and the popularity of every key */
+    uint64_t rng = options.seed | 1;
+    object_sizes = malloc(options.keys * sizeof(size_t));
+    zipf_cdf = malloc(options.keys * sizeof(double));
+    assert(object_sizes != NULL && zipf_cdf != NULL);
+    double total = 0;
+    for (size_t i = 0; i < options.keys; i++) {
+        object_sizes[i] = draw_size(&rng);
+        total += 1.0 / pow(i + 1, options.zipf);
+        zipf_cdf[i] = total;
+    }
+    for (size_t i = 0; i < options.keys; i++) {
+        zipf_cdf[i] /= total;
+    }
+
+    /* In open loop, the whole arrival schedule is fixed up front */
+    if (options.rate > 0) {
+        if (options.duration > 0) {
+            options.requests = (long) (options.rate * options.duration);
+        }
+        arrivals = malloc(options.requests * sizeof(double));
+        assert(arrivals != NULL);
+        double t = 0;
+        for (long i = 0; i < options.requests; i++) {
+            t += -log(1.0 - next_uniform(&rng)) / options.rate;
+            arrivals[i] = t;
+        }
+    }
+
+    long served_before = origin_count();
+    worker_t *workers = calloc(options.concurrency, sizeof(worker_t));
+    assert(workers != NULL);
+    start_ns = now_ns();
+    if (options.rate <= 0 && options.duration > 0) {
+        deadline_ns = start_ns + (uint64_t) (options.duration * 1e9);
+    }
+    for (int i = 0; i < options.concurrency; i++) {
+        workers[i].rng = (options.seed + i + 1) * 0x9E3779B97F4A7C15ULL;
+        pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]);
+    }
+
+    size_t count = 0;
+    uint64_t errors = 0, bytes = 0;
+    for (int i = 0; i < options.concurrency; i++) {
+        pthread_join(workers[i].tid, NULL);
+        count += workers[i].count;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+    long served_after = origin_count();
+
+    uint64_t *latencies = malloc((count + 1) * sizeof(uint64_t));
+    assert(latencies != NULL);
+    size_t merged = 0;
+    for (int i = 0; i < options.concurrency; i++) {
+        memcpy(latencies + merged, workers[i].latencies,
+               workers[i].count * sizeof(uint64_t));
+        merged += workers[i].count;
+        free(workers[i].latencies);
+    }
+    qsort(latencies, count, sizeof(uint64_t), compare_u64);
+
+    printf("mode          %s, %d connections, %zu keys, zipf %.2f\n",
+           arrivals ? "open loop" : "closed loop", options.concurrency,
+           options.keys, options.zipf);
+    printf("requests      %zu ok, %lu errors in %.2f s\n", count, errors,
+           elapsed);
+    printf("throughput    %.1f req/s, %.2f MB/s\n", count / elapsed,
+           bytes / elapsed / 1e6);
+    printf("latency       p50=%.3fms p99=%.3fms p999=%.3fms max=%.3fms\n",
+           percentile_ms(latencies, count, 0.5),
+           percentile_ms(latencies, count, 0.99),
+           percentile_ms(latencies, count, 0.999),
+           count ? latencies[count - 1] / 1e6 : 0.0);
+    if (served_before >= 0 && served_after >= 0 && count > 0) {
+        long misses = served_after - served_before;
+        printf("hit ratio     %.4f (%ld origin fetches)\n",
+               1.0 - (double) misses / (count + errors), misses);
+    }
+
+    free(latencies);
+    free(workers);
+    free(arrivals);
+    free(zipf_cdf);
+    free(object_sizes);
+    return errors > 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * bench-origin.c - A local stand-in for origin servers, used by the benchmarks.
+ *
+ * Serves GET /obj/<id>?size=<bytes> with a deterministic body of the requested
+ * size, so benchmarks can run without touching the Internet. The body starts
+ * with the id and goes on with a pattern seeded by it, so that objects differ
+ * as they would on a real origin and the proxy cannot store them once (see
+ * body.c). With -D every object of a size gets the same body instead, which
+ * shows what that deduplication gains. The response is cacheable for max-age
+ * seconds (see -m). GET /count returns the number of
+ * objects served so far, which lets the load generator compute the hit ratio
+ * of the proxy in front of us.
+ *
+ * A fixed pool of threads blocks in accept on the shared listening socket, so
+ * the origin itself never becomes the bottleneck of a benchmark.
+ */
+
+#include <assert.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define LISTENQ 1024
+#define REQUEST_SIZE 8192
+#define BODY_CHUNK 65536
+
+/* Upper bound on the size of a single object, to keep mistakes cheap */
+#define MAX_BODY_SIZE (64 * 1024 * 1024)
+
+static int listen_fd;
+static long max_age = 3600;
+static unsigned long delay_us = 0;
+static unsigned long served = 0;
+static bool duplicate_bodies = false;
+static uint8_t body_chunk[BODY_CHUNK];
+
+static int open_listen_fd(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int value = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, LISTENQ) < 0) {
+        return -1;
+    }
+    return fd;
+}
+
+/* Writes all of a byte array, returns whether successful */
+static bool write_all(int fd, const void *bytes, size_t length) {
+    const char *curr = bytes;
+    while (length > 0) {
+        ssize_t written = write(fd, curr, length);
+        if (written <= 0) {
+            return false;
+        }
+        curr += written;
+        length -= written;
+    }
+    return true;
+}
+
+/* Reads the request head into request, returns whether a whole head arrived */
+static bool read_request(int fd, char *request, size_t size) {
+    size_t length = 0;
+    while (length < size - 1) {
+        ssize_t bytes_read = read(fd, request + length, size - 1 - length);
+        if (bytes_read <= 0) {
+            return false;
+        }
+        length += bytes_read;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Fills the first chunk of the body of object id into chunk: the id, then
+ * letters drawn from a generator seeded with it. Larger bodies repeat the
+ * chunk. */
+static void fill_body(uint8_t *chunk, size_t length, unsigned long id) {
+    int prefix = snprintf((char *) chunk, length, "%lu\n", id);
+    if (prefix < 0 || (size_t) prefix >= length) {
+        return;
+    }
+    uint64_t state = id * 0x9e3779b97f4a7c15ULL + 1;
+    for (size_t i = prefix; i < length; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        chunk[i] = 'a' + state % 26;
+    }
+}
+
+static void serve(int fd) {
+    char request[REQUEST_SIZE];
+    if (!read_request(fd, request, sizeof(request))) {
+        return;
+    }
+
+    char header[512];
+    if (strncmp(request, "GET /count ", strlen("GET /count ")) == 0) {
+        char body[32];
+        int length = snprintf(body, sizeof(body), "%lu\n",
+                              __atomic_load_n(&served, __ATOMIC_RELAXED));
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\n"
+                 "Cache-Control: no-store\r\n"
+                 "Content-Length: %d\r\n\r\n", length);
+        if (write_all(fd, header, strlen(header))) {
+            write_all(fd, body, length);
+        }
+        return;
+    }
+
+    char *size_str = strstr(request, "size=");
+    if (strncmp(request, "GET /obj/", strlen("GET /obj/")) != 0 ||
+        size_str == NULL) {
+        char *not_found = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        write_all(fd, not_found, strlen(not_found));
+        return;
+    }
+    size_t size = strtoul(size_str + strlen("size="), NULL, 10);
+    if (size > MAX_BODY_SIZE) {
+        size = MAX_BODY_SIZE;
+    }
+    uint8_t *chunk = body_chunk;
+    uint8_t own_chunk[BODY_CHUNK];
+    if (!duplicate_bodies) {
+        unsigned long id = strtoul(request + strlen("GET /obj/"), NULL, 10);
+        fill_body(own_chunk, size < BODY_CHUNK ? size : BODY_CHUNK, id);
+        chunk = own_chunk;
+    }
+
+    __atomic_fetch_add(&served, 1, __ATOMIC_RELAXED);
+    if (delay_us > 0) {
+        usleep(delay_us);
+    }
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\n"
+             "Content-Type: application/octet-stream\r\n"
+             "Cache-Control: max-age=%ld\r\n"
+             "Content-Length: %zu\r\n\r\n", max_age, size);
+    if (!write_all(fd, header, strlen(header))) {
+        return;
+    }
+    while (size > 0) {
+        size_t length = size < BODY_CHUNK ? size : BODY_CHUNK;
+        if (!write_all(fd, chunk, length)) {
+            return;
+        }
+        size -= length;
+    }
+}
+
+static void *worker(void *arg) {
+    (void) arg;
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void usage(char *program) {
+    printf("Usage: %s [-t threads] [-m max-age] [-d delay-us] [-D] <port>\n"
+           "  -D  serve the same body for every object of a size\n", program);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+
+    int threads = 16;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:m:d:D")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'm':
+                max_age = atol(optarg);
+                break;
+            case 'd':
+                delay_us = strtoul(optarg, NULL, 10);
+                break;
+            case 'D':
+                duplicate_bodies = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || threads <= 0) {
+        usage(argv[0]);
+    }
+    int port = atoi(argv[optind]);
+    if (port <= 0 || port > 65535) {
+        usage(argv[0]);
+    }
+
+    for (size_t i = 0; i < BODY_CHUNK; i++) {
+        body_chunk[i] = 'a' + i % 26;
+    }
+    listen_fd = open_listen_fd(port);
+    if (listen_fd < 0) {
+        perror("Listen error");
+        return 1;
+    }
+
+    printf("Origin listening on port %d with %d threads\n", port, threads);
+    fflush(stdout);
+    pthread_t tid;
+    for (int i = 1; i < threads; i++) {
+        pthread_create(&tid, NULL, worker, NULL);
+    }
+    worker(NULL);
+}
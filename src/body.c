@@ -0,0 +1,132 @@
+/*
+ * body.c - Storing identical response bodies once.
+ *
+ * Versioned asset paths, mirrors and URLs that differ only in their query
+ * often answer with byte-identical bodies. Cache entries therefore keep
+ * their headers to themselves, but look their body up by a fingerprint of
+ * its bytes and share it with every other entry that has the same bytes.
+ * A body counts its references, and is freed along with the last entry
+ * holding it, so a cache only charges the first copy against its capacity.
+ *
+ * The fingerprint mixes eight bytes at a time, so that hashing a large body
+ * costs little next to receiving it. Two bodies are only shared if their
+ * bytes are actually equal, so a collision of fingerprints never mixes up
+ * responses.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "body.h"
+
+/* Number of buckets of a store */
+#define BODY_BUCKETS 1024
+
+struct body_t {
+  body_store_t* store;
+  uint64_t fingerprint;
+  size_t length;
+  size_t refs;
+  // The next body in the same bucket
+  struct body_t* next;
+  uint8_t data[];
+};
+
+struct body_store_t {
+  body_t* buckets[BODY_BUCKETS];
+  size_t shared_bytes;
+};
+
+body_store_t* body_store_init(void) {
+  body_store_t* store = calloc(1, sizeof(body_store_t));
+  assert(store != NULL);
+  return store;
+}
+
+void body_store_free(body_store_t* store) {
+  if (store == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < BODY_BUCKETS; i++) {
+    body_t* curr = store->buckets[i];
+    while (curr != NULL) {
+      body_t* next = curr->next;
+      free(curr);
+      curr = next;
+    }
+  }
+  free(store);
+}
+
+uint64_t body_fingerprint(uint8_t* data, size_t length) {
+  uint64_t hash = 0x9e3779b97f4a7c15ULL ^ length;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+  }
+  uint64_t rest = 0;
+  memcpy(&rest, data + i, length - i);
+  hash = (hash ^ rest) * 0xc4ceb9fe1a85ec53ULL;
+  return hash ^ (hash >> 29);
+}
+
+body_t* body_intern(body_store_t* store, uint64_t fingerprint, uint8_t* data,
+                    size_t length, bool* added) {
+  body_t** bucket = &store->buckets[fingerprint % BODY_BUCKETS];
+  for (body_t* curr = *bucket; curr != NULL; curr = curr->next) {
+    if (curr->fingerprint == fingerprint && curr->length == length &&
+        memcmp(curr->data, data, length) == 0) {
+      curr->refs++;
+      store->shared_bytes += length;
+      *added = false;
+      return curr;
+    }
+  }
+
+  body_t* body = malloc(sizeof(body_t) + length);
+  assert(body != NULL);
+  body->store = store;
+  body->fingerprint = fingerprint;
+  body->length = length;
+  body->refs = 1;
+  memcpy(body->data, data, length);
+  body->next = *bucket;
+  *bucket = body;
+  *added = true;
+  return body;
+}
+
+size_t body_release(body_t* body) {
+  if (body == NULL) {
+    return 0;
+  }
+  body_store_t* store = body->store;
+  if (--body->refs > 0) {
+    store->shared_bytes -= body->length;
+    return 0;
+  }
+  body_t** curr = &store->buckets[body->fingerprint % BODY_BUCKETS];
+  while (*curr != body) {
+    curr = &(*curr)->next;
+  }
+  *curr = body->next;
+  size_t length = body->length;
+  free(body);
+  return length;
+}
+
+uint8_t* body_data(body_t* body) {
+  return body->data;
+}
+
+size_t body_length(body_t* body) {
+  return body->length;
+}
+
+size_t body_shared_bytes(body_store_t* store) {
+  return store->shared_bytes;
+}
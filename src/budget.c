@@ -0,0 +1,241 @@
+/*
+ * budget.c - Sizing the cache to the memory the cgroup can spare.
+ *
+ * A fixed cache size either wastes memory a container could give to its
+ * neighbors or gets the proxy OOM-killed when they spike. A monitor thread
+ * instead reads the cgroup v2 memory files of the proxy every interval and
+ * moves the budget of the cache the way TCP moves its window, starting from
+ * the configured size: a quarter is cut whenever tasks of the cgroup spent
+ * more than BUDGET_HIGH_PRESSURE percent of the last ten seconds stalled on
+ * memory (the "some avg10" of memory.pressure), and a sixteenth of the
+ * configured size is given back whenever they spent less than
+ * BUDGET_LOW_PRESSURE percent.
+ *
+ * The budget never exceeds the configured size, nor what memory.max leaves
+ * over once everything but the cache (and a tenth of the limit, as headroom)
+ * is counted, and never drops below a sixteenth of the configured size. The
+ * caches keep their shares of the budget, and those that hold more than
+ * their new capacity are shrunk at once with hash_remove.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "budget.h"
+
+/* Root of the cgroup v2 hierarchy */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+/* Longest path of a cgroup file */
+#define MAX_PATH 512
+
+/* Largest cgroup file read */
+#define MAX_FILE 1024
+
+/* The configured size is divided by this to get the smallest budget and the
+ * step it grows by */
+#define BUDGET_STEPS 16
+
+struct budget_t {
+  char directory[MAX_PATH];
+  hash_t** caches;
+  // The capacities the caches started with, which set their shares
+  size_t* shares;
+  size_t count;
+  // The capacities the caches started with in total, and now
+  size_t max_bytes;
+  size_t bytes;
+  long interval;
+};
+
+bool budget_parse_pressure(char* text, double* avg10) {
+  // The first line looks like "some avg10=0.00 avg60=0.00 avg300=0.00 ..."
+  if (strncmp(text, "some ", strlen("some ")) != 0) {
+    return false;
+  }
+  char* value = strstr(text, "avg10=");
+  char* end_of_line = strchr(text, '\n');
+  if (value == NULL || (end_of_line != NULL && value > end_of_line)) {
+    return false;
+  }
+  char* end;
+  *avg10 = strtod(value + strlen("avg10="), &end);
+  return end != value + strlen("avg10=");
+}
+
+size_t budget_next(size_t current, size_t floor, size_t ceiling, size_t step,
+                   double pressure) {
+  size_t next = current;
+  if (pressure >= BUDGET_HIGH_PRESSURE) {
+    next = current - current / 4;
+  }
+  else if (pressure <= BUDGET_LOW_PRESSURE) {
+    next = current + step;
+  }
+  if (next > ceiling) {
+    next = ceiling;
+  }
+  if (next < floor) {
+    next = floor;
+  }
+  return next;
+}
+
+/* Reads the file name of the budget's cgroup into text, which holds
+ * MAX_FILE bytes. Returns whether successful. */
+static bool read_file(budget_t* budget, char* name, char* text) {
+  char path[MAX_PATH + 32];
+  snprintf(path, sizeof(path), "%s/%s", budget->directory, name);
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    return false;
+  }
+  size_t length = fread(text, 1, MAX_FILE - 1, file);
+  fclose(file);
+  text[length] = '\0';
+  return length > 0;
+}
+
+/* Reads a file of the budget's cgroup that holds a number of bytes. Returns
+ * false if it cannot be read or is unlimited ("max"). */
+static bool read_bytes(budget_t* budget, char* name, size_t* bytes) {
+  char text[MAX_FILE];
+  if (!read_file(budget, name, text)) {
+    return false;
+  }
+  char* end;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (end == text) {
+    return false;
+  }
+  *bytes = value;
+  return true;
+}
+
+/* Finds the directory of the proxy's own cgroup in the v2 hierarchy, from
+ * the "0::/path" line of /proc/self/cgroup. Returns whether found. */
+static bool find_own_cgroup(char* directory) {
+  FILE* file = fopen("/proc/self/cgroup", "r");
+  if (file == NULL) {
+    return false;
+  }
+  char line[MAX_PATH];
+  bool found = false;
+  while (!found && fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, "0::", strlen("0::")) == 0) {
+      line[strcspn(line, "\n")] = '\0';
+      snprintf(directory, MAX_PATH, "%s%s", CGROUP_ROOT, line + strlen("0::"));
+      found = true;
+    }
+  }
+  fclose(file);
+  return found;
+}
+
+/* Gives every cache its share of the budget, shrinking those that hold more
+ * than that */
+static void apply(budget_t* budget) {
+  size_t total = 0;
+  for (size_t i = 0; i < budget->count; i++) {
+    total += budget->shares[i];
+  }
+  for (size_t i = 0; i < budget->count; i++) {
+    hash_t* cache = budget->caches[i];
+    size_t capacity = (double) budget->bytes * budget->shares[i] / total;
+    hash_set_capacity(cache, capacity);
+    while (get_cache_size(cache) > capacity) {
+      hash_remove(cache);
+    }
+  }
+}
+
+/* Moves the budget according to the memory of the cgroup */
+static void update(budget_t* budget) {
+  char text[MAX_FILE];
+  double pressure;
+  if (!read_file(budget, "memory.pressure", text) ||
+      !budget_parse_pressure(text, &pressure)) {
+    return;
+  }
+
+  size_t ceiling = budget->max_bytes;
+  size_t limit, current;
+  if (read_bytes(budget, "memory.max", &limit) &&
+      read_bytes(budget, "memory.current", &current)) {
+    size_t cached = 0;
+    for (size_t i = 0; i < budget->count; i++) {
+      cached += get_cache_size(budget->caches[i]);
+    }
+    size_t used = (current > cached ? current - cached : 0) + limit / 10;
+    size_t room = limit > used ? limit - used : 0;
+    if (room < ceiling) {
+      ceiling = room;
+    }
+  }
+
+  size_t step = budget->max_bytes / BUDGET_STEPS;
+  size_t next = budget_next(budget->bytes, step, ceiling, step, pressure);
+  if (next != budget->bytes) {
+    budget->bytes = next;
+    apply(budget);
+  }
+}
+
+static void* monitor(void* arg) {
+  budget_t* budget = arg;
+  struct timespec interval = {
+    budget->interval / 1000, budget->interval % 1000 * 1000000
+  };
+  while (true) {
+    nanosleep(&interval, NULL);
+    update(budget);
+  }
+  return NULL;
+}
+
+budget_t* budget_start(char* cgroup, hash_t** caches, size_t count,
+                       long interval) {
+  budget_t* budget = calloc(1, sizeof(budget_t));
+  if (budget == NULL) {
+    return NULL;
+  }
+  if (cgroup != NULL) {
+    snprintf(budget->directory, sizeof(budget->directory), "%s", cgroup);
+  }
+  else if (!find_own_cgroup(budget->directory)) {
+    free(budget);
+    return NULL;
+  }
+
+  char text[MAX_FILE];
+  double pressure;
+  budget->shares = malloc(count * sizeof(size_t));
+  if (budget->shares == NULL || interval <= 0 ||
+      !read_file(budget, "memory.pressure", text) ||
+      !budget_parse_pressure(text, &pressure)) {
+    free(budget->shares);
+    free(budget);
+    return NULL;
+  }
+  budget->caches = caches;
+  budget->count = count;
+  budget->interval = interval;
+  budget->max_bytes = 0;
+  for (size_t i = 0; i < count; i++) {
+    budget->shares[i] = get_cache_capacity(caches[i]);
+    budget->max_bytes += budget->shares[i];
+  }
+  budget->bytes = budget->max_bytes;
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, monitor, budget) != 0) {
+    free(budget->shares);
+    free(budget);
+    return NULL;
+  }
+  pthread_detach(tid);
+  return budget;
+}
@@ -0,0 +1,364 @@
+/*
+ * cache-sim.c - Trace-driven offline simulator for the proxy cache.
+ *
+ * Replays a trace of (timestamp, key, size) requests against the real hash.c
+ * and queue.c code, once per cache size of a sweep, and reports the hit ratio,
+ * byte-hit ratio and number of evictions of each size. Objects larger than the
+ * maximum object size are never cached, just like in the proxy.
+ *
+ * With -s, the sweep is instead computed in a single pass from LRU stack
+ * distances: for every request, the number of bytes of distinct objects used
+ * since the previous request for the same key is found with a Fenwick tree
+ * over the trace positions. A request hits in every LRU cache at least that
+ * large (plus the object itself), so one sort of the distances gives the
+ * whole miss ratio curve. This is exact for byte-based LRU, which is what the
+ * cache implements, and takes seconds where replays take one pass per size.
+ *
+ * Traces are either CSV, one "timestamp,key,size" line per request, or (with
+ * -b) packed binary records of a little endian u64 timestamp, u64 key hash and
+ * u32 size. -o converts any trace into the binary format.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "hash.h"
+#include "metrics.h"
+
+/* Same as the proxy's limit on the size of a cached response */
+#define DEFAULT_MAX_OBJECT_SIZE 102400
+
+#define DEFAULT_SIZES "256K,512K,1M,2M,4M,8M,16M,32M,64M"
+#define MAX_SIZES 64
+#define LINE_SIZE 4096
+#define KEY_SIZE 17
+
+/* A packed record of a binary trace */
+typedef struct __attribute__((packed)) record_t {
+  uint64_t timestamp;
+  uint64_t key;
+  uint32_t size;
+} record_t;
+
+/* A trace with its keys hashed and renumbered densely from 0 */
+typedef struct trace_t {
+  uint64_t* timestamps;
+  uint64_t* keys;
+  uint32_t* ids;
+  uint32_t* sizes;
+  size_t length;
+  size_t capacity;
+  size_t distinct;
+} trace_t;
+
+static size_t max_object_size = DEFAULT_MAX_OBJECT_SIZE;
+
+/* 64-bit FNV-1a hash of a key string */
+static uint64_t hash_key(const char* key, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t) key[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void trace_append(trace_t* trace, uint64_t timestamp, uint64_t key,
+                         uint32_t size) {
+  if (trace->length == trace->capacity) {
+    trace->capacity = trace->capacity ? trace->capacity * 2 : 65536;
+    trace->timestamps = realloc(trace->timestamps,
+                                trace->capacity * sizeof(uint64_t));
+    trace->keys = realloc(trace->keys, trace->capacity * sizeof(uint64_t));
+    trace->sizes = realloc(trace->sizes, trace->capacity * sizeof(uint32_t));
+    assert(trace->timestamps && trace->keys && trace->sizes);
+  }
+  trace->timestamps[trace->length] = timestamp;
+  trace->keys[trace->length] = key;
+  trace->sizes[trace->length] = size;
+  trace->length++;
+}
+
+static bool read_csv(FILE* file, trace_t* trace) {
+  char line[LINE_SIZE];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char* first = strchr(line, ',');
+    char* last = strrchr(line, ',');
+    // Skips blank lines and a header line
+    if (first == NULL || first == last || line[0] < '0' || line[0] > '9') {
+      continue;
+    }
+    uint64_t timestamp = strtoull(line, NULL, 10);
+    uint32_t size = strtoul(last + 1, NULL, 10);
+    trace_append(trace, timestamp, hash_key(first + 1, last - first - 1),
+                 size);
+  }
+  return !ferror(file);
+}
+
+static bool read_binary(FILE* file, trace_t* trace) {
+  record_t record;
+  while (fread(&record, sizeof(record), 1, file) == 1) {
+    trace_append(trace, record.timestamp, record.key, record.size);
+  }
+  return !ferror(file);
+}
+
+static bool write_binary(char* path, trace_t* trace) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < trace->length; i++) {
+    record_t record = { trace->timestamps[i], trace->keys[i], trace->sizes[i] };
+    fwrite(&record, sizeof(record), 1, file);
+  }
+  return fclose(file) == 0;
+}
+
+/* Numbers the distinct keys of a trace densely, with an open addressing table */
+static void assign_ids(trace_t* trace) {
+  size_t slots = 1;
+  while (slots < trace->length * 2) {
+    slots <<= 1;
+  }
+  uint64_t* table_keys = calloc(slots, sizeof(uint64_t));
+  uint32_t* table_ids = malloc(slots * sizeof(uint32_t));
+  bool* used = calloc(slots, sizeof(bool));
+  trace->ids = malloc(trace->length * sizeof(uint32_t));
+  assert(table_keys && table_ids && used && trace->ids);
+  trace->distinct = 0;
+  for (size_t i = 0; i < trace->length; i++) {
+    size_t slot = trace->keys[i] & (slots - 1);
+    while (used[slot] && table_keys[slot] != trace->keys[i]) {
+      slot = (slot + 1) & (slots - 1);
+    }
+    if (!used[slot]) {
+      used[slot] = true;
+      table_keys[slot] = trace->keys[i];
+      table_ids[slot] = trace->distinct++;
+    }
+    trace->ids[i] = table_ids[slot];
+  }
+  free(used);
+  free(table_ids);
+  free(table_keys);
+}
+
+/* Parses a size such as "512K" or "4M" */
+static size_t parse_size(char* str) {
+  char* end;
+  size_t size = strtoull(str, &end, 10);
+  switch (*end) {
+    case 'G': case 'g': size <<= 10; /* fall through */
+    case 'M': case 'm': size <<= 10; /* fall through */
+    case 'K': case 'k': size <<= 10;
+  }
+  return size;
+}
+
+static void print_result(size_t capacity, trace_t* trace, uint64_t hits,
+                         uint64_t hit_bytes, uint64_t total_bytes,
+                         long evictions) {
+  printf("%12zu  %9.4f  %9.4f", capacity, (double) hits / trace->length,
+         total_bytes ? (double) hit_bytes / total_bytes : 0.0);
+  if (evictions >= 0) {
+    printf("  %10ld", evictions);
+  }
+  printf("\n");
+}
+
+/* Replays the trace against a real hash_t of the given capacity */
+static void replay(trace_t* trace, size_t capacity, uint8_t* filler) {
+  hash_t* cache = hash_init_with_capacity(capacity);
+  uint64_t evictions = metrics_total(METRIC_EVICTIONS);
+  uint64_t hits = 0, hit_bytes = 0, total_bytes = 0;
+  char key[KEY_SIZE];
+  for (size_t i = 0; i < trace->length; i++) {
+    snprintf(key, sizeof(key), "%016lx", trace->keys[i]);
+    total_bytes += trace->sizes[i];
+    buffer_t* value = get(cache, key);
+    if (value != NULL) {
+      hits++;
+      hit_bytes += trace->sizes[i];
+      buffer_free(value);
+    }
+    else if (trace->sizes[i] < max_object_size) {
+      value = buffer_create(trace->sizes[i]);
+      buffer_append_bytes(value, filler, trace->sizes[i]);
+      insert(cache, key, value);
+    }
+  }
+  print_result(capacity, trace, hits, hit_bytes, total_bytes,
+               metrics_total(METRIC_EVICTIONS) - evictions);
+  hash_free(cache);
+}
+
+/* Reuse distance of one request: the bytes an LRU cache needs to hit it */
+typedef struct distance_t {
+  uint64_t bytes;
+  uint32_t size;
+} distance_t;
+
+static int compare_distance(const void* a, const void* b) {
+  uint64_t x = ((const distance_t*) a)->bytes;
+  uint64_t y = ((const distance_t*) b)->bytes;
+  return x < y ? -1 : x > y;
+}
+
+static void fenwick_add(int64_t* tree, size_t length, size_t index,
+                        int64_t delta) {
+  for (index++; index <= length; index += index & -index) {
+    tree[index - 1] += delta;
+  }
+}
+
+/* Returns the sum of the first count entries */
+static int64_t fenwick_sum(int64_t* tree, size_t count) {
+  int64_t sum = 0;
+  for (; count > 0; count -= count & -count) {
+    sum += tree[count - 1];
+  }
+  return sum;
+}
+
+/* Computes the whole sweep in one pass from LRU stack distances */
+static void stack_distances(trace_t* trace, size_t* capacities,
+                            size_t capacity_count) {
+  // Position of the last request for every key, or SIZE_MAX if none yet
+  size_t* last = malloc(trace->distinct * sizeof(size_t));
+  int64_t* tree = calloc(trace->length, sizeof(int64_t));
+  distance_t* distances = malloc(trace->length * sizeof(distance_t));
+  assert(last && tree && distances);
+  memset(last, 0xff, trace->distinct * sizeof(size_t));
+
+  size_t reuses = 0;
+  uint64_t total_bytes = 0;
+  for (size_t i = 0; i < trace->length; i++) {
+    uint32_t id = trace->ids[i];
+    uint32_t size = trace->sizes[i];
+    total_bytes += size;
+    if (last[id] != SIZE_MAX) {
+      // Bytes of the distinct objects requested since, plus the object
+      uint64_t between = fenwick_sum(tree, i) - fenwick_sum(tree, last[id] + 1);
+      if (size < max_object_size) {
+        distances[reuses].bytes = between + size;
+        distances[reuses].size = size;
+        reuses++;
+      }
+      fenwick_add(tree, trace->length, last[id], -(int64_t) trace->sizes[last[id]]);
+    }
+    // Objects too large to cache never take up room in the stack
+    if (size < max_object_size) {
+      fenwick_add(tree, trace->length, i, size);
+    }
+    last[id] = i;
+  }
+
+  qsort(distances, reuses, sizeof(distance_t), compare_distance);
+  size_t hits = 0;
+  uint64_t hit_bytes = 0;
+  for (size_t c = 0; c < capacity_count; c++) {
+    while (hits < reuses && distances[hits].bytes <= capacities[c]) {
+      hit_bytes += distances[hits].size;
+      hits++;
+    }
+    print_result(capacities[c], trace, hits, hit_bytes, total_bytes, -1);
+  }
+  free(distances);
+  free(tree);
+  free(last);
+}
+
+static int compare_capacity(const void* a, const void* b) {
+  size_t x = *(const size_t*) a, y = *(const size_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+static void usage(char* program) {
+  printf("Usage: %s [options] <trace>\n"
+         "Options:\n"
+         "  -b          the trace is binary instead of CSV\n"
+         "  -s          compute the sweep from stack distances in one pass\n"
+         "  -c <sizes>  comma separated cache sizes (default %s)\n"
+         "  -m <size>   largest object that is cached (default %d)\n"
+         "  -o <file>   also write the trace in binary format to file\n",
+         program, DEFAULT_SIZES, DEFAULT_MAX_OBJECT_SIZE);
+  exit(1);
+}
+
+int main(int argc, char* argv[]) {
+  bool binary = false, stack = false;
+  char sizes[LINE_SIZE] = DEFAULT_SIZES;
+  char* output = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "bsc:m:o:")) != -1) {
+    switch (opt) {
+      case 'b': binary = true; break;
+      case 's': stack = true; break;
+      case 'c': snprintf(sizes, sizeof(sizes), "%s", optarg); break;
+      case 'm': max_object_size = parse_size(optarg); break;
+      case 'o': output = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+
+  size_t capacities[MAX_SIZES];
+  size_t capacity_count = 0;
+  char* saveptr;
+  for (char* size = strtok_r(sizes, ",", &saveptr);
+       size != NULL && capacity_count < MAX_SIZES;
+       size = strtok_r(NULL, ",", &saveptr)) {
+    capacities[capacity_count++] = parse_size(size);
+  }
+  qsort(capacities, capacity_count, sizeof(size_t), compare_capacity);
+
+  FILE* file = fopen(argv[optind], binary ? "rb" : "r");
+  if (file == NULL) {
+    perror("Trace error");
+    return 1;
+  }
+  trace_t trace;
+  memset(&trace, 0, sizeof(trace));
+  bool success = binary ? read_binary(file, &trace) : read_csv(file, &trace);
+  fclose(file);
+  if (!success || trace.length == 0) {
+    printf("Could not read any requests from %s\n", argv[optind]);
+    return 1;
+  }
+  if (output != NULL && !write_binary(output, &trace)) {
+    perror("Output error");
+    return 1;
+  }
+  assign_ids(&trace);
+
+  printf("%zu requests, %zu distinct keys, %.1f s of trace\n", trace.length,
+         trace.distinct,
+         (trace.timestamps[trace.length - 1] - trace.timestamps[0]) / 1.0);
+  printf("%12s  %9s  %9s%s\n", "cache size", "hit ratio", "byte hits",
+         stack ? "" : "   evictions");
+  if (stack) {
+    stack_distances(&trace, capacities, capacity_count);
+  }
+  else {
+    uint8_t* filler = calloc(max_object_size, 1);
+    assert(filler != NULL);
+    for (size_t c = 0; c < capacity_count; c++) {
+      replay(&trace, capacities[c], filler);
+    }
+    free(filler);
+  }
+
+  free(trace.timestamps);
+  free(trace.keys);
+  free(trace.ids);
+  free(trace.sizes);
+}
@@ -0,0 +1,142 @@
+/*
+ * cache_key.c - Canonical cache keys and the keys of response variants.
+ *
+ * Requests that name the same resource in different ways should share one
+ * cache entry. The key of a request is the host, lowercased and without the
+ * default port, followed by the path. Optionally the query parameters are
+ * sorted, so their order does not matter, and tracking parameters (such as
+ * utm_source) that do not change the response are dropped. The request sent
+ * to the origin is never changed; only the key is.
+ *
+ * A response with a Vary header depends on some request headers as well, so
+ * each combination of their values is stored as a variant under a key of its
+ * own: the key of the URL followed by those headers as request header lines.
+ * Such a key carries everything needed to fetch the variant again, which is
+ * what background refreshes do.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache_key.h"
+#include "http.h"
+
+char* cache_key_host(arena_t* arena, char* host) {
+  char* canonical = arena_strdup(arena, host);
+  for (char* c = canonical; *c != '\0'; c++) {
+    *c = tolower(*c);
+  }
+  size_t length = strlen(canonical);
+  if (length > strlen(":80") &&
+      strcmp(canonical + length - strlen(":80"), ":80") == 0) {
+    canonical[length - strlen(":80")] = '\0';
+  }
+  return canonical;
+}
+
+/* Returns whether the query parameter param is named in strip */
+static bool is_stripped(char* param, char* strip) {
+  size_t name_length = strcspn(param, "=");
+  char* name = strip;
+  while (*name != '\0') {
+    size_t length = strcspn(name, ",");
+    if (length > 0 && name[length - 1] == '*') {
+      if (name_length >= length - 1 &&
+          strncmp(param, name, length - 1) == 0) {
+        return true;
+      }
+    }
+    else if (length == name_length && strncmp(param, name, length) == 0) {
+      return true;
+    }
+    name += length;
+    if (*name == ',') {
+      name++;
+    }
+  }
+  return false;
+}
+
+static int compare_params(const void* a, const void* b) {
+  return strcmp(*(char**) a, *(char**) b);
+}
+
+char* cache_key_make(arena_t* arena, char* host, char* path, bool sort_query,
+                     char* strip) {
+  char* canonical = cache_key_host(arena, host);
+  size_t host_length = strlen(canonical);
+  char* key = arena_alloc(arena, host_length + strlen(path) + 1);
+  strcpy(key, canonical);
+  strcpy(key + host_length, path);
+
+  char* query = strchr(key + host_length, '?');
+  if (query == NULL || (!sort_query && strip == NULL)) {
+    return key;
+  }
+
+  // Split the query into its parameters, in place
+  size_t count = 1;
+  for (char* c = query + 1; *c != '\0'; c++) {
+    count += *c == '&';
+  }
+  char* params[count];
+  size_t kept = 0;
+  char* saveptr;
+  for (char* param = strtok_r(query + 1, "&", &saveptr); param != NULL;
+       param = strtok_r(NULL, "&", &saveptr)) {
+    if (strip == NULL || !is_stripped(param, strip)) {
+      params[kept++] = param;
+    }
+  }
+  if (sort_query) {
+    qsort(params, kept, sizeof(char*), compare_params);
+  }
+
+  // Join what is left into a new query; a query left empty is dropped
+  char* result = arena_alloc(arena, strlen(path) + host_length + 1);
+  size_t length = query - key;
+  memcpy(result, key, length);
+  for (size_t i = 0; i < kept; i++) {
+    result[length++] = i == 0 ? '?' : '&';
+    strcpy(result + length, params[i]);
+    length += strlen(params[i]);
+  }
+  result[length] = '\0';
+  return result;
+}
+
+bool cache_key_is_variant(char* key) {
+  return strchr(key, '\r') != NULL;
+}
+
+size_t cache_key_url_length(char* key) {
+  return strcspn(key, "\r");
+}
+
+char* cache_key_variant(arena_t* arena, char* key, char* vary, char* headers) {
+  if (headers == NULL) {
+    headers = key;
+  }
+  size_t url_length = cache_key_url_length(key);
+  char* names = arena_strdup(arena, vary);
+  char* variant = arena_alloc(arena, url_length + strlen("\r\n") +
+                         strlen(vary) * (strlen(": \r\n") + MAX_VARIANT_VALUE)
+                         + MAX_VARIANT_VALUE + 1);
+  memcpy(variant, key, url_length);
+  strcpy(variant + url_length, "\r\n");
+
+  char* saveptr;
+  for (char* name = strtok_r(names, ",", &saveptr); name != NULL;
+       name = strtok_r(NULL, ",", &saveptr)) {
+    char value[MAX_VARIANT_VALUE];
+    if (http_get_header((uint8_t*) headers, strlen(headers), name, value,
+                        sizeof(value))) {
+      strcat(variant, name);
+      strcat(variant, ": ");
+      strcat(variant, value);
+      strcat(variant, "\r\n");
+    }
+  }
+  return variant;
+}
@@ -2,62 +2,544 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <pthread.h>
 
 #include "client_thread.h"
+#include "access_log.h"
+#include "arena.h"
 #include "buffer.h"
+#include "cache_key.h"
+#include "config.h"
+#include "freshness.h"
+#include "front.h"
 #include "hash.h"
+#include "http.h"
+#include "metrics.h"
+#include "origin.h"
+#include "prefetch.h"
+#include "resolver.h"
+#include "rope.h"
 
 #define BUFFER_SIZE 8192
 
-/* Defines the maximum object size for the data buffer*/
-#define MAX_OBJECT_SIZE 102400
+/* How long a connection attempt gets before the next address is tried in
+ * parallel, in milliseconds (RFC 8305 recommends 250) */
+#define CONNECTION_ATTEMPT_DELAY 250
 
-/* Defines a global cache across the program. This cache is initialized in
- * proxy.c.
+/* The most addresses of one host a connection is attempted to */
+#define MAX_CONNECT_ATTEMPTS MAX_RESOLVED_ADDRESSES
+
+/* Longest Range or If-Range header value we look at */
+#define RANGE_HEADER_SIZE 256
+
+/* Most requests of one connection being answered at once; reading further
+ * requests waits until the first of them has been sent */
+#define MAX_PIPELINED_REQUESTS 16
+
+/* Bytes of an answer to a pipelined request that may wait for the answers
+ * to the requests before it */
+#define PIPELINE_BUFFER_SIZE 65536
+
+/* How long a kept-alive client connection may be idle between requests, in
+ * milliseconds */
+#define KEEP_ALIVE_TIMEOUT 15000
+
+/* Largest body without a Content-Length that is held back until its answer
+ * ends, so that it can be sent with one on a kept-alive connection */
+#define MAX_REFRAMED_SIZE (1024 * 1024)
+
+/* Largest error response that is remembered */
+#define MAX_NEGATIVE_SIZE 16384
+
+/* Reads a client's request a buffer at a time rather than a byte at a time.
+ * Bytes read past the line asked for stay in buf for the next line. */
+typedef struct client_reader_t {
+    int fd;
+    uint8_t buf[BUFFER_SIZE];
+    size_t start;
+    size_t end;
+} client_reader_t;
+
+/* The byte range a client asked for with its Range and If-Range headers.
+ * Ranges are answered by the proxy from complete responses, so the origin is
+ * always asked for the whole object, which can then be cached. */
+typedef struct client_range_t {
+    bool requested;
+    char range[RANGE_HEADER_SIZE];
+    // The value of the If-Range header, or "" if there was none
+    char if_range[RANGE_HEADER_SIZE];
+} client_range_t;
+
+/* The slice of a response that is too large to buffer still being sent to
+ * a client that asked for bytes first to last of its body */
+typedef struct range_stream_t {
+    // Whether only the slice is sent, rather than the whole response
+    bool active;
+    // Whether everything the client asked for was sent
+    bool done;
+    // The offset in the body of the next byte read from the server
+    size_t offset;
+    size_t first;
+    size_t last;
+} range_stream_t;
+
+/* An answer to a pipelined request: the end of the socket pair it is written
+ * to, and whether the client wants the connection kept open after it */
+typedef struct pipeline_slot_t {
+    int fd;
+    bool keep_alive;
+} pipeline_slot_t;
+
+/* A client connection with requests being answered, oldest first */
+typedef struct pipeline_t {
+    int client_fd;
+    pipeline_slot_t slots[MAX_PIPELINED_REQUESTS];
+    size_t first;
+    size_t count;
+    // Whether the connection's thread stopped reading requests
+    bool closed;
+    // Whether the relay stopped sending answers, since the connection can
+    // not carry any more
+    bool stopped;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} pipeline_t;
+
+/* Writes an answer on a connection the client keeps open, so that the
+ * client can tell where it ends. The headers are held back until they are
+ * complete, to be marked keep-alive. A body without a Content-Length is held
+ * back until the answer ends, to be sent with one; if it grows too large, it
+ * is sent as it is and the connection ends with it. */
+typedef struct client_framer_t {
+    int fd;
+    // The bytes of the answer held back
+    buffer_t *held;
+    // The length of the headers, or 0 while they are incomplete
+    size_t header_length;
+    // Whether the headers were sent, and whether the body has a known length
+    // then, of which remaining bytes are still to be sent
+    bool head_sent;
+    bool framed;
+    size_t remaining;
+    // Whether a write to the client failed
+    bool failed;
+} client_framer_t;
+
+/* A pipelined request handed to its own thread */
+typedef struct pipelined_request_t {
+    int fd;
+    buffer_t *head;
+    struct proxy_shard_t *shard;
+} pipelined_request_t;
+
+/* The resources of a cached page being prefetched. Up to
+ * config.prefetch_concurrency threads take the paths in turn, until they run
+ * out of paths or the page's budget, and the last of them frees it. */
+typedef struct prefetch_t {
+    struct proxy_shard_t *shard;
+    char *host;
+    char *paths[MAX_PREFETCH_LINKS];
+    size_t count;
+    // The next path to take
+    size_t next;
+    // Bytes fetched for the page so far
+    size_t bytes;
+    // Threads still working on the page
+    size_t threads;
+} prefetch_t;
+
+/* A cached entry that is being refreshed in the background */
+typedef struct refresh_t {
+    struct proxy_shard_t *shard;
+    char *host;
+    char *path;
+    char *key;
+    freshness_t meta;
+    struct refresh_t *next;
+} refresh_t;
+
+/* The warm-up of the caches from a list of URLs (see start_warm_up).
+ * config.warm_up_concurrency threads take the URLs in turn, until they run
+ * out of URLs or of budget. Every URL is fetched once, through the shards in
+ * turn, and copied into the caches of the other shards, since any of them
+ * may be asked for it. */
+typedef struct warm_up_t {
+    char **urls;
+    size_t count;
+    proxy_shard_t **shards;
+    size_t shard_count;
+    // The next URL to take
+    size_t next;
+    // URLs that are done, and those of them that were fetched (or were
+    // cached already)
+    size_t done;
+    size_t fetched;
+    // Bytes fetched so far
+    size_t bytes;
+    // Threads still warming up
+    size_t threads;
+} warm_up_t;
+
+struct proxy_shard_t {
+    hash_t *cache;
+    // Answers to requests to origins that failed, keyed by host, and error
+    // responses, keyed like the cache, for the negative TTL
+    hash_t *negative;
+    // Origins with requests in flight from this shard, and how many each may
+    // have
+    origin_table_t *origins;
+    size_t origin_concurrency;
+    // Lets fetches from any origin through, favoring clients
+    admission_t *admission;
+    // Resolves the host names of the origins
+    resolver_t *resolver;
+    // The CPU the shard's threads are pinned to, or -1
+    int cpu;
+    // Entries currently being refreshed, so that a stale entry that is
+    // requested many times is only fetched once
+    refresh_t *refreshing;
+    pthread_mutex_t refreshing_lock;
+    struct proxy_shard_t *next;
+};
+
+/* Every shard, so the admin pages can report on all of them. Shards are only
+ * created before the proxy starts accepting connections. */
+static proxy_shard_t *shards = NULL;
+
+/* Threads prefetching resources, across all shards */
+static size_t prefetchers = 0;
+
+/* The warm-up of the caches, or NULL if there is none */
+static warm_up_t *warm_up = NULL;
+
+/* Bytes the current thread has read from origins */
+static __thread size_t bytes_fetched = 0;
+
+/* Whether the current thread is prefetching, in which case the pages it
+ * fetches are not scanned for more resources */
+static __thread bool prefetching = false;
+
+static void start_prefetch(char *key, buffer_t *data);
+
+/* The framer of the answer the current thread is writing to a kept-alive
+ * connection, or NULL if its answer ends with the connection */
+static __thread client_framer_t *answer_framer = NULL;
+
+static bool framer_write(client_framer_t *framer, uint8_t *bytes,
+                         size_t length);
+
+/* The access log record of the request the current thread is answering,
+ * filled in as it goes. Its time is 0 when there is none. */
+static __thread access_record_t access_record;
+
+/* The shard of the connection the current thread is handling. Connections
+ * accepted on different listeners may be served by different shards (see
+ * the per-core mode in proxy.c), so every thread sets this when it starts.
  */
-extern hash_t* cache;
+static __thread proxy_shard_t *shard;
 
-static int open_client_fd(char *hostname, int port, int *err) {
-    int client_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_fd < 0) {
+/* The transient allocations of the request the current thread is handling
+ * (see arena.c), all freed once it is answered. Created on first use and
+ * freed when the thread exits. */
+static __thread arena_t *arena = NULL;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void free_arena(void *thread_arena) {
+    arena_free(thread_arena);
+}
+
+static void create_arena_key(void) {
+    pthread_key_create(&arena_key, free_arena);
+}
+
+/* Returns the arena of the current thread */
+static arena_t *request_arena(void) {
+    if (arena == NULL) {
+        pthread_once(&arena_key_once, create_arena_key);
+        arena = arena_create();
+        pthread_setspecific(arena_key, arena);
+    }
+    return arena;
+}
+
+/* Returns the microseconds since start, as returned by metrics_now */
+static uint32_t micros_since(uint64_t start) {
+    return (metrics_now() - start) / 1000;
+}
+
+/* Starts the access log record of a request for key */
+static void begin_access(char *key) {
+    memset(&access_record, 0, sizeof(access_record));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    access_record.time = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    strncpy(access_record.key, key, sizeof(access_record.key));
+}
+
+/* Adds length bytes sent to the client to the access log record, taking the
+ * status from them if they start the response */
+static void record_sent(uint8_t *bytes, size_t length) {
+    access_record.bytes += length;
+    if (access_record.status == 0) {
+        int status = http_status_code(bytes, length);
+        access_record.status = status > 0 ? status : 0;
+    }
+}
+
+/* Queues the access log record of the request the current thread answered,
+ * which arrived at start, if it has one */
+static void finish_access(uint64_t start) {
+    if (access_record.time == 0) {
+        return;
+    }
+    access_record.total_us = micros_since(start);
+    access_log_write(&access_record);
+    access_record.time = 0;
+}
+
+/* Sets the receive (SO_RCVTIMEO) or send (SO_SNDTIMEO) timeout of a socket.
+ * A timeout of 0 means blocking forever. */
+static void set_timeout(int fd, int option, long milliseconds) {
+    struct timeval timeout = {
+        milliseconds / 1000, (milliseconds % 1000) * 1000
+    };
+    setsockopt(fd, SOL_SOCKET, option, &timeout, sizeof(timeout));
+}
+
+/* Starts a non-blocking connect to the address at index of addresses.
+ * Returns the socket, which may still be connecting, or -1 with errno set if
+ * the attempt failed at once. */
+static int start_connect(resolved_t *addresses, size_t index) {
+    struct sockaddr *address = (struct sockaddr *) &addresses->addresses[index];
+    int fd = socket(address->sa_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+        (connect(fd, address, addresses->lengths[index]) < 0 &&
+         errno != EINPROGRESS)) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+/* Orders the resolved addresses as RFC 8305 section 4 asks, alternating
+ * between address families starting with the first one returned. Fills
+ * ordered with the indices of at most MAX_CONNECT_ATTEMPTS addresses and
+ * returns how many. */
+static size_t interleave_addresses(resolved_t *addresses, size_t *ordered) {
+    size_t first[MAX_CONNECT_ATTEMPTS], other[MAX_CONNECT_ATTEMPTS];
+    size_t first_count = 0, other_count = 0;
+    for (size_t i = 0; i < addresses->count; i++) {
+        if (addresses->addresses[i].ss_family ==
+            addresses->addresses[0].ss_family) {
+            if (first_count < MAX_CONNECT_ATTEMPTS) {
+                first[first_count++] = i;
+            }
+        }
+        else if (other_count < MAX_CONNECT_ATTEMPTS) {
+            other[other_count++] = i;
+        }
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; count < MAX_CONNECT_ATTEMPTS &&
+                       (i < first_count || i < other_count); i++) {
+        if (i < first_count) {
+            ordered[count++] = first[i];
+        }
+        if (i < other_count && count < MAX_CONNECT_ATTEMPTS) {
+            ordered[count++] = other[i];
+        }
+    }
+    return count;
+}
+
+/* Connects to one of the resolved addresses the way RFC 8305 describes:
+ * a new attempt starts every CONNECTION_ATTEMPT_DELAY ms, or as soon as any
+ * attempt fails, while earlier attempts keep going; the first one to
+ * complete wins and the others are closed. Gives up after the connect
+ * timeout. Returns a blocking socket, or -1 with errno set to ETIMEDOUT if
+ * the origin took too long or to the last error seen otherwise. */
+static int connect_happy_eyeballs(resolved_t *addresses) {
+    size_t ordered[MAX_CONNECT_ATTEMPTS];
+    size_t count = interleave_addresses(addresses, ordered);
+    struct pollfd pending[MAX_CONNECT_ATTEMPTS];
+    size_t pending_count = 0, next = 0;
+    int error = ECONNREFUSED;
+    int winner = -1;
+    uint64_t start = metrics_now();
+    uint64_t deadline = start + (uint64_t) config.connect_timeout * 1000000;
+
+    bool start_next = true;
+    while (winner < 0 && (next < count || pending_count > 0)) {
+        /* Start the next attempt when it is due or an attempt just failed */
+        if (start_next && next < count) {
+            start_next = false;
+            int fd = start_connect(addresses, ordered[next++]);
+            if (fd < 0) {
+                error = errno;
+                start_next = true;
+                continue;
+            }
+            pending[pending_count++] = (struct pollfd) {
+                .fd = fd, .events = POLLOUT
+            };
+        }
+        if (pending_count == 0) {
+            continue;
+        }
+
+        /* Wait for an attempt to finish, for the next attempt to be due or
+         * for the connect timeout, whichever comes first */
+        int wait = next < count ? CONNECTION_ATTEMPT_DELAY : -1;
+        if (config.connect_timeout > 0) {
+            uint64_t now = metrics_now();
+            if (now >= deadline) {
+                error = ETIMEDOUT;
+                break;
+            }
+            int remaining = (deadline - now + 999999) / 1000000;
+            if (wait < 0 || remaining < wait) {
+                wait = remaining;
+            }
+        }
+        int ready = poll(pending, pending_count, wait);
+        if (ready < 0) {
+            error = errno;
+            break;
+        }
+        if (ready == 0) {
+            start_next = true;
+            continue;
+        }
+
+        /* Keep the first attempt that connected, drop those that failed */
+        for (size_t i = 0; i < pending_count; ) {
+            if (pending[i].revents == 0) {
+                i++;
+                continue;
+            }
+            int result;
+            socklen_t length = sizeof(result);
+            if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR,
+                           &result, &length) < 0) {
+                result = errno;
+            }
+            if (result == 0 && winner < 0) {
+                winner = pending[i].fd;
+            }
+            else {
+                if (result != 0) {
+                    error = result;
+                    start_next = true;
+                }
+                close(pending[i].fd);
+            }
+            pending[i] = pending[--pending_count];
+        }
+    }
+
+    /* Cancel the attempts that lost */
+    for (size_t i = 0; i < pending_count; i++) {
+        close(pending[i].fd);
+    }
+    metrics_record_since(METRIC_UPSTREAM_CONNECT, start);
+    if (winner < 0) {
+        errno = error;
+        return -1;
+    }
+    int flags = fcntl(winner, F_GETFL);
+    if (flags < 0 || fcntl(winner, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        error = errno;
+        close(winner);
+        errno = error;
         return -1;
     }
+    return winner;
+}
 
-    /* Fill in the server's IP address and port */
-    struct addrinfo *address;
-    char port_str[sizeof("65535")];
-    sprintf(port_str, "%d", port);
-    *err = getaddrinfo(hostname, port_str, NULL, &address);
+static int open_client_fd(char *hostname, int port, int *err) {
+    /* Resolve every address of the server, of either family, on the
+     * shard's resolver threads */
+    resolved_t addresses;
+    uint64_t start = metrics_now();
+    *err = resolver_lookup(shard->resolver, hostname, port, &addresses);
+    metrics_record_since(METRIC_UPSTREAM_DNS, start);
     if (*err != 0) {
         return -2;
     }
 
     /* Establish a connection with the server */
-    bool success = connect(client_fd, address->ai_addr, address->ai_addrlen) >= 0;
-    freeaddrinfo(address);
-    return success ? client_fd : -1;
+    int client_fd = connect_happy_eyeballs(&addresses);
+    access_record.connect_us = micros_since(start);
+    if (client_fd < 0) {
+        return -1;
+    }
+
+    /* Until the response starts, reads wait for the first byte timeout */
+    set_timeout(client_fd, SO_RCVTIMEO, config.first_byte_timeout);
+    set_timeout(client_fd, SO_SNDTIMEO, config.idle_timeout);
+    return client_fd;
 }
 
-/* Writes a string to a file descriptor, returns whether successful */
-static bool write_string(int fd, char *str) {
-    return write(fd, str, strlen(str)) >= 0;
+/* Writes all of length bytes to a file descriptor, returns whether
+ * successful */
+static bool write_bytes(int fd, uint8_t *bytes, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            return false;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return true;
 }
 
-/* Sends a status message to client with the status line specified by
- * status with a message body described by msg.
- * Returns whether successful */
-static bool send_status_code(int client_fd, char *status, char *msg) {
+/* Writes all of a buffer to a file descriptor, returns whether successful */
+static bool write_buffer(int fd, buffer_t *buf) {
+    return write_bytes(fd, buffer_data(buf), buffer_length(buf));
+}
+
+/* Writes bytes of the answer to the current request to the client, through
+ * the framer of its connection if it is kept alive. Returns whether
+ * successful */
+static bool send_bytes(int client_fd, uint8_t *bytes, size_t length) {
+    if (answer_framer != NULL && answer_framer->fd == client_fd) {
+        return framer_write(answer_framer, bytes, length);
+    }
+    return write_bytes(client_fd, bytes, length);
+}
+
+/* Appends a string to a buffer */
+static void append_string(buffer_t *buf, char *str) {
+    buffer_append_bytes(buf, (uint8_t *) str, strlen(str));
+}
+
+/* Returns a new buffer with a status message with the status line specified
+ * by status with a message body described by msg */
+static buffer_t *status_response(char *status, char *msg) {
     char *format =
         "HTTP/1.0 %s\r\n"
         "Content-Type: text/html\r\n"
@@ -68,15 +550,97 @@ static bool send_status_code(int client_fd, char *status, char *msg) {
             "<body>%s</body>"
         "</html>";
 
-    /* Fill out the response template and send it to the client */
+    /* Fill out the response template */
     char response[strlen(format) + 2 * strlen(status) + strlen(msg)];
     sprintf(response, format, status, status, msg);
-    return write_string(client_fd, response);
+    buffer_t *buf = buffer_create(sizeof(response));
+    append_string(buf, response);
+    return buf;
+}
+
+/* Sends a status message to client with the status line specified by
+ * status with a message body described by msg.
+ * Returns whether successful */
+static bool send_status_code(int client_fd, char *status, char *msg) {
+    buffer_t *response = status_response(status, msg);
+    record_sent(buffer_data(response), buffer_length(response));
+    bool success = send_bytes(client_fd, buffer_data(response),
+                              buffer_length(response));
+    buffer_free(response);
+    return success;
+}
+
+/* Remembers the answer to a request that failed (or a response with an error
+ * status) under key for the negative TTL, so that the same request is
+ * answered with it instead of failing again. Takes ownership of response. */
+static void remember_failure(char *key, buffer_t *response) {
+    if (config.negative_ttl <= 0) {
+        buffer_free(response);
+        return;
+    }
+    freshness_t meta;
+    memset(&meta, 0, sizeof(meta));
+    meta.stored_at = time(NULL);
+    meta.lifetime = config.negative_ttl;
+    meta.expires_at = meta.stored_at + config.negative_ttl;
+    meta.stale_while_revalidate = -1;
+    meta.stale_if_error = -1;
+    meta.must_revalidate = true;
+    insert_with_meta(shard->negative, key, response, &meta);
+}
+
+/* Returns the remembered answer for key, or NULL if there is none or it
+ * expired */
+static buffer_t *recall_failure(char *key) {
+    if (config.negative_ttl <= 0) {
+        return NULL;
+    }
+    freshness_t meta;
+    buffer_t *response = get_with_meta(shard->negative, key, &meta);
+    if (response != NULL && !freshness_is_fresh(&meta, time(NULL))) {
+        buffer_free(response);
+        return NULL;
+    }
+    return response;
+}
+
+/* Tells the client (if there is one) that the origin host could not be
+ * reached and remembers the answer under host, for the requests to host that
+ * come before it could have recovered */
+static void send_origin_failure(int client_fd, char *host, char *status,
+                                char *msg) {
+    buffer_t *response = status_response(status, msg);
+    if (client_fd >= 0) {
+        record_sent(buffer_data(response), buffer_length(response));
+        send_bytes(client_fd, buffer_data(response), buffer_length(response));
+    }
+    remember_failure(host, response);
+}
+
+/* Returns whether responses with status are remembered */
+static bool is_negative_status(int status) {
+    if (status < 100) {
+        return false;
+    }
+    for (char *curr = config.negative_statuses; curr != NULL;
+         curr = strchr(curr, ',')) {
+        if (*curr == ',') {
+            curr++;
+        }
+        if (atoi(curr) == status) {
+            return true;
+        }
+    }
+    return false;
 }
 
 /* Opens connection to full_host and returns the file descriptor or
- * returns -1 on error */
+ * returns -1 on error. Errors are reported to the client unless client_fd is
+ * -1. */
 static int open_server_connection(int client_fd, char *full_host) {
+    /* Failures are remembered under the host and port */
+    char host[strlen(full_host) + 1];
+    strcpy(host, full_host);
     int port;
     char *port_str = strchr(full_host, ':');
     if (port_str == NULL) {
@@ -97,6 +661,20 @@ static int open_server_connection(int client_fd, char *full_host) {
     int server_fd = open_client_fd(full_host, port, &server_error);
     if (server_fd == -1) {
         verbose_printf("open_client_fd error: %s\n", strerror(errno));
+        if (errno == ETIMEDOUT) {
+            metrics_add(METRIC_UPSTREAM_TIMEOUTS, 1);
+            send_status_code(client_fd, "504 Gateway Timeout",
+                "Connecting to the origin server timed out.");
+        }
+        else if (errno == ECONNREFUSED || errno == EHOSTUNREACH ||
+                 errno == ENETUNREACH) {
+            send_origin_failure(client_fd, host, "502 Bad Gateway",
+                "Could not connect to the origin server.");
+        }
+        else {
+            send_status_code(client_fd, "502 Bad Gateway",
+                "Could not connect to the origin server.");
+        }
         return -1;
     }
     if (server_fd == -2) {
@@ -105,82 +683,142 @@ static int open_server_connection(int client_fd, char *full_host) {
             case EAI_NONAME:
                 /* Don't bother checking exit code, since we are returning error
                  * afterwards anyway */
-                send_status_code(client_fd, "502 Bad Gateway",
+                send_origin_failure(client_fd, host, "502 Bad Gateway",
                     "DNS could not resolve address.");
                 return -1;
             case EAI_AGAIN:
                 /* Don't bother checking exit code, since we are returning error
                  * afterwards anyway */
-                send_status_code(client_fd, "502 Bad Gateway",
+                send_origin_failure(client_fd, host, "502 Bad Gateway",
                     "DNS temporarily could not resolve address.");
                 return -1;
             case EAI_NODATA:
                 /* Don't bother checking exit code, since we are returning error
                  * afterwards anyway */
-                send_status_code(client_fd, "502 Bad Gateway",
+                send_origin_failure(client_fd, host, "502 Bad Gateway",
                     "DNS could has no network addresses for host.");
                 return -1;
         }
         verbose_printf("getaddrinfo error: %s\n", gai_strerror(server_error));
+        send_origin_failure(client_fd, host, "502 Bad Gateway",
+            "DNS could not resolve address.");
         return -1;
     }
 
     return server_fd;
 }
 
-/* Send get request to server, returns whether successful */
-static bool send_get_header(int server_fd, char *path) {
-    return write_string(server_fd, "GET ") &&
-        write_string(server_fd, path) &&
-        write_string(server_fd, " HTTP/1.0\r\n");
+/* Adds the request line of a GET request for path to the request for the
+ * server. The request is built up in one buffer and written to the server at
+ * once, rather than one write per header line. */
+static void add_get_header(buffer_t *request, char *path) {
+    append_string(request, "GET ");
+    append_string(request, path);
+    append_string(request, " HTTP/1.0\r\n");
 }
 
-/* Reads a line from fd until a \r\n is reached.  Returns an allocated
- * buffer that must be freed by the user containing the line read in upon
- * success.  Returns NULL on error. */
-static buffer_t *read_full_line(int fd) {
-    buffer_t *line = buffer_create(BUFFER_SIZE);
+/* Adds the validators of a stale cached response to the request, so the
+ * server can answer with 304 Not Modified instead of the full response */
+static void add_conditional_headers(buffer_t *request, freshness_t *meta) {
+    if (meta->etag[0] != '\0') {
+        append_string(request, "If-None-Match: ");
+        append_string(request, meta->etag);
+        append_string(request, "\r\n");
+    }
+    if (meta->last_modified > 0) {
+        char date[HTTP_DATE_SIZE];
+        http_format_date(meta->last_modified, date);
+        append_string(request, "If-Modified-Since: ");
+        append_string(request, date);
+        append_string(request, "\r\n");
+    }
+}
+
+static void reader_init(client_reader_t *reader, int fd) {
+    reader->fd = fd;
+    reader->start = 0;
+    reader->end = 0;
+}
 
+/* Reads a line from the client until a \r\n is reached and appends it to
+ * line.  Returns whether successful. */
+static bool read_full_line(client_reader_t *reader, buffer_t *line) {
     /* Read until we reach \r\n */
     char c = '\0', last_c;
     do {
-        last_c = c;
-        ssize_t chars_read = read(fd, &c, sizeof(c));
-        if (chars_read <= 0) {
-            if (chars_read < 0) {
-                /* Error occurred */
-                verbose_printf("Read error: %s\n", strerror(errno));
+        if (reader->start == reader->end) {
+            ssize_t chars_read = read(reader->fd, reader->buf,
+                                      sizeof(reader->buf));
+            if (chars_read <= 0) {
+                if (chars_read < 0) {
+                    /* Error occurred */
+                    verbose_printf("Read error: %s\n", strerror(errno));
+                }
+                return false;
             }
-            buffer_free(line);
-            return NULL;
+            reader->start = 0;
+            reader->end = chars_read;
         }
 
-        buffer_append_char(line, c);
+        /* Take everything up to the next \n that is already buffered */
+        uint8_t *bytes = reader->buf + reader->start;
+        size_t available = reader->end - reader->start;
+        uint8_t *newline = memchr(bytes, '\n', available);
+        size_t length = newline != NULL ? (size_t) (newline - bytes) + 1 :
+            available;
+        last_c = length > 1 ? bytes[length - 2] : c;
+        c = bytes[length - 1];
+        buffer_append_bytes(line, bytes, length);
+        reader->start += length;
     } while (!(last_c == '\r' && c == '\n'));
 
-    return line;
+    return true;
+}
+
+/* Reads the request line and the headers of a client's request, up to and
+ * including the empty line that ends them.  Returns an allocated buffer that
+ * must be freed by the user upon success.  Returns NULL on error. */
+static buffer_t *read_request_head(client_reader_t *reader) {
+    buffer_t *head = buffer_create(BUFFER_SIZE);
+    size_t line_start;
+    do {
+        line_start = buffer_length(head);
+        if (!read_full_line(reader, head)) {
+            buffer_free(head);
+            return NULL;
+        }
+    } while (line_start == 0 || buffer_length(head) - line_start != 2);
+    buffer_string(head);
+    return head;
 }
 
 static bool starts_with(char *str, char *prefix) {
     return strncmp(str, prefix, strlen(prefix)) == 0;
 }
 
-/* Produces a GET header from client's GET header
+/* Produces a GET header from client's GET header, the first line of head
+ * (NULL if the request could not be read)
  * Sets *full_host to the 'host:port' string specified in the GET
  * Sets *path to the part of the GET request after the port, excluding
  * the leading /
- * *full_host and *path must be freed by the user if function returns 0.
+ * *full_host and *path are allocated from the arena of the request.
+ * A request for a path on the proxy itself (such as "GET /metrics") sets
+ * *full_host to NULL and *path to that path.
  * Returns whether successful. */
-static bool make_get_header(int client_fd, char **full_host, char **path) {
+static bool make_get_header(int client_fd, buffer_t *head, char **full_host,
+                            char **path) {
     *full_host = NULL;
     *path = NULL;
 
-    /* Read the first line (with the GET request) separately */
-    buffer_t *buf = read_full_line(client_fd);
-    if (buf == NULL) {
+    /* Parse a copy of the first line (with the GET request) */
+    char *data = NULL;
+    if (head == NULL) {
         verbose_printf("No request string\n");
         goto MALFORMED_ERROR;
     }
+    char *line_end = strchr(buffer_string(head), '\n');
+    data = arena_strndup(request_arena(), buffer_string(head),
+                         line_end - buffer_string(head) + 1);
 
     /* Parse first line.  We are expecting one of a few cases:
      * GET http://<HOST>/[<PATH>[/]] HTTP/..
@@ -191,9 +829,7 @@ static bool make_get_header(int client_fd, char **full_host, char **path) {
      */
 
     char *saveptr; // A context pointer to be passed in to strtok_r
-    char *data = buffer_string(buf);
     char *prefix  = strtok_r(data, " ", &saveptr);
-    sleep(1);
     char *url     = strtok_r(NULL, " ", &saveptr);
     char *version = strtok_r(NULL, " ", &saveptr);
 
@@ -212,6 +848,11 @@ static bool make_get_header(int client_fd, char **full_host, char **path) {
                " GET request should be an HTTP version\n");
         goto MALFORMED_ERROR;
     }
+    if (url[0] == '/') {
+        /* Request addressed to the proxy itself */
+        *path = url;
+        return true;
+    }
     if (!starts_with(url, "http://")) {
         verbose_printf("Malformed request string: The URL of the request"
                " should start with 'http://'\n");
@@ -219,22 +860,17 @@ static bool make_get_header(int client_fd, char **full_host, char **path) {
     }
 
     char *host = url + strlen("http://");
-    /* Allocate path separately so we can free line buffer.
+    /* Copy the path, since the host is cut off where it starts.
      * The path starts at the first '/' in the URL.
      * If there is no '/' (e.g. "http://ucla.edu"), the path is just "/". */
     char *path_start = strchr(host, '/');
-    *path = strdup(path_start == NULL ? "/" : path_start);
-    assert(*path != NULL);
-
-    /* Copy host, so that we have a separate copy for later */
+    *path = arena_strdup(request_arena(),
+                         path_start == NULL ? "/" : path_start);
     if (path_start != NULL) {
         *path_start = '\0';
     }
-    *full_host = strdup(host);
-    assert(*full_host != NULL);
-    printf("Handling Request: %s%s\n", *full_host, *path);
-
-    buffer_free(buf);
+    *full_host = host;
+    verbose_printf("Handling Request: %s%s\n", *full_host, *path);
     return true;
 
     MALFORMED_ERROR:
@@ -252,43 +888,51 @@ static bool make_get_header(int client_fd, char **full_host, char **path) {
         goto ERROR;
 
     ERROR:
-        buffer_free(buf);
-        free(*path);
-        free(*full_host);
+        *path = NULL;
+        *full_host = NULL;
         return false;
 }
 
-/* To be called after make_get_header.  Reads the remaining headers from
- * clientfd and sends them to serverfd after modification as follows:
+/* To be called after make_get_header.  Adds the remaining headers of the
+ * client's request head to the request for the server after modification as
+ * follows:
  *
  * All Keep-Alive headers are dropped
+ * Range and If-Range headers are dropped, since we fetch whole objects and
+ * answer ranges ourselves
  * Connection headers have their value replaced with 'close'
  * Proxy-Connection headers have their value replaced with 'close'
  * If a Host header is not found, a Host header is added
- *
- * Returns whether successful
-*/
-static bool filter_rest_headers(int client_fd, int server_fd, char *host) {
+ * If holding_stale, the client's own conditional headers are dropped, since
+ * the answer has to be about our stale copy and not the client's
+ */
+static void filter_rest_headers(buffer_t *head, buffer_t *request,
+                                char *host, bool holding_stale) {
     bool sent_host_header = false, sent_connection_header = false;
+    char *next = strchr(buffer_string(head), '\n') + 1;
     while (true) {
-        buffer_t *buf = read_full_line(client_fd);
-
-        /* read_full_line() errored out */
-        if (buf == NULL) {
-            verbose_printf("Malformed header: Not terminated by new line\n");
-            return false;
-        }
+        char *line = next;
+        char *line_end = strchr(line, '\n') + 1;
+        next = line_end;
 
-        char *line = buffer_string(buf);
         /* Detect end of header (make sure we sent host line) */
-        if (strcmp(line, "\r\n") == 0) {
-            buffer_free(buf);
+        if (starts_with(line, "\r\n")) {
             break;
         }
 
         /* Remove Keep-Alive line */
         if (starts_with(line, "Keep-Alive:")) {
-            buffer_free(buf);
+            continue;
+        }
+
+        /* Remove ranges, which we answer from the whole object */
+        if (starts_with(line, "Range:") || starts_with(line, "If-Range:")) {
+            continue;
+        }
+
+        /* Remove conditionals that would conflict with our own */
+        if (holding_stale && (starts_with(line, "If-None-Match:") ||
+                             starts_with(line, "If-Modified-Since:"))) {
             continue;
         }
 
@@ -299,151 +943,1482 @@ static bool filter_rest_headers(int client_fd, int server_fd, char *host) {
         /* Connection: * -> Connection: close */
         else if (starts_with(line, "Connection:")) {
             line = "Connection: close\r\n";
+            line_end = line + strlen(line);
             sent_connection_header = 1;
         }
         /* Proxy-Connection: * -> Proxy-Connection: close */
         else if (starts_with(line, "Proxy-Connection:")) {
             line = "Proxy-Connection: close\r\n";
+            line_end = line + strlen(line);
         }
 
-        /* Send line to server */
-        bool success = write_string(server_fd, line);
-        buffer_free(buf);
-        if (!success) {
-            return false;
-        }
+        /* Add line to the request */
+        buffer_append_bytes(request, (uint8_t *) line, line_end - line);
     }
 
-    /* Done sending headers. Make sure the necessary headers were sent */
+    /* Done adding headers. Make sure the necessary headers were added */
     if (!sent_host_header) {
-        bool success = write_string(server_fd, "Host: ") &&
-            write_string(server_fd, host) &&
-            write_string(server_fd, "\r\n");
-        if (!success) {
-            return false;
-        }
+        append_string(request, "Host: ");
+        append_string(request, host);
+        append_string(request, "\r\n");
     }
     if (!sent_connection_header) {
-        if (!write_string(server_fd, "Connection: close\r\n")) {
+        append_string(request, "Connection: close\r\n");
+    }
+    append_string(request, "\r\n");
+}
+
+/* Stores a complete response in the cache under key if it is small enough
+ * and its headers allow it, or remembers it for the negative TTL if it has
+ * one of the configured error statuses. A response with a Vary header is
+ * stored as the variant selected by head (the client's request head, or NULL
+ * if key is a variant key already), and the key of its URL keeps the Vary
+ * header so later requests can find their variant. Takes ownership of data. */
+static void cache_response(char *key, buffer_t *head, buffer_t *data) {
+    freshness_t meta;
+    char cache_control[BUFFER_SIZE];
+    if (buffer_length(data) < MAX_OBJECT_SIZE &&
+        freshness_parse(buffer_data(data), buffer_length(data), time(NULL),
+                        &meta)) {
+        if (config.prefetch_concurrency > 0 && !prefetching) {
+            start_prefetch(key, data);
+        }
+        char *url = arena_strndup(request_arena(), key,
+                                  cache_key_url_length(key));
+        if (meta.vary[0] != '\0') {
+            char *variant = cache_key_variant(request_arena(), key, meta.vary,
+                head != NULL ? buffer_string(head) : NULL);
+            insert_with_meta(shard->cache, variant, data, &meta);
+            insert_with_meta(shard->cache, url, buffer_create(1), &meta);
+        }
+        else {
+            /* The origin may have stopped varying the response */
+            insert_with_meta(shard->cache, url, data, &meta);
+        }
+    }
+    else if (buffer_length(data) < MAX_NEGATIVE_SIZE &&
+             is_negative_status(http_status_code(buffer_data(data),
+                                                 buffer_length(data))) &&
+             !(http_get_header(buffer_data(data), buffer_length(data),
+                               "Cache-Control", cache_control,
+                               sizeof(cache_control)) &&
+               strcasestr(cache_control, "no-store") != NULL)) {
+        remember_failure(key, data);
+    }
+    else {
+        buffer_free(data);
+    }
+}
+
+/* Reads from the server. *request_sent is the time the request was sent
+ * until the first byte of the response arrives; the first read records the
+ * time to first byte, swaps the first byte timeout for the idle timeout and
+ * clears *request_sent. A read that times out fails with errno set to
+ * ETIMEDOUT. */
+static ssize_t read_server(int server_fd, uint8_t *buf, size_t size,
+                           uint64_t *request_sent) {
+    ssize_t bytes_read = read(server_fd, buf, size);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        metrics_add(METRIC_UPSTREAM_TIMEOUTS, 1);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (*request_sent != 0) {
+        metrics_record_since(METRIC_UPSTREAM_TTFB, *request_sent);
+        access_record.ttfb_us = micros_since(*request_sent);
+        set_timeout(server_fd, SO_RCVTIMEO, config.idle_timeout);
+        *request_sent = 0;
+    }
+    if (bytes_read > 0) {
+        metrics_add(METRIC_BYTES_FETCHED, bytes_read);
+        bytes_fetched += bytes_read;
+    }
+    return bytes_read;
+}
+
+/* Reads from server_fd into data until the whole header block has arrived.
+ * Returns whether successful */
+static bool read_response_headers(int server_fd, buffer_t *data,
+                                  uint64_t *request_sent) {
+    while (http_header_end(buffer_data(data), buffer_length(data)) == 0) {
+        uint8_t buf[BUFFER_SIZE];
+        ssize_t bytes_read = read_server(server_fd, buf, sizeof(buf),
+                                         request_sent);
+        if (bytes_read <= 0) {
             return false;
         }
+        buffer_append_bytes(data, buf, bytes_read);
+    }
+    return true;
+}
+
+/* Writes bytes to the client, if there is one. Returns whether successful */
+static bool write_client(int client_fd, uint8_t *bytes, size_t length) {
+    if (client_fd < 0) {
+        return true;
+    }
+    metrics_add(METRIC_BYTES_SERVED, length);
+    record_sent(bytes, length);
+    return send_bytes(client_fd, bytes, length);
+}
+
+/* Tells the client that the origin timed out, if nothing was sent yet */
+static void send_timeout(int client_fd, bool forwarded) {
+    if (client_fd >= 0 && !forwarded && errno == ETIMEDOUT) {
+        send_status_code(client_fd, "504 Gateway Timeout",
+            "The origin server did not respond in time.");
+    }
+}
+
+/* Fills in the byte range asked for by the client's request head */
+static void read_client_range(buffer_t *head, client_range_t *range) {
+    range->requested = http_get_header(buffer_data(head), buffer_length(head),
+                                       "Range", range->range,
+                                       sizeof(range->range));
+    if (!http_get_header(buffer_data(head), buffer_length(head), "If-Range",
+                         range->if_range, sizeof(range->if_range))) {
+        range->if_range[0] = '\0';
+    }
+}
+
+/* Works out which bytes of a response with header_length bytes of headers
+ * and a body of total bytes the client asked for. Only 200 responses whose
+ * validator matches the client's If-Range (if any) are sent in part. */
+static http_range_t resolve_range(client_range_t *range, uint8_t *response,
+                                  size_t header_length, size_t total,
+                                  size_t *first, size_t *last) {
+    if (range == NULL || !range->requested ||
+        http_status_code(response, header_length) != 200 ||
+        (range->if_range[0] != '\0' &&
+         !http_if_range_matches(response, header_length, range->if_range))) {
+        return HTTP_RANGE_IGNORED;
+    }
+    return http_parse_range(range->range, total, first, last);
+}
+
+/* Returns whether a header line has one of the NULL-terminated names */
+static bool is_header(uint8_t *line, size_t length, char **names) {
+    for (; *names != NULL; names++) {
+        size_t name_length = strlen(*names);
+        if (length > name_length && line[name_length] == ':' &&
+            strncasecmp((char *) line, *names, name_length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Appends the header lines (but not the status line or the empty line
+ * ending them) of a response with header_length bytes of headers to out,
+ * leaving out the headers with one of the NULL-terminated names */
+static void copy_headers_except(buffer_t *out, uint8_t *response,
+                                size_t header_length, char **names) {
+    uint8_t *line = (uint8_t *) memchr(response, '\n', header_length) + 1;
+    uint8_t *end = response + header_length - strlen("\r\n");
+    while (line < end) {
+        uint8_t *next = (uint8_t *) memchr(line, '\n', end - line) + 1;
+        if (!is_header(line, next - line, names)) {
+            buffer_append_bytes(out, line, next - line);
+        }
+        line = next;
     }
-    return write_string(server_fd, "\r\n");
 }
 
-/* Sends the server's response to the client.
+/* Sends the status line and headers of a 206 Partial Content response with
+ * bytes first to last of a body of total bytes. The headers are those of
+ * response, which has header_length bytes of headers, with the length
+ * adjusted to the range. Returns whether successful */
+static bool send_partial_head(int client_fd, uint8_t *response,
+                              size_t header_length, size_t first, size_t last,
+                              size_t total) {
+    metrics_add(METRIC_PARTIAL_RESPONSES, 1);
+    buffer_t *head = buffer_create(BUFFER_SIZE);
+    append_string(head, "HTTP/1.0 206 Partial Content\r\n");
+    char *length_headers[] = { "Content-Length", "Content-Range", NULL };
+    copy_headers_except(head, response, header_length, length_headers);
+    char range_headers[BUFFER_SIZE];
+    snprintf(range_headers, sizeof(range_headers),
+             "Content-Range: bytes %zu-%zu/%zu\r\n"
+             "Content-Length: %zu\r\n"
+             "\r\n", first, last, total, last - first + 1);
+    append_string(head, range_headers);
+    bool success = write_client(client_fd, buffer_data(head),
+                                buffer_length(head));
+    buffer_free(head);
+    return success;
+}
+
+/* Tells the client that the range it asked for lies past the end of a body
+ * of total bytes. Returns whether successful */
+static bool send_range_not_satisfiable(int client_fd, size_t total) {
+    char response[BUFFER_SIZE];
+    snprintf(response, sizeof(response),
+             "HTTP/1.0 416 Range Not Satisfiable\r\n"
+             "Content-Range: bytes */%zu\r\n"
+             "Content-Length: 0\r\n"
+             "Connection: close\r\n"
+             "\r\n", total);
+    return write_client(client_fd, (uint8_t *) response, strlen(response));
+}
+
+/* Sends a complete response to the client: the part of it the client asked
+ * for if range is not NULL, and all of it otherwise.
+ * Returns whether successful */
+static bool send_cached(int client_fd, buffer_t *data, client_range_t *range) {
+    uint8_t *bytes = buffer_data(data);
+    size_t length = buffer_length(data);
+    size_t header_length = http_header_end(bytes, length);
+    size_t first, last;
+    http_range_t result = header_length == 0 ? HTTP_RANGE_IGNORED :
+        resolve_range(range, bytes, header_length, length - header_length,
+                      &first, &last);
+    switch (result) {
+        case HTTP_RANGE_SATISFIABLE:
+            return send_partial_head(client_fd, bytes, header_length, first,
+                                     last, length - header_length) &&
+                write_client(client_fd, bytes + header_length + first,
+                             last - first + 1);
+        case HTTP_RANGE_UNSATISFIABLE:
+            return send_range_not_satisfiable(client_fd,
+                                              length - header_length);
+        default:
+            return write_client(client_fd, bytes, length);
+    }
+}
+
+/* Sends the part of length bytes of the body that the client asked for, if
+ * any, and moves the stream past them. Returns whether successful */
+static bool stream_range(int client_fd, range_stream_t *stream,
+                         uint8_t *bytes, size_t length) {
+    size_t start = stream->offset;
+    size_t end = start + length;
+    stream->offset = end;
+    stream->done = end > stream->last;
+    if (end <= stream->first || start > stream->last) {
+        return true;
+    }
+    size_t from = start > stream->first ? start : stream->first;
+    size_t to = end < stream->last + 1 ? end : stream->last + 1;
+    return write_client(client_fd, bytes + (from - start), to - from);
+}
+
+/* Starts sending a response that turned out too large to buffer for a
+ * client that asked for a range, with the data received so far. If the
+ * response says how long its body is, only the range is streamed; otherwise
+ * all of it is sent. Returns whether successful */
+static bool start_range_stream(int client_fd, buffer_t *data,
+                               client_range_t *range,
+                               range_stream_t *stream) {
+    uint8_t *bytes = buffer_data(data);
+    size_t length = buffer_length(data);
+    size_t header_length = http_header_end(bytes, length);
+    char value[32];
+    char *end;
+    size_t total = 0, first, last;
+    http_range_t result = HTTP_RANGE_IGNORED;
+    if (header_length > 0 &&
+        http_get_header(bytes, header_length, "Content-Length", value,
+                        sizeof(value))) {
+        total = strtoull(value, &end, 10);
+        if (value[0] != '\0' && *end == '\0') {
+            result = resolve_range(range, bytes, header_length, total, &first,
+                                   &last);
+        }
+    }
+    switch (result) {
+        case HTTP_RANGE_SATISFIABLE:
+            stream->active = true;
+            stream->offset = 0;
+            stream->first = first;
+            stream->last = last;
+            return send_partial_head(client_fd, bytes, header_length, first,
+                                     last, total) &&
+                stream_range(client_fd, stream, bytes + header_length,
+                             length - header_length);
+        case HTTP_RANGE_UNSATISFIABLE:
+            stream->active = true;
+            stream->done = true;
+            return send_range_not_satisfiable(client_fd, total);
+        default:
+            return write_client(client_fd, bytes, length);
+    }
+}
+
+/* Sends the server's response to the client, or only stores it in the cache
+ * if client_fd is -1. head is the client's request head, which selects the
+ * variant stored, or NULL without a client.
+ * If stale_meta is not NULL, we hold the stale cached response stale for key
+ * and nothing is forwarded until the status of the answer is known. A 304 Not
+ * Modified answer then refreshes the metadata of the cached entry and stale is
+ * sent instead, and so is a failed, timed out or 5xx answer if
+ * serve_stale_on_error. Timeouts before anything was forwarded are answered
+ * with 504 Gateway Timeout.
+ * If range is not NULL and the client asked for a range, the response is
+ * held until it is complete and only the range is sent. A response too large
+ * to cache is sent as it arrives instead, as a range if it has a length.
  * Returns whether successful */
-static bool send_response(int client_fd, int server_fd, char* key) {
-    /* Loop until server sends an EOF */
-    buffer_t* data = buffer_create(BUFFER_SIZE);
+static bool send_response(int client_fd, int server_fd, char* key,
+                          buffer_t *head, buffer_t *stale, freshness_t *stale_meta,
+                          bool serve_stale_on_error, client_range_t *range) {
+    rope_t *data = rope_create();
+    uint64_t request_sent = metrics_now();
+    bool forwarded = false;
+    bool buffering = client_fd >= 0 && range != NULL && range->requested;
+    /* Whether the response may still fit in the cache. Once it does not,
+     * each read is dropped as soon as it has been passed on. */
+    bool storing = true;
+    range_stream_t stream = { .active = false, .done = false };
+    if (stale_meta != NULL) {
+        buffer_t *headers = buffer_create(BUFFER_SIZE);
+        bool success = read_response_headers(server_fd, headers,
+                                             &request_sent);
+        int status = http_status_code(buffer_data(headers),
+                                      buffer_length(headers));
+        if (status == 304) {
+            metrics_add(METRIC_NOT_MODIFIED, 1);
+            freshness_update(stale_meta, buffer_data(headers),
+                             buffer_length(headers), time(NULL));
+            hash_refresh(shard->cache, key, stale_meta);
+            buffer_free(headers);
+            rope_free(data);
+            return stale == NULL || send_cached(client_fd, stale, range);
+        }
+        if (serve_stale_on_error && (!success || status >= 500)) {
+            verbose_printf("Serving stale response for %s\n", key);
+            metrics_add(METRIC_STALE_HITS, 1);
+            access_record.outcome = ACCESS_STALE_HIT;
+            buffer_free(headers);
+            rope_free(data);
+            return send_cached(client_fd, stale, range);
+        }
+        if (!success) {
+            send_timeout(client_fd, forwarded);
+            verbose_printf("read error: %s\n", strerror(errno));
+            buffer_free(headers);
+            rope_free(data);
+            return false;
+        }
+        rope_append_bytes(data, buffer_data(headers), buffer_length(headers));
+        bool sent = buffering || write_client(client_fd, buffer_data(headers),
+                                              buffer_length(headers));
+        buffer_free(headers);
+        if (!sent) {
+            rope_free(data);
+            return false;
+        }
+        forwarded = !buffering;
+    }
+
+    /* Loop until server sends an EOF, reading straight into the free space
+     * at the end of data */
     while (true) {
-        uint8_t buf[BUFFER_SIZE];
-        ssize_t bytes_read = read(server_fd, buf, sizeof(buf));
+        size_t available;
+        uint8_t *buf = rope_reserve(data, &available);
+        ssize_t bytes_read = read_server(server_fd, buf, available,
+                                         &request_sent);
         if (bytes_read < 0) {
+            send_timeout(client_fd, forwarded);
             verbose_printf("read error: %s\n", strerror(errno));
+            rope_free(data);
             return false;
         }
         /* Server sent EOF */
         if (bytes_read == 0) {
-            /* If the data is less than MAX_OBJECT_SIZE, then add it
-             * to the cache; otherwise, discard the buffer_t.
-             */
-            if (buffer_length(data) < MAX_OBJECT_SIZE) {
-              insert(cache, key, data);
+            bool success = true;
+            if (storing) {
+                buffer_t *response = rope_flatten(data);
+                success = !buffering || send_cached(client_fd, response, range);
+                cache_response(key, head, response);
             }
-            else {
-              buffer_free(data);
-              free(key);
+            rope_free(data);
+            return success;
+        }
+        rope_commit(data, bytes_read);
+        bool success;
+        if (buffering) {
+            /* Wait for the rest, unless the response is too large to cache */
+            if (rope_length(data) < MAX_OBJECT_SIZE) {
+                continue;
             }
-            return true;
+            buffering = false;
+            buffer_t *received = rope_flatten(data);
+            success = start_range_stream(client_fd, received, range, &stream);
+            buffer_free(received);
         }
-        // Writes the data to the buffer_t data as it is being read
-        buffer_append_bytes(data, buf, bytes_read);
-        ssize_t bytes_written = write(client_fd, buf, bytes_read);
-        if (bytes_written < 0) {
-            return false;
+        else if (stream.active) {
+            success = stream_range(client_fd, &stream, buf, bytes_read);
+        }
+        else {
+            success = write_client(client_fd, buf, bytes_read);
+        }
+        if (!success || stream.done) {
+            rope_free(data);
+            return success;
+        }
+        forwarded = true;
+        if (rope_length(data) >= MAX_OBJECT_SIZE) {
+            storing = false;
+        }
+        if (!storing) {
+            rope_clear(data);
         }
     }
 }
 
-void *handle_request(void *cfd) {
-    // Detaches the current thread
+proxy_shard_t *shard_init(hash_t *cache, hash_t *negative, int cpu,
+                          size_t origin_concurrency, admission_t *admission,
+                          resolver_t *resolver) {
+    proxy_shard_t *new_shard = malloc(sizeof(proxy_shard_t));
+    assert(new_shard != NULL);
+    new_shard->cache = cache;
+    new_shard->negative = negative;
+    new_shard->origins = origin_table_init();
+    new_shard->origin_concurrency = origin_concurrency;
+    new_shard->admission = admission;
+    new_shard->resolver = resolver;
+    new_shard->cpu = cpu;
+    new_shard->refreshing = NULL;
+    pthread_mutex_init(&new_shard->refreshing_lock, NULL);
+    new_shard->next = shards;
+    shards = new_shard;
+    return new_shard;
+}
+
+/* Makes the calling thread work for a shard */
+static void enter_shard(proxy_shard_t *target) {
+    shard = target;
+    if (shard->cpu >= 0) {
+        metrics_bind_cpu(shard->cpu);
+    }
+}
+
+/* Takes a refresh off its shard's list once it is done or abandoned */
+static void forget_refresh(refresh_t *refresh) {
+    pthread_mutex_lock(&shard->refreshing_lock);
+    refresh_t **curr = &shard->refreshing;
+    while (*curr != refresh) {
+        curr = &(*curr)->next;
+    }
+    *curr = refresh->next;
+    pthread_mutex_unlock(&shard->refreshing_lock);
+}
+
+/* Frees a refresh and the strings it owns */
+static void free_refresh(refresh_t *refresh) {
+    free(refresh->host);
+    free(refresh->path);
+    free(refresh->key);
+    free(refresh);
+}
+
+/* Fetches path from host into the cache under key without a client waiting
+ * on the result. If meta is not NULL, the cached entry with that metadata is
+ * revalidated instead. Returns whether successful */
+static bool fetch_to_cache(char *host, char *path, char *key,
+                           freshness_t *meta) {
+    /* Background work gives way to clients when the proxy is busy */
+    if (!admission_acquire(shard->admission, ADMISSION_BACKGROUND)) {
+        metrics_add(METRIC_SHED_MISSES, 1);
+        return false;
+    }
+
+    /* open_server_connection cuts the port off the host it is given */
+    origin_t *origin = origin_acquire(shard->origins, host,
+                                      shard->origin_concurrency);
+    char *server_host = arena_strdup(request_arena(), host);
+    int server_fd = origin != NULL ?
+        open_server_connection(-1, server_host) : -1;
+    bool success = false;
+    if (server_fd >= 0) {
+        buffer_t *request = buffer_create(BUFFER_SIZE);
+        add_get_header(request, path);
+        if (meta != NULL) {
+            add_conditional_headers(request, meta);
+        }
+        append_string(request, "Host: ");
+        append_string(request, host);
+        append_string(request, "\r\n");
+        /* A variant is fetched with the request headers that select it */
+        if (cache_key_is_variant(key)) {
+            append_string(request, key + cache_key_url_length(key) +
+                          strlen("\r\n"));
+        }
+        append_string(request, "Connection: close\r\n\r\n");
+        success = write_buffer(server_fd, request) &&
+            send_response(-1, server_fd, key, NULL, NULL, meta, false, NULL);
+        buffer_free(request);
+        close(server_fd);
+    }
+    origin_release(origin);
+    admission_release(shard->admission);
+    return success;
+}
+
+/* Revalidates (or fetches again) a stale entry without a client waiting on
+ * the result, then removes it from the refreshing list. */
+static void *refresh_entry(void *arg) {
+    pthread_detach(pthread_self());
+    refresh_t *refresh = arg;
+    enter_shard(refresh->shard);
+    bool revalidating = freshness_has_validator(&refresh->meta);
+    if (!fetch_to_cache(refresh->host, refresh->path, refresh->key,
+                        revalidating ? &refresh->meta : NULL)) {
+        verbose_printf("Background refresh of %s failed\n", refresh->key);
+    }
+
+    forget_refresh(refresh);
+    free_refresh(refresh);
+    return NULL;
+}
+
+/* Starts refreshing the stale entry for key in the background, unless it is
+ * already being refreshed */
+static void start_refresh(char *host, char *path, char *key,
+                          freshness_t *meta) {
+    pthread_mutex_lock(&shard->refreshing_lock);
+    for (refresh_t *curr = shard->refreshing; curr != NULL; curr = curr->next) {
+        if (strcmp(curr->key, key) == 0) {
+            pthread_mutex_unlock(&shard->refreshing_lock);
+            return;
+        }
+    }
+    refresh_t *refresh = malloc(sizeof(refresh_t));
+    assert(refresh != NULL);
+    refresh->host = strdup(host);
+    refresh->path = strdup(path);
+    refresh->key = strdup(key);
+    assert(refresh->host != NULL && refresh->path != NULL &&
+           refresh->key != NULL);
+    refresh->shard = shard;
+    refresh->meta = *meta;
+    refresh->next = shard->refreshing;
+    shard->refreshing = refresh;
+    pthread_mutex_unlock(&shard->refreshing_lock);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, refresh_entry, refresh) == 0) {
+        return;
+    }
+    /* Forget the refresh so a later request can try again, rather than make
+     * this client wait on the origin for its stale copy */
+    verbose_printf("Could not start background refresh of %s\n", key);
+    forget_refresh(refresh);
+    free_refresh(refresh);
+}
+
+/* Drops a thread's reference to a prefetch, freeing it with the last one */
+static void release_prefetch(prefetch_t *prefetch) {
+    if (__atomic_sub_fetch(&prefetch->threads, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (size_t i = 0; i < prefetch->count; i++) {
+            free(prefetch->paths[i]);
+        }
+        free(prefetch->host);
+        free(prefetch);
+    }
+}
+
+/* Fetches resources of a page into the cache, taking them in turn with the
+ * page's other prefetch threads, until the page runs out of resources or of
+ * budget */
+static void *prefetch_resources(void *arg) {
     pthread_detach(pthread_self());
-    int client_fd = *(int *) cfd;
-    free(cfd);
+    prefetch_t *prefetch = arg;
+    enter_shard(prefetch->shard);
+    prefetching = true;
+
+    size_t index;
+    while ((index = __atomic_fetch_add(&prefetch->next, 1, __ATOMIC_RELAXED))
+           < prefetch->count &&
+           __atomic_load_n(&prefetch->bytes, __ATOMIC_RELAXED) <
+           (size_t) config.prefetch_budget) {
+        char *path = prefetch->paths[index];
+        char *key = cache_key_make(request_arena(), prefetch->host, path,
+                                   config.sort_query,
+                                   config.strip_query_params);
+        if (!contains(shard->cache, key)) {
+            size_t before = bytes_fetched;
+            if (fetch_to_cache(prefetch->host, path, key, NULL)) {
+                metrics_add(METRIC_PREFETCHES, 1);
+            }
+            __atomic_add_fetch(&prefetch->bytes, bytes_fetched - before,
+                               __ATOMIC_RELAXED);
+        }
+        arena_reset(request_arena());
+    }
+
+    __atomic_sub_fetch(&prefetchers, 1, __ATOMIC_RELAXED);
+    release_prefetch(prefetch);
+    return NULL;
+}
+
+/* Starts prefetching the resources of the page cached under key, if it is
+ * an HTML page, on as many threads as config.prefetch_concurrency still
+ * allows */
+static void start_prefetch(char *key, buffer_t *data) {
+    uint8_t *bytes = buffer_data(data);
+    size_t length = buffer_length(data);
+    size_t header_length = http_header_end(bytes, length);
+    char content_type[BUFFER_SIZE];
+    if (!http_get_header(bytes, header_length, "Content-Type", content_type,
+                         sizeof(content_type)) ||
+        strncasecmp(content_type, "text/html", strlen("text/html")) != 0) {
+        return;
+    }
+
+    prefetch_t *prefetch = malloc(sizeof(prefetch_t));
+    assert(prefetch != NULL);
+    char *path = strchr(key, '/');
+    prefetch->host = strndup(key, path - key);
+    char *url_path = arena_strndup(request_arena(), path,
+                                   cache_key_url_length(path));
+    assert(prefetch->host != NULL);
+    prefetch->count = prefetch_find_links(bytes + header_length,
+                                          length - header_length,
+                                          prefetch->host, url_path,
+                                          prefetch->paths, MAX_PREFETCH_LINKS);
+    prefetch->shard = shard;
+    prefetch->next = 0;
+    prefetch->bytes = 0;
+    prefetch->threads = 1;
+
+    /* The starting thread holds a reference until all threads are started */
+    for (size_t i = 0; i < prefetch->count; i++) {
+        if (__atomic_add_fetch(&prefetchers, 1, __ATOMIC_RELAXED) >
+            (size_t) config.prefetch_concurrency) {
+            __atomic_sub_fetch(&prefetchers, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_add_fetch(&prefetch->threads, 1, __ATOMIC_RELAXED);
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, prefetch_resources, prefetch) != 0) {
+            __atomic_sub_fetch(&prefetchers, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&prefetch->threads, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    release_prefetch(prefetch);
+}
+
+/* Copies the entry under key from the cache of the current shard into the
+ * cache of target, along with the variant that a request without any of
+ * the headers it varies on selects, if it has variants */
+static void copy_entry(proxy_shard_t *target, char *key) {
+    freshness_t meta;
+    buffer_t *data = get_with_meta(shard->cache, key, &meta);
+    if (data == NULL) {
+        return;
+    }
+    if (meta.vary[0] != '\0') {
+        char *variant = cache_key_variant(request_arena(), key, meta.vary,
+                                          NULL);
+        freshness_t variant_meta;
+        buffer_t *variant_data = get_with_meta(shard->cache, variant,
+                                               &variant_meta);
+        if (variant_data != NULL) {
+            insert_with_meta(target->cache, variant, variant_data,
+                             &variant_meta);
+        }
+    }
+    insert_with_meta(target->cache, key, data, &meta);
+}
 
+/* Fetches the URLs of the warm-up into the caches, taking them in turn with
+ * the other warm-up threads */
+static void *warm_up_caches(void *arg) {
+    pthread_detach(pthread_self());
+    (void) arg;
+    /* Warm-up has a budget of its own */
+    prefetching = true;
+    size_t budget = config.warm_up_budget > 0 ?
+        (size_t) config.warm_up_budget : (size_t) config.cache_size;
+
+    size_t index;
+    while (__atomic_load_n(&warm_up->bytes, __ATOMIC_RELAXED) < budget &&
+           (index = __atomic_fetch_add(&warm_up->next, 1, __ATOMIC_RELAXED))
+           < warm_up->count) {
+        /* The fetches are spread over the shards, whose origin and
+         * admission limits they count against */
+        enter_shard(warm_up->shards[index % warm_up->shard_count]);
+        char *url = warm_up->urls[index];
+        char *path = strchr(url, '/');
+        char *host = cache_key_host(request_arena(),
+                                    arena_strndup(request_arena(), url,
+                                                  path - url));
+        char *key = cache_key_make(request_arena(), host, path,
+                                   config.sort_query,
+                                   config.strip_query_params);
+        bool fetched = contains(shard->cache, key);
+        if (!fetched) {
+            size_t before = bytes_fetched;
+            fetched = fetch_to_cache(host, path, key, NULL);
+            __atomic_add_fetch(&warm_up->bytes, bytes_fetched - before,
+                               __ATOMIC_RELAXED);
+        }
+        if (fetched) {
+            __atomic_add_fetch(&warm_up->fetched, 1, __ATOMIC_RELAXED);
+            for (size_t i = 0; i < warm_up->shard_count; i++) {
+                if (warm_up->shards[i] != shard &&
+                    !contains(warm_up->shards[i]->cache, key)) {
+                    copy_entry(warm_up->shards[i], key);
+                }
+            }
+        }
+        __atomic_add_fetch(&warm_up->done, 1, __ATOMIC_RELAXED);
+        arena_reset(request_arena());
+    }
+
+    __atomic_sub_fetch(&warm_up->threads, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Prints the progress of the warm-up */
+static void print_warm_up(char *state) {
+    printf("Warm-up %s: %zu of %zu URLs done, %zu fetched, %zu bytes\n",
+           state, __atomic_load_n(&warm_up->done, __ATOMIC_RELAXED),
+           warm_up->count,
+           __atomic_load_n(&warm_up->fetched, __ATOMIC_RELAXED),
+           __atomic_load_n(&warm_up->bytes, __ATOMIC_RELAXED));
+    fflush(stdout);
+}
+
+/* Starts the warm-up threads, then reports their progress every second
+ * until they are done */
+static void *run_warm_up(void *arg) {
+    pthread_detach(pthread_self());
+    (void) arg;
+    /* start_warm_up holds a reference for this thread until all threads
+     * are started */
+    for (long i = 0; i < config.warm_up_concurrency; i++) {
+        __atomic_add_fetch(&warm_up->threads, 1, __ATOMIC_RELAXED);
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, warm_up_caches, NULL) != 0) {
+            __atomic_sub_fetch(&warm_up->threads, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    __atomic_sub_fetch(&warm_up->threads, 1, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&warm_up->threads, __ATOMIC_ACQUIRE) > 0) {
+        sleep(1);
+        print_warm_up("in progress");
+    }
+    print_warm_up("finished");
+    return NULL;
+}
+
+bool start_warm_up(char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    warm_up = calloc(1, sizeof(warm_up_t));
+    assert(warm_up != NULL);
+    size_t capacity = 0;
+    char line[BUFFER_SIZE];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        /* One "host[:port]/path" per line, as in tests/repeat-sites */
+        line[strcspn(line, "\r\n")] = '\0';
+        char *url = line;
+        if (strncasecmp(url, "http://", strlen("http://")) == 0) {
+            url += strlen("http://");
+        }
+        if (url[0] == '\0' || url[0] == '#' || url[0] == '/') {
+            continue;
+        }
+        if (warm_up->count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            warm_up->urls = realloc(warm_up->urls, capacity * sizeof(char *));
+            assert(warm_up->urls != NULL);
+        }
+        size_t length = strlen(url);
+        char *copy = malloc(length + strlen("/") + 1);
+        assert(copy != NULL);
+        strcpy(copy, url);
+        if (strchr(copy, '/') == NULL) {
+            strcpy(copy + length, "/");
+        }
+        warm_up->urls[warm_up->count++] = copy;
+    }
+    fclose(file);
+
+    for (proxy_shard_t *curr = shards; curr != NULL; curr = curr->next) {
+        warm_up->shard_count++;
+    }
+    warm_up->shards = malloc(warm_up->shard_count * sizeof(proxy_shard_t *));
+    assert(warm_up->shards != NULL);
+    size_t i = 0;
+    for (proxy_shard_t *curr = shards; curr != NULL; curr = curr->next) {
+        warm_up->shards[i++] = curr;
+    }
+    /* Ready until the threads are started if there is nothing to do */
+    warm_up->threads = warm_up->count > 0 ? 1 : 0;
+
+    pthread_t tid;
+    if (warm_up->count > 0 &&
+        pthread_create(&tid, NULL, run_warm_up, NULL) != 0) {
+        warm_up->threads = 0;
+        return false;
+    }
+    return true;
+}
+
+/* Returns whether the proxy is warm enough to take traffic: there is no
+ * warm-up, it is config.warm_up_ready percent done or it has stopped */
+static bool is_ready(void) {
+    if (warm_up == NULL) {
+        return true;
+    }
+    return __atomic_load_n(&warm_up->threads, __ATOMIC_ACQUIRE) == 0 ||
+        __atomic_load_n(&warm_up->done, __ATOMIC_RELAXED) * 100 >=
+        warm_up->count * config.warm_up_ready;
+}
+
+/* Returns the grace window for a stale response: the origin's, if it gave
+ * one, and the configured default otherwise */
+static long grace_window(long origin_window, long default_window) {
+    return origin_window >= 0 ? origin_window : default_window;
+}
+
+/* Answers a request addressed to the proxy itself. /metrics serves the
+ * metrics in the Prometheus text format and /stats as plain text. /ready
+ * answers 200 once the proxy is warm enough to take traffic, and 503 until
+ * then. */
+static void send_admin_page(int client_fd, char *path) {
+    if (strcmp(path, "/ready") == 0) {
+        if (is_ready()) {
+            send_status_code(client_fd, "200 OK", "Ready.");
+        }
+        else {
+            send_status_code(client_fd, "503 Service Unavailable",
+                             "Warming up the cache.");
+        }
+        return;
+    }
+    bool prometheus = strcmp(path, "/metrics") == 0;
+    if (!prometheus && strcmp(path, "/stats") != 0) {
+        send_status_code(client_fd, "404 Not Found", "Unknown proxy page.");
+        return;
+    }
+
+    size_t cache_bytes = 0, cache_budget = 0, dedup_bytes = 0;
+    for (proxy_shard_t *curr = shards; curr != NULL; curr = curr->next) {
+        cache_bytes += get_cache_size(curr->cache);
+        cache_budget += get_cache_capacity(curr->cache);
+        dedup_bytes += get_dedup_bytes(curr->cache);
+    }
+    metrics_set(METRIC_CACHE_BYTES, cache_bytes);
+    metrics_set(METRIC_CACHE_BUDGET, cache_budget);
+    metrics_set(METRIC_DEDUP_BYTES, dedup_bytes);
+    buffer_t *body = buffer_create(BUFFER_SIZE);
+    metrics_render(body, prometheus);
+    char header[BUFFER_SIZE];
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: close\r\n"
+             "\r\n", buffer_length(body));
+    if (send_bytes(client_fd, (uint8_t *) header, strlen(header))) {
+        send_bytes(client_fd, buffer_data(body), buffer_length(body));
+    }
+    buffer_free(body);
+}
+
+/* Answers a request whose head (NULL if it could not be read) was read
+ * already on client_fd. Returns whether an answer was sent, so that the
+ * connection can be closed gracefully. */
+static bool serve_request(int client_fd, buffer_t *head) {
+    uint64_t start = metrics_now();
     char *host = NULL, *path = NULL;
-    if (!make_get_header(client_fd, &host, &path)) {
+    if (!make_get_header(client_fd, head, &host, &path)) {
         goto CLIENT_ERROR;
     }
+    if (host == NULL) {
+        send_admin_page(client_fd, path);
+        goto RETURN_SECTION;
+    }
+    metrics_add(METRIC_REQUESTS, 1);
+    client_range_t range;
+    read_client_range(head, &range);
 
-    /* Mallocs a char* pointer to concatenate both the host and path */
-    char* key = malloc((strlen(host) + strlen(path) + 1) * sizeof(char));
-    strcpy(key, host);
-    strcat(key, path);
+    /* Requests that name the same resource in different ways share a key,
+     * and failures of the origin are remembered under its canonical name */
+    host = cache_key_host(request_arena(), host);
+    char *key = cache_key_make(request_arena(), host, path,
+                               config.sort_query, config.strip_query_params);
+    begin_access(key);
 
-    /* If the data is not NULL, then skips the server connection and writes
-     * the data directly tot the client.
+    /* If the data is not NULL and still fresh, then skips the server
+     * connection and writes the data directly to the client. A response
+     * that only just went stale is served as well while it is refreshed in
+     * the background.
      */
-    buffer_t* data = get(cache, key);
-    if (data != NULL) {
-        write(client_fd, buffer_data(data), buffer_length(data));
+    freshness_t meta;
+    time_t now = time(NULL);
+    buffer_t* data = front_get(shard->cache, key, &meta);
+    if (data != NULL && freshness_is_fresh(&meta, now)) {
+        /* One of the hottest responses, copied to this CPU */
+        metrics_add(METRIC_HITS, 1);
+        metrics_add(METRIC_FRONT_HITS, 1);
+        access_record.outcome = ACCESS_FRONT_HIT;
+        access_record.lookup_us = micros_since(start);
+        send_cached(client_fd, data, &range);
+        buffer_free(data);
+        goto RETURN_SECTION;
+    }
+    buffer_free(data);
+    data = get_with_meta(shard->cache, key, &meta);
+    if (data != NULL && meta.vary[0] != '\0') {
+        /* The URL has variants; look up the one this request selects */
+        key = cache_key_variant(request_arena(), key, meta.vary,
+                                buffer_string(head));
+        buffer_free(data);
+        data = get_with_meta(shard->cache, key, &meta);
+    }
+    bool fresh = data != NULL && freshness_is_fresh(&meta, now);
+    access_record.lookup_us = micros_since(start);
+    if (data != NULL && !fresh && freshness_within_stale_window(&meta, now,
+            grace_window(meta.stale_while_revalidate,
+                         config.stale_while_revalidate))) {
+        start_refresh(host, path, key, &meta);
+        metrics_add(METRIC_STALE_HITS, 1);
+        access_record.outcome = ACCESS_STALE_HIT;
+        fresh = true;
+    }
+    else if (fresh) {
+        metrics_add(METRIC_HITS, 1);
+        access_record.outcome = ACCESS_HIT;
+        if (!cache_key_is_variant(key)) {
+            front_note_hit(shard->cache, key);
+        }
+    }
+    if (fresh) {
+        send_cached(client_fd, data, &range);
+        buffer_free(data);
+        goto RETURN_SECTION;
+    }
+
+    /* Keep a stale response if it can be revalidated, or if it can stand in
+     * for the origin when the origin fails */
+    bool stale_if_error = data != NULL &&
+        freshness_within_stale_window(&meta, now,
+            grace_window(meta.stale_if_error, config.stale_if_error));
+    if (data != NULL && !stale_if_error && !freshness_has_validator(&meta)) {
+        buffer_free(data);
+        data = NULL;
+    }
+
+    /* Without a copy of our own, a request for a URL that got an error or to
+     * an origin that failed a moment ago gets the same answer again, instead
+     * of waiting for the origin to fail once more */
+    if (data == NULL) {
+        buffer_t *failure = recall_failure(key);
+        if (failure == NULL) {
+            failure = recall_failure(host);
+        }
+        if (failure != NULL) {
+            metrics_add(METRIC_NEGATIVE_HITS, 1);
+            access_record.outcome = ACCESS_NEGATIVE_HIT;
+            write_client(client_fd, buffer_data(failure),
+                         buffer_length(failure));
+            buffer_free(failure);
+            goto RETURN_SECTION;
+        }
+    }
+    metrics_add(data != NULL ? METRIC_REVALIDATIONS : METRIC_MISSES, 1);
+    access_record.outcome = data != NULL ? ACCESS_REVALIDATION : ACCESS_MISS;
+
+    /* Only a bounded number of misses fetch at once, so that they cannot
+     * starve the hits. A miss that queued too long is shed, and answered
+     * with the stale copy if there is one that may stand in. */
+    if (!admission_acquire(shard->admission, ADMISSION_CLIENT)) {
+        metrics_add(METRIC_SHED_MISSES, 1);
+        access_record.outcome = ACCESS_SHED;
+        if (stale_if_error) {
+            metrics_add(METRIC_STALE_HITS, 1);
+            send_cached(client_fd, data, &range);
+        }
+        else {
+            send_status_code(client_fd, "503 Service Unavailable",
+                "The proxy is too busy to fetch this from the origin server.");
+        }
         buffer_free(data);
-        free(key);
         goto RETURN_SECTION;
     }
 
-    /* Establish connection with requested server */
-    int server_fd = open_server_connection(client_fd, host);
+    /* Establish connection with requested server, unless it already has as
+     * many requests in flight as we allow */
+    int server_fd = -1;
+    origin_t *origin = origin_acquire(shard->origins, host,
+                                      shard->origin_concurrency);
+    if (origin == NULL) {
+        metrics_add(METRIC_ORIGIN_REJECTED, 1);
+        if (!stale_if_error) {
+            send_status_code(client_fd, "503 Service Unavailable",
+                "Too many requests are waiting on this origin server.");
+        }
+    }
+    else {
+        server_fd = open_server_connection(stale_if_error ? -1 : client_fd,
+                                           host);
+    }
     if (server_fd < 0) {
+        /* A request turned away by the cap already counts as rejected */
+        if (origin != NULL) {
+            metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+        }
+        origin_release(origin);
+        admission_release(shard->admission);
+        if (stale_if_error) {
+            verbose_printf("Serving stale response for %s\n", key);
+            metrics_add(METRIC_STALE_HITS, 1);
+            access_record.outcome = ACCESS_STALE_HIT;
+            send_cached(client_fd, data, &range);
+            buffer_free(data);
+            goto RETURN_SECTION;
+        }
+        buffer_free(data);
+        access_record.outcome = ACCESS_ERROR;
+        finish_access(start);
         goto CLIENT_ERROR;
     }
 
-    /* Send GET request to server */
-    if (!send_get_header(server_fd, path)) {
-        goto SERVER_ERROR;
+    /* Send GET request to server, revalidating the stale copy if we can.
+     * The request headers are modified to ensure no persistent connections
+     * and the presence of a Host header, and sent with a single write */
+    buffer_t *request = buffer_create(BUFFER_SIZE);
+    add_get_header(request, path);
+    if (data != NULL && freshness_has_validator(&meta)) {
+        add_conditional_headers(request, &meta);
     }
-
-    /* Modify and send request headers to ensure no persistent connections and
-     * ensure the presence of a Host header */
-    if (!filter_rest_headers(client_fd, server_fd, host)) {
-        verbose_printf("filter_rest_headers error: %s\n", strerror(errno));
+    filter_rest_headers(head, request, host, data != NULL);
+    if (!write_buffer(server_fd, request)) {
+        verbose_printf("write error: %s\n", strerror(errno));
+        buffer_free(request);
+        buffer_free(data);
         goto SERVER_ERROR;
     }
+    buffer_free(request);
 
     /* Forward response from server to client, and store the response in the
      * cache if possible */
-    if (!send_response(client_fd, server_fd, key)) {
+    if (!send_response(client_fd, server_fd, key, head, data,
+                       data != NULL ? &meta : NULL, stale_if_error, &range)) {
         verbose_printf("send_reponse error: %s\n", strerror(errno));
         /* Fall through, since we're done anyway */
     }
+    buffer_free(data);
 
     close(server_fd);
+    origin_release(origin);
+    admission_release(shard->admission);
     goto RETURN_SECTION;
 
     RETURN_SECTION:
-      /* Close the write end of the client socket and wait for it to send EOF. */
-      if (shutdown(client_fd, SHUT_WR) < 0) {
-          verbose_printf("shutdown error: %s\n", strerror(errno));
-          goto CLIENT_ERROR;
-      }
-      uint8_t discard_buffer[BUFFER_SIZE];
-      if (read(client_fd, discard_buffer, sizeof(discard_buffer)) < 0) {
-          verbose_printf("read error: %s\n", strerror(errno));
-          goto CLIENT_ERROR;
-      }
-      close(client_fd);
-      free(host);
-      free(path);
-      return NULL;
+      metrics_record_since(METRIC_REQUEST_LATENCY, start);
+      finish_access(start);
+      arena_reset(request_arena());
+      return true;
 
     SERVER_ERROR:
         verbose_printf("Error in writing to server\n");
         close(server_fd);
+        origin_release(origin);
+        admission_release(shard->admission);
+        access_record.outcome = ACCESS_ERROR;
+        finish_access(start);
 
     CLIENT_ERROR:
+        arena_reset(request_arena());
+        return false;
+}
+
+/* Closes the write end of the client socket and waits for the client to send
+ * EOF before closing the connection */
+static void close_client(int client_fd) {
+    if (shutdown(client_fd, SHUT_WR) < 0) {
+        verbose_printf("shutdown error: %s\n", strerror(errno));
+    }
+    else {
+        uint8_t discard_buffer[BUFFER_SIZE];
+        if (read(client_fd, discard_buffer, sizeof(discard_buffer)) < 0) {
+            verbose_printf("read error: %s\n", strerror(errno));
+        }
+    }
+    close(client_fd);
+}
+
+/* Returns whether the client wants to keep its connection open after the
+ * answer to the request with this head: by default for HTTP/1.1, and only
+ * when asked to with keep-alive for HTTP/1.0 */
+static bool wants_keep_alive(buffer_t *head) {
+    char *request_line = buffer_string(head);
+    char *line_end = strchr(request_line, '\r');
+    bool http_1_1 = line_end - request_line >= (ptrdiff_t) strlen("HTTP/1.1") &&
+        strncmp(line_end - strlen("HTTP/1.1"), "HTTP/1.1", strlen("HTTP/1.1"))
+            == 0;
+    char value[BUFFER_SIZE];
+    if (http_get_header(buffer_data(head), buffer_length(head), "Connection",
+                        value, sizeof(value)) ||
+        http_get_header(buffer_data(head), buffer_length(head),
+                        "Proxy-Connection", value, sizeof(value))) {
+        if (strcasestr(value, "close") != NULL) {
+            return false;
+        }
+        if (strcasestr(value, "keep-alive") != NULL) {
+            return true;
+        }
+    }
+    return http_1_1;
+}
+
+static void framer_init(client_framer_t *framer, int fd) {
+    framer->fd = fd;
+    framer->held = buffer_create(BUFFER_SIZE);
+    framer->header_length = 0;
+    framer->head_sent = false;
+    framer->framed = false;
+    framer->remaining = 0;
+    framer->failed = false;
+}
+
+/* Sends the held headers with their connection headers replaced by
+ * "Connection: " and connection, and with a Content-Length of
+ * content_length added if add_length. Returns whether successful */
+static bool send_framed_head(client_framer_t *framer, char *connection,
+                             bool add_length, size_t content_length) {
+    uint8_t *bytes = buffer_data(framer->held);
+    buffer_t *head = buffer_create(BUFFER_SIZE);
+    uint8_t *status_end = memchr(bytes, '\n', framer->header_length) + 1;
+    buffer_append_bytes(head, bytes, status_end - bytes);
+    char *connection_headers[] = {
+        "Connection", "Proxy-Connection", "Keep-Alive", NULL
+    };
+    copy_headers_except(head, bytes, framer->header_length,
+                        connection_headers);
+    char lines[BUFFER_SIZE];
+    if (add_length) {
+        snprintf(lines, sizeof(lines), "Content-Length: %zu\r\n",
+                 content_length);
+        append_string(head, lines);
+    }
+    snprintf(lines, sizeof(lines), "Connection: %s\r\n\r\n", connection);
+    append_string(head, lines);
+    bool success = write_buffer(framer->fd, head);
+    buffer_free(head);
+    return success;
+}
+
+/* Decides how the body is framed once the headers are complete. Answers
+ * that never have a body and answers with a Content-Length are framed. */
+static void frame_body(client_framer_t *framer) {
+    uint8_t *bytes = buffer_data(framer->held);
+    int status = http_status_code(bytes, framer->header_length);
+    char value[32];
+    char *end;
+    if (status == 204 || status == 304) {
+        framer->framed = true;
+        framer->remaining = 0;
+    }
+    else if (http_get_header(bytes, framer->header_length, "Content-Length",
+                             value, sizeof(value))) {
+        framer->remaining = strtoull(value, &end, 10);
+        framer->framed = value[0] != '\0' && *end == '\0';
+    }
+}
+
+/* Writes bytes of an answer through a framer. Bytes past the length of a
+ * framed body are dropped. Returns whether successful */
+static bool framer_write(client_framer_t *framer, uint8_t *bytes,
+                         size_t length) {
+    if (framer->failed) {
+        return false;
+    }
+    if (framer->head_sent) {
+        if (framer->framed) {
+            length = length < framer->remaining ? length : framer->remaining;
+            framer->remaining -= length;
+        }
+        framer->failed = !write_bytes(framer->fd, bytes, length);
+        return !framer->failed;
+    }
+
+    buffer_append_bytes(framer->held, bytes, length);
+    if (framer->header_length == 0) {
+        framer->header_length = http_header_end(buffer_data(framer->held),
+                                                buffer_length(framer->held));
+        if (framer->header_length == 0) {
+            return true;
+        }
+        frame_body(framer);
+    }
+    size_t body_length = buffer_length(framer->held) - framer->header_length;
+    if (framer->framed) {
+        /* Send the headers marked keep-alive and the body so far */
+        framer->head_sent = true;
+        if (body_length > framer->remaining) {
+            body_length = framer->remaining;
+        }
+        framer->remaining -= body_length;
+        framer->failed = !send_framed_head(framer, "keep-alive", false, 0) ||
+            !write_bytes(framer->fd,
+                         buffer_data(framer->held) + framer->header_length,
+                         body_length);
+    }
+    else if (body_length > MAX_REFRAMED_SIZE) {
+        /* Too large to hold back: the client can only tell where it ends by
+         * the connection closing */
+        framer->head_sent = true;
+        framer->failed = !send_framed_head(framer, "close", false, 0) ||
+            !write_bytes(framer->fd,
+                         buffer_data(framer->held) + framer->header_length,
+                         body_length);
+    }
+    return !framer->failed;
+}
+
+/* Ends the answer written through a framer, sending whatever was held back,
+ * and frees the framer. Returns whether the connection can carry the next
+ * answer. */
+static bool framer_finish(client_framer_t *framer) {
+    bool usable = false;
+    if (framer->failed || framer->head_sent) {
+        usable = !framer->failed && framer->framed && framer->remaining == 0;
+    }
+    else if (framer->header_length > 0) {
+        /* The body ended without a Content-Length, so it gets one now */
+        size_t body_length = buffer_length(framer->held) -
+            framer->header_length;
+        usable = send_framed_head(framer, "keep-alive", true, body_length) &&
+            write_bytes(framer->fd,
+                        buffer_data(framer->held) + framer->header_length,
+                        body_length);
+    }
+    else {
+        /* Not even the headers were complete */
+        write_buffer(framer->fd, framer->held);
+    }
+    buffer_free(framer->held);
+    return usable;
+}
+
+/* Copies a response from fd to the client until fd ends, returning whether
+ * the connection can carry the next response. If the client wants to keep
+ * the connection, the response goes through a framer; otherwise it is
+ * copied as it is. */
+static bool relay_response(int client_fd, int fd, bool keep_alive) {
+    client_framer_t framer;
+    framer_init(&framer, client_fd);
+    uint8_t buf[BUFFER_SIZE];
+    ssize_t bytes_read;
+    bool success = true;
+    while (success && (bytes_read = read(fd, buf, sizeof(buf))) > 0) {
+        success = keep_alive ? framer_write(&framer, buf, bytes_read) :
+            write_bytes(client_fd, buf, bytes_read);
+    }
+    return framer_finish(&framer) && keep_alive && success;
+}
+
+/* Answers a pipelined request on its own thread, into its socket pair */
+static void *answer_pipelined(void *arg) {
+    pthread_detach(pthread_self());
+    pipelined_request_t *request = arg;
+    enter_shard(request->shard);
+    serve_request(request->fd, request->head);
+    close(request->fd);
+    buffer_free(request->head);
+    free(request);
+    return NULL;
+}
+
+/* Sends the answers to the requests of a pipeline to the client in the order
+ * the requests came in. Once an answer leaves the connection unusable, the
+ * remaining answers are dropped and reading requests is stopped. Closes the
+ * connection and frees the pipeline once no more requests come. */
+static void *relay_pipeline(void *arg) {
+    pthread_detach(pthread_self());
+    pipeline_t *pipeline = arg;
+    pthread_mutex_lock(&pipeline->lock);
+    while (true) {
+        while (pipeline->count == 0 && !pipeline->closed) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        if (pipeline->count == 0) {
+            break;
+        }
+        pipeline_slot_t slot = pipeline->slots[pipeline->first];
+        pthread_mutex_unlock(&pipeline->lock);
+
+        bool usable = !pipeline->stopped &&
+            relay_response(pipeline->client_fd, slot.fd, slot.keep_alive);
+        close(slot.fd);
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->first = (pipeline->first + 1) % MAX_PIPELINED_REQUESTS;
+        pipeline->count--;
+        if (!usable && !pipeline->stopped) {
+            /* Wakes up the connection's thread if it is waiting for a
+             * request */
+            pipeline->stopped = true;
+            shutdown(pipeline->client_fd, SHUT_RD);
+        }
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    close_client(pipeline->client_fd);
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->changed);
+    free(pipeline);
+    return NULL;
+}
+
+/* Hands a request of the pipeline to a new thread, which answers it into a
+ * socket pair for the relay to pick up. Takes ownership of head. Returns
+ * whether the pipeline can take more requests. */
+static bool dispatch_request(pipeline_t *pipeline, buffer_t *head,
+                             bool keep_alive) {
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->count == MAX_PIPELINED_REQUESTS && !pipeline->stopped) {
+        pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    }
+    bool stopped = pipeline->stopped;
+    pthread_mutex_unlock(&pipeline->lock);
+    int fds[2];
+    if (stopped ||
+        socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        buffer_free(head);
+        return false;
+    }
+
+    /* The socket buffer bounds how much of an answer waits for the answers
+     * before it; beyond that, its thread waits for the relay */
+    int buffer_size = PIPELINE_BUFFER_SIZE;
+    setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &buffer_size,
+               sizeof(buffer_size));
+    pipelined_request_t *request = malloc(sizeof(pipelined_request_t));
+    assert(request != NULL);
+    request->fd = fds[1];
+    request->head = head;
+    request->shard = shard;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, answer_pipelined, request) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        buffer_free(head);
+        free(request);
+        return false;
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    size_t last = (pipeline->first + pipeline->count) % MAX_PIPELINED_REQUESTS;
+    pipeline->slots[last].fd = fds[0];
+    pipeline->slots[last].keep_alive = keep_alive;
+    pipeline->count++;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+    return true;
+}
+
+/* Serves the rest of a kept-alive connection whose client sent further
+ * requests before getting the answer to the one with the given head.
+ * Requests are read back-to-back as they come and each is answered on its
+ * own thread, so that a hit is answered while a miss before it still waits
+ * on its origin; a relay thread sends the answers in order. Returns whether
+ * the connection was handed to the relay; if not, head is left to the
+ * caller. */
+static bool serve_pipeline(client_reader_t *reader, buffer_t *head) {
+    pipeline_t *pipeline = malloc(sizeof(pipeline_t));
+    assert(pipeline != NULL);
+    pipeline->client_fd = reader->fd;
+    pipeline->first = 0;
+    pipeline->count = 0;
+    pipeline->closed = false;
+    pipeline->stopped = false;
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->changed, NULL);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, relay_pipeline, pipeline) != 0) {
+        pthread_mutex_destroy(&pipeline->lock);
+        pthread_cond_destroy(&pipeline->changed);
+        free(pipeline);
+        return false;
+    }
+
+    while (head != NULL) {
+        bool keep_alive = wants_keep_alive(head);
+        if (!dispatch_request(pipeline, head, keep_alive) || !keep_alive) {
+            break;
+        }
+        head = read_request_head(reader);
+    }
+
+    /* The relay frees the pipeline once it saw this */
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->closed = true;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+    return true;
+}
+
+/* Answers a request on a kept-alive connection on the connection's own
+ * thread, through a framer. Sets *answered to whether an answer was sent.
+ * Returns whether the connection can carry the next answer. */
+static bool serve_kept_alive(int client_fd, buffer_t *head, bool *answered) {
+    client_framer_t framer;
+    framer_init(&framer, client_fd);
+    answer_framer = &framer;
+    *answered = serve_request(client_fd, head);
+    answer_framer = NULL;
+    return framer_finish(&framer) && *answered;
+}
+
+void *handle_request(void *connection) {
+    // Detaches the current thread
+    pthread_detach(pthread_self());
+    int client_fd = ((connection_t *) connection)->client_fd;
+    enter_shard(((connection_t *) connection)->shard);
+    free(connection);
+
+    /* Requests of a kept-alive connection are answered one at a time on this
+     * thread, with no thread or socket pair of their own, until the client
+     * sends a request before getting the answer to the one before */
+    client_reader_t reader;
+    reader_init(&reader, client_fd);
+    buffer_t *head = read_request_head(&reader);
+    bool answered = true;
+    bool kept_alive = false;
+    while (head != NULL && wants_keep_alive(head)) {
+        if (reader.start < reader.end && serve_pipeline(&reader, head)) {
+            return NULL;
+        }
+        if (!kept_alive) {
+            /* An idle connection does not hold its thread forever */
+            set_timeout(client_fd, SO_RCVTIMEO, KEEP_ALIVE_TIMEOUT);
+            kept_alive = true;
+        }
+        bool usable = serve_kept_alive(client_fd, head, &answered);
+        buffer_free(head);
+        head = NULL;
+        if (!usable) {
+            break;
+        }
+        head = read_request_head(&reader);
+        if (head == NULL) {
+            /* The client is done with the connection */
+            close_client(client_fd);
+            return NULL;
+        }
+    }
+    if (head != NULL || !kept_alive) {
+        answered = serve_request(client_fd, head);
+    }
+    if (answered) {
+        close_client(client_fd);
+    }
+    else {
         close(client_fd);
-        free(host);
-        free(path);
-        return NULL;
+    }
+    buffer_free(head);
+    return NULL;
 }
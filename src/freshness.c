@@ -0,0 +1,217 @@
+/*
+ * freshness.c - HTTP freshness and validation metadata for cached responses.
+ *
+ * Whenever a response is put into the cache, its headers are parsed once into
+ * a freshness_t which records when the response becomes stale and which
+ * validators (ETag and Last-Modified) can be used to revalidate it. The
+ * lifetime follows RFC 7234: s-maxage and max-age take precedence over
+ * Expires, responses without either get a heuristic lifetime of 10% of the
+ * time since Last-Modified, and responses with no information at all get
+ * DEFAULT_FRESHNESS_LIFETIME. no-store and private responses are not cacheable
+ * and no-cache responses are stored already stale so every hit revalidates.
+ *
+ * When a stale response is revalidated and the origin answers with 304 Not
+ * Modified, only this metadata is refreshed; the cached body is kept as is.
+ * Whatever the 304 does not say (validators, directives, lifetime) is kept
+ * from the stored response.
+ *
+ * The stale-while-revalidate and stale-if-error extensions (RFC 5861) are
+ * recorded as well, so the proxy can keep serving a stale response for a
+ * while when refreshing it would make the client wait on the origin.
+ *
+ * The Vary header is kept in a normalized form, since the proxy stores one
+ * variant of the response per combination of the headers it names. A
+ * response that varies on everything (Vary: *) cannot be stored.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "freshness.h"
+#include "http.h"
+
+/* Large enough for any Cache-Control or date header we care about */
+#define HEADER_VALUE_SIZE 512
+
+/* Parsed Cache-Control directives. A negative age means it was not present. */
+typedef struct cache_control_t {
+  bool no_store;
+  bool no_cache;
+  bool must_revalidate;
+  long max_age;
+  long stale_while_revalidate;
+  long stale_if_error;
+} cache_control_t;
+
+/* Parses a Cache-Control header value into its directives */
+static void parse_cache_control(char* value, cache_control_t* cc) {
+  long s_maxage = -1;
+  char* saveptr;
+  for (char* token = strtok_r(value, ",", &saveptr); token != NULL;
+       token = strtok_r(NULL, ",", &saveptr)) {
+    while (*token == ' ' || *token == '\t') {
+      token++;
+    }
+    if (strncasecmp(token, "no-store", 8) == 0 ||
+        strncasecmp(token, "private", 7) == 0) {
+      cc->no_store = true;
+    }
+    else if (strncasecmp(token, "no-cache", 8) == 0) {
+      cc->no_cache = true;
+    }
+    else if (strncasecmp(token, "must-revalidate", 15) == 0 ||
+             strncasecmp(token, "proxy-revalidate", 16) == 0) {
+      cc->must_revalidate = true;
+    }
+    else if (strncasecmp(token, "stale-while-revalidate=", 23) == 0) {
+      cc->stale_while_revalidate = strtol(token + 23, NULL, 10);
+    }
+    else if (strncasecmp(token, "stale-if-error=", 15) == 0) {
+      cc->stale_if_error = strtol(token + 15, NULL, 10);
+    }
+    else if (strncasecmp(token, "max-age=", 8) == 0) {
+      cc->max_age = strtol(token + 8, NULL, 10);
+    }
+    else if (strncasecmp(token, "s-maxage=", 9) == 0) {
+      s_maxage = strtol(token + 9, NULL, 10);
+    }
+  }
+  // A shared cache must prefer s-maxage over max-age
+  if (s_maxage >= 0) {
+    cc->max_age = s_maxage;
+  }
+}
+
+/* Copies a Vary header value into vary as lowercased names separated by
+ * commas without spaces. Returns false for Vary: * and for values too long
+ * to keep. */
+static bool normalize_vary(char* value, char* vary) {
+  size_t length = 0;
+  char* saveptr;
+  for (char* token = strtok_r(value, ", \t", &saveptr); token != NULL;
+       token = strtok_r(NULL, ", \t", &saveptr)) {
+    if (strcmp(token, "*") == 0 ||
+        length + strlen(token) + 1 >= MAX_VARY_LENGTH) {
+      return false;
+    }
+    if (length > 0) {
+      vary[length++] = ',';
+    }
+    for (char* c = token; *c != '\0'; c++) {
+      vary[length++] = tolower(*c);
+    }
+  }
+  vary[length] = '\0';
+  return true;
+}
+
+/* Reads the validators and the lifetime from the response headers into meta.
+ * When merging the headers of a 304 Not Modified into stored metadata, the
+ * directives and the lifetime the 304 does not carry are kept from the stored
+ * response (RFC 7234 section 4.3.4). Returns whether the response forbids
+ * storing it. */
+static bool read_headers(uint8_t* response, size_t length, time_t now,
+                         freshness_t* meta, bool merge) {
+  char value[HEADER_VALUE_SIZE];
+  cache_control_t cc = { false, false, false, -1, -1, -1 };
+  bool has_cache_control =
+    http_get_header(response, length, "Cache-Control", value, sizeof(value));
+  if (has_cache_control) {
+    parse_cache_control(value, &cc);
+  }
+  if (http_get_header(response, length, "ETag", value, sizeof(value)) &&
+      strlen(value) < MAX_ETAG_LENGTH) {
+    strcpy(meta->etag, value);
+  }
+  if (http_get_header(response, length, "Last-Modified", value, sizeof(value))) {
+    time_t last_modified = http_parse_date(value);
+    if (last_modified > 0) {
+      meta->last_modified = last_modified;
+    }
+  }
+
+  // The age the response already had when we received it
+  long age = 0;
+  if (http_get_header(response, length, "Age", value, sizeof(value))) {
+    age = strtol(value, NULL, 10);
+  }
+  time_t date = now;
+  if (http_get_header(response, length, "Date", value, sizeof(value))) {
+    time_t parsed = http_parse_date(value);
+    if (parsed > 0) {
+      date = parsed;
+    }
+  }
+
+  meta->stored_at = now;
+  if (has_cache_control || !merge) {
+    meta->stale_while_revalidate = cc.stale_while_revalidate;
+    meta->stale_if_error = cc.stale_if_error;
+    meta->must_revalidate = cc.must_revalidate || cc.no_cache;
+  }
+  if (cc.no_cache) {
+    meta->lifetime = 0;
+  }
+  else if (cc.max_age >= 0) {
+    meta->lifetime = cc.max_age;
+  }
+  else if (http_get_header(response, length, "Expires", value, sizeof(value))) {
+    // An invalid Expires (such as "0") means already expired
+    time_t expires = http_parse_date(value);
+    meta->lifetime = expires > date ? expires - date : 0;
+  }
+  else if (merge) {
+    // Keep the lifetime of the stored response
+  }
+  else if (meta->last_modified > 0 && meta->last_modified < date) {
+    meta->lifetime = (date - meta->last_modified) / 10;
+    if (meta->lifetime > MAX_HEURISTIC_LIFETIME) {
+      meta->lifetime = MAX_HEURISTIC_LIFETIME;
+    }
+  }
+  else {
+    meta->lifetime = DEFAULT_FRESHNESS_LIFETIME;
+  }
+  meta->expires_at = now + meta->lifetime - age;
+  return cc.no_store;
+}
+
+bool freshness_parse(uint8_t* response, size_t length, time_t now,
+                     freshness_t* meta) {
+  memset(meta, 0, sizeof(*meta));
+  // Only complete 200 responses are stored
+  if (http_status_code(response, length) != 200 ||
+      http_header_end(response, length) == 0) {
+    return false;
+  }
+  char value[HEADER_VALUE_SIZE];
+  if (http_get_header(response, length, "Vary", value, sizeof(value)) &&
+      !normalize_vary(value, meta->vary)) {
+    return false;
+  }
+  return !read_headers(response, length, now, meta, false);
+}
+
+void freshness_update(freshness_t* meta, uint8_t* response, size_t length,
+                      time_t now) {
+  read_headers(response, length, now, meta, true);
+}
+
+bool freshness_is_fresh(freshness_t* meta, time_t now) {
+  return now < meta->expires_at;
+}
+
+bool freshness_within_stale_window(freshness_t* meta, time_t now,
+                                   long window) {
+  if (meta->must_revalidate) {
+    return false;
+  }
+  return now < meta->expires_at + window;
+}
+
+bool freshness_has_validator(freshness_t* meta) {
+  return meta->etag[0] != '\0' || meta->last_modified > 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * front.c - Small per-CPU caches of the hottest responses.
+ *
+ * Every hit on the shared cache takes its read lock, walks a bucket and
+ * stamps the node it finds, all on cache lines that every core touches.
+ * Under a skewed workload most hits are on a handful of keys, so each CPU
+ * keeps a few of them in a front cache of its own that hits are served from
+ * first. The front caches are per CPU rather than per thread because the
+ * proxy runs a thread per request, which would never see the same key twice.
+ *
+ * Hits on the shared cache are sampled into a small table of candidates per
+ * CPU, and a key that is sampled FRONT_PROMOTE_SAMPLES times is copied into
+ * the front cache. Copying marks the shared entry hot (see queue.c), and
+ * replacing, evicting or refreshing a hot entry advances the hot epoch, so a
+ * front copy is only served while the epoch it was taken at is current.
+ * Hits served from the front do not touch the shared entry, so one in
+ * FRONT_TOUCH_RATE of them looks it up to keep it recently used.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "front.h"
+
+/* Number of front caches the CPUs are spread over */
+#define FRONT_CPUS 64
+
+/* Number of responses a front cache holds */
+#define FRONT_SLOTS 8
+
+/* Number of keys a front cache counts samples of */
+#define FRONT_CANDIDATES 32
+
+/* One in this many hits on the shared cache is sampled */
+#define FRONT_SAMPLE_RATE 4
+
+/* Samples of a key after which it is copied into the front cache */
+#define FRONT_PROMOTE_SAMPLES 4
+
+/* One in this many front cache hits touches the shared entry */
+#define FRONT_TOUCH_RATE 16
+
+#define CACHE_LINE_SIZE 64
+
+/* A response copied into a front cache */
+typedef struct front_entry_t {
+  hash_t* table;
+  char* key;
+  buffer_t* value;
+  freshness_t meta;
+  // The hot epoch the copy is current for
+  uint64_t epoch;
+} front_entry_t;
+
+/* A key that is counted for promotion, known by its hash code */
+typedef struct candidate_t {
+  size_t code;
+  unsigned samples;
+} candidate_t;
+
+typedef struct front_t {
+  // Only contended by threads running on the same CPU
+  pthread_mutex_t lock;
+  uint64_t hits;
+  front_entry_t slots[FRONT_SLOTS];
+  candidate_t candidates[FRONT_CANDIDATES];
+} __attribute__((aligned(CACHE_LINE_SIZE))) front_t;
+
+static front_t fronts[FRONT_CPUS] = {
+  [0 ... FRONT_CPUS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+/* Returns the front cache of the CPU the calling thread runs on */
+static front_t* current_front(void) {
+  int cpu = sched_getcpu();
+  return &fronts[(cpu < 0 ? 0 : cpu) % FRONT_CPUS];
+}
+
+/* Empties a slot */
+static void drop_entry(front_entry_t* entry) {
+  free(entry->key);
+  buffer_free(entry->value);
+  entry->key = NULL;
+  entry->value = NULL;
+}
+
+buffer_t* front_get(hash_t* table, char* key, freshness_t* meta) {
+  size_t code = get_hash_code(key);
+  front_t* front = current_front();
+  buffer_t* copy = NULL;
+  bool touch = false;
+  pthread_mutex_lock(&front->lock);
+  front_entry_t* entry = &front->slots[code % FRONT_SLOTS];
+  if (entry->key != NULL && entry->table == table &&
+      strcmp(entry->key, key) == 0) {
+    if (entry->epoch == get_hot_epoch()) {
+      copy = buffer_create(buffer_length(entry->value));
+      buffer_append_bytes(copy, buffer_data(entry->value),
+                          buffer_length(entry->value));
+      *meta = entry->meta;
+      touch = ++front->hits % FRONT_TOUCH_RATE == 0;
+    }
+    else {
+      drop_entry(entry);
+    }
+  }
+  pthread_mutex_unlock(&front->lock);
+  if (touch) {
+    contains(table, key);
+  }
+  return copy;
+}
+
+void front_note_hit(hash_t* table, char* key) {
+  size_t code = get_hash_code(key);
+  front_t* front = current_front();
+  bool promote = false;
+  pthread_mutex_lock(&front->lock);
+  if (++front->hits % FRONT_SAMPLE_RATE == 0) {
+    candidate_t* candidate = &front->candidates[code % FRONT_CANDIDATES];
+    if (candidate->code != code) {
+      candidate->code = code;
+      candidate->samples = 0;
+    }
+    if (++candidate->samples >= FRONT_PROMOTE_SAMPLES) {
+      candidate->samples = 0;
+      promote = true;
+    }
+  }
+  pthread_mutex_unlock(&front->lock);
+  if (!promote) {
+    return;
+  }
+
+  // Copied outside the lock of the front cache, since it takes the lock of
+  // the table
+  freshness_t meta;
+  uint64_t epoch;
+  buffer_t* value = get_hot(table, key, FRONT_MAX_OBJECT, &meta, &epoch);
+  if (value == NULL) {
+    return;
+  }
+  char* copy = strdup(key);
+  if (copy == NULL) {
+    buffer_free(value);
+    return;
+  }
+  pthread_mutex_lock(&front->lock);
+  front_entry_t* entry = &front->slots[code % FRONT_SLOTS];
+  drop_entry(entry);
+  entry->table = table;
+  entry->key = copy;
+  entry->value = value;
+  entry->meta = meta;
+  entry->epoch = epoch;
+  pthread_mutex_unlock(&front->lock);
+}
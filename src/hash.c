@@ -21,6 +21,28 @@
  *
  * If the maximum cache size is exceeded when insert is attempted, then the hash
  * table automatically removes elements until there is enough space for caching.
+ * Inserting a key that is already cached replaces the old entry. The maximum
+ * size can be changed while the cache is in use.
+ *
+ * Evicting inline makes the thread that finished a download pay for a scan
+ * of the whole table under the write lock per entry evicted. A table can
+ * instead start a background reclaimer that keeps it between a low and a
+ * high watermark: inserts that push it over the high watermark wake the
+ * reclaimer, which evicts in batches down to the low watermark, taking the
+ * write lock once per batch and scanning the table once per batch rather
+ * than once per entry. Inserts then only evict inline when the table is
+ * completely full, because the reclaimer could not keep up.
+ *
+ * Responses that differ only in their headers, as when the same file is
+ * served under several URLs, keep one copy of their body: an insert looks
+ * the body up in the body_store_t of the table (see body.c), and an entry
+ * whose body is there already only holds its headers and a reference to it.
+ * The cache size counts the body once, when its first entry is inserted,
+ * and gets it back when its last entry is removed.
+ *
+ * Every entry also carries the freshness_t metadata of its response (see
+ * freshness.c). get_with_meta returns it along with the value, and
+ * hash_refresh replaces it in place when a stale entry has been revalidated.
  *
  * To create a thread-safe cache, a read-writer lock is used for the 3 functions
  * insert, get and create.
@@ -38,6 +60,8 @@
 #include <string.h>
 
 #include "hash.h"
+#include "http.h"
+#include "metrics.h"
 
 #define HASH_NUMBER 37
 #define TABLE_SIZE 67
@@ -47,8 +71,8 @@
  */
 #define NULL_INDEX 9999
 
-/* Defines the maximum cache size for the proxy cache */
-#define MAX_CACHE_SIZE 1048756
+/* Most entries the reclaimer evicts per hold of the write lock */
+#define RECLAIM_BATCH 32
 
 struct hash_t {
   // This is an array of queue pointers for each bucket
@@ -59,10 +83,52 @@ struct hash_t {
   size_t buckets;
   // Keeps track of the cache size
   size_t cache_size;
+  // The bodies the entries of the table share
+  body_store_t* bodies;
+  // The most bytes the cache may hold. It may be changed at any time (see
+  // budget.c), so it is read and written atomically.
+  size_t capacity;
+  // The background reclaimer, if one was started, and the percentages of the
+  // capacity it starts and stops evicting at
+  bool reclaiming;
+  bool stopping;
+  pthread_t reclaimer;
+  unsigned low_watermark;
+  unsigned high_watermark;
+  pthread_mutex_t reclaim_lock;
+  pthread_cond_t reclaim_wanted;
 };
 
+/* Takes the table lock for reading and records how long we waited for it. The
+ * clock is only read when the lock is contended. */
+static void read_lock(hash_t* hash_table) {
+  if (pthread_rwlock_tryrdlock(&hash_table->table_lock) == 0) {
+    metrics_record(METRIC_LOCK_WAIT, 0);
+    return;
+  }
+  uint64_t start = metrics_now();
+  pthread_rwlock_rdlock(&hash_table->table_lock);
+  metrics_record_since(METRIC_LOCK_WAIT, start);
+}
+
+/* Takes the table lock for writing and records how long we waited for it */
+static void write_lock(hash_t* hash_table) {
+  if (pthread_rwlock_trywrlock(&hash_table->table_lock) == 0) {
+    metrics_record(METRIC_LOCK_WAIT, 0);
+    return;
+  }
+  uint64_t start = metrics_now();
+  pthread_rwlock_wrlock(&hash_table->table_lock);
+  metrics_record_since(METRIC_LOCK_WAIT, start);
+}
+
 // Constructor for a hash_t that also acts as a cache
 hash_t *hash_init(void) {
+  return hash_init_with_capacity(MAX_CACHE_SIZE);
+}
+
+// Constructor for a hash_t holding at most capacity bytes
+hash_t *hash_init_with_capacity(size_t capacity) {
   hash_t *hash_table = malloc(sizeof(hash_t));
   assert(hash_table != NULL);
   queue_t **queue_arr = malloc(TABLE_SIZE * sizeof(queue_t*));
@@ -72,7 +138,13 @@ hash_t *hash_init(void) {
   hash_table->queue_arr = queue_arr;
   hash_table->buckets = TABLE_SIZE;
   hash_table->cache_size = 0;
+  hash_table->bodies = body_store_init();
+  hash_table->capacity = capacity;
+  hash_table->reclaiming = false;
+  hash_table->stopping = false;
   pthread_rwlock_init(&hash_table->table_lock, NULL);
+  pthread_mutex_init(&hash_table->reclaim_lock, NULL);
+  pthread_cond_init(&hash_table->reclaim_wanted, NULL);
   return hash_table;
 }
 
@@ -80,15 +152,61 @@ size_t get_cache_size(hash_t* hash_table) {
   return hash_table->cache_size;
 }
 
+size_t get_dedup_bytes(hash_t* hash_table) {
+  read_lock(hash_table);
+  size_t bytes = body_shared_bytes(hash_table->bodies);
+  pthread_rwlock_unlock(&hash_table->table_lock);
+  return bytes;
+}
+
+size_t get_cache_capacity(hash_t* hash_table) {
+  return __atomic_load_n(&hash_table->capacity, __ATOMIC_RELAXED);
+}
+
+/* Returns the number of bytes that is percent of the capacity */
+static size_t watermark(hash_t* hash_table, unsigned percent) {
+  return (double) get_cache_capacity(hash_table) * percent / 100;
+}
+
+/* Wakes the reclaimer of the table, if it has one and the table is over its
+ * high watermark */
+static void wake_reclaimer(hash_t* hash_table) {
+  if (!hash_table->reclaiming ||
+      get_cache_size(hash_table) <=
+        watermark(hash_table, hash_table->high_watermark)) {
+    return;
+  }
+  pthread_mutex_lock(&hash_table->reclaim_lock);
+  pthread_cond_signal(&hash_table->reclaim_wanted);
+  pthread_mutex_unlock(&hash_table->reclaim_lock);
+}
+
+// Only limits later inserts; the entries cached already stay until they are
+// removed, or the reclaimer gets to them
+void hash_set_capacity(hash_t* hash_table, size_t capacity) {
+  __atomic_store_n(&hash_table->capacity, capacity, __ATOMIC_RELAXED);
+  wake_reclaimer(hash_table);
+}
+
 // Frees the hash table by calling queue_free on each bucket and destroying
 // the lock
 void hash_free(hash_t* hash_table) {
   if (!hash_table) {
     return;
   }
+  if (hash_table->reclaiming) {
+    pthread_mutex_lock(&hash_table->reclaim_lock);
+    hash_table->stopping = true;
+    pthread_cond_signal(&hash_table->reclaim_wanted);
+    pthread_mutex_unlock(&hash_table->reclaim_lock);
+    pthread_join(hash_table->reclaimer, NULL);
+  }
+  pthread_mutex_destroy(&hash_table->reclaim_lock);
+  pthread_cond_destroy(&hash_table->reclaim_wanted);
   for (size_t i = 0; i < hash_table->buckets; i++) {
     queue_free(hash_table->queue_arr[i]);
   }
+  body_store_free(hash_table->bodies);
   pthread_rwlock_destroy(&hash_table->table_lock);
   free(hash_table->queue_arr);
   free(hash_table);
@@ -111,7 +229,11 @@ size_t get_hash_id(hash_t* hash_table, char* key) {
 
 // Checks if the hash table contains a key
 bool contains(hash_t* hash_table, char* key) {
-  return get(hash_table, key) != NULL;
+  size_t node_id = get_hash_id(hash_table, key);
+  read_lock(hash_table);
+  bool found = queue_get(hash_table->queue_arr[node_id], key) != NULL;
+  pthread_rwlock_unlock(&hash_table->table_lock);
+  return found;
 }
 
 // Makes a new copy of the buffer_t before returning the copy from get to avoid
@@ -122,27 +244,88 @@ buffer_t *copy_buffer(buffer_t* buf) {
   return copy;
 }
 
+/* Returns a copy of the whole response of a node, its shared body included.
+ * The caller must hold the table lock. */
+static buffer_t* copy_value(node_t* node) {
+  body_t* body = get_body(node);
+  if (body == NULL) {
+    return copy_buffer(get_value(node));
+  }
+  buffer_t* value = get_value(node);
+  buffer_t* copy = buffer_create(get_length(node));
+  buffer_append_bytes(copy, buffer_data(value), buffer_length(value));
+  buffer_append_bytes(copy, body_data(body), body_length(body));
+  return copy;
+}
+
 // Returns the value associated with the key
 buffer_t* get(hash_t* hash_table, char* key) {
+  freshness_t meta;
+  return get_with_meta(hash_table, key, &meta);
+}
+
+// Returns the value associated with the key and copies its freshness metadata
+// into meta
+buffer_t* get_with_meta(hash_t* hash_table, char* key, freshness_t* meta) {
   size_t node_id = get_hash_id(hash_table, key);
   // Critical section
-  pthread_rwlock_rdlock(&hash_table->table_lock);
+  read_lock(hash_table);
   node_t* node = queue_get(hash_table->queue_arr[node_id], key);
-  buffer_t* buffer = get_value(node);
   if (!get_value(node)) {
     pthread_rwlock_unlock(&hash_table->table_lock);
     return NULL;
   }
+  // The copy has to be made inside the critical section, since the node may
+  // be replaced or evicted as soon as the lock is released
+  buffer_t* copy = copy_value(node);
+  *meta = *get_meta(node);
+  pthread_rwlock_unlock(&hash_table->table_lock);
+  return copy;
+}
+
+// Returns a copy of the value associated with the key for a front cache,
+// marking its node hot in the same critical section, so that any later
+// change to it advances the hot epoch read here
+buffer_t* get_hot(hash_t* hash_table, char* key, size_t max_length,
+                  freshness_t* meta, uint64_t* epoch) {
+  size_t node_id = get_hash_id(hash_table, key);
+  // Critical section
+  read_lock(hash_table);
+  node_t* node = queue_get(hash_table->queue_arr[node_id], key);
+  if (!get_value(node) || get_length(node) > max_length) {
+    pthread_rwlock_unlock(&hash_table->table_lock);
+    return NULL;
+  }
+  mark_hot(node);
+  buffer_t* copy = copy_value(node);
+  *meta = *get_meta(node);
+  *epoch = get_hot_epoch();
+  pthread_rwlock_unlock(&hash_table->table_lock);
+  return copy;
+}
+
+// Replaces the freshness metadata of the entry with the given key. Returns
+// whether the key was found.
+bool hash_refresh(hash_t* hash_table, char* key, freshness_t* meta) {
+  size_t node_id = get_hash_id(hash_table, key);
+  // Critical section
+  write_lock(hash_table);
+  node_t* node = queue_get(hash_table->queue_arr[node_id], key);
+  if (node != NULL) {
+    *get_meta(node) = *meta;
+    node_changed(node);
+  }
   pthread_rwlock_unlock(&hash_table->table_lock);
-  return copy_buffer(buffer);
+  return node != NULL;
 }
 
 /* Returns the least recent node from the hashtable by checking each queue
  * for the least min node, and then comparing all of the min nodes with each
  * other for the min node. If there is no min_node (i.e, queue is empty),
- * then return the NULL_INDEX
+ * then return the NULL_INDEX. The caller must hold the table lock for
+ * writing, since another thread may otherwise free the nodes we look at.
  */
-size_t find_least_recent_node_hash(hash_t* hash_table) {
+static size_t find_least_recent_node_hash(hash_t* hash_table) {
   node_t* min_node_hash = NULL;
   size_t queue_idx = NULL_INDEX;
   for (size_t i = 0; i < hash_table->buckets; i++) {
@@ -160,20 +343,104 @@ size_t find_least_recent_node_hash(hash_t* hash_table) {
   return queue_idx;
 }
 
-/* This function removes a LRU node from the hash_table by first finding
- * the correct queue to remove from, calling queue_remove on that queue,
- * and decrementing the cache size by the removed element size
- */
-void hash_remove(hash_t* hash_table) {
+/* Removes the LRU node with the table lock already held for writing, and
+ * returns whether there was anything to remove */
+static bool evict_locked(hash_t* hash_table) {
   size_t queue_idx_to_remove = find_least_recent_node_hash(hash_table);
   // If queue_idx is NULL_INDEX, there is nothing to remove
   if (queue_idx_to_remove == NULL_INDEX) {
-    return;
+    return false;
   }
-  // Critical section
-  pthread_rwlock_wrlock(&hash_table->table_lock);
   size_t removed = queue_remove(hash_table->queue_arr[queue_idx_to_remove]);
   hash_table->cache_size -= removed;
+  metrics_add(METRIC_EVICTIONS, 1);
+  return true;
+}
+
+/* Removes least recently used entries with the table lock already held for
+ * writing, until at least bytes are freed or RECLAIM_BATCH entries are
+ * removed. The table is scanned once for the least recent node of every
+ * bucket, and only the bucket that lost its node is scanned again after
+ * each removal. Returns the number of bytes freed. */
+static size_t evict_batch_locked(hash_t* hash_table, size_t bytes) {
+  node_t* oldest[hash_table->buckets];
+  for (size_t i = 0; i < hash_table->buckets; i++) {
+    oldest[i] = find_least_recent_node(hash_table->queue_arr[i]);
+  }
+  size_t freed = 0;
+  for (size_t evicted = 0; freed < bytes && evicted < RECLAIM_BATCH;
+       evicted++) {
+    size_t queue_idx = NULL_INDEX;
+    for (size_t i = 0; i < hash_table->buckets; i++) {
+      if (oldest[i] != NULL && (queue_idx == NULL_INDEX ||
+          get_timestamp(oldest[i]) < get_timestamp(oldest[queue_idx]))) {
+        queue_idx = i;
+      }
+    }
+    if (queue_idx == NULL_INDEX) {
+      break;
+    }
+    size_t removed = queue_remove(hash_table->queue_arr[queue_idx]);
+    hash_table->cache_size -= removed;
+    freed += removed;
+    metrics_add(METRIC_EVICTIONS, 1);
+    oldest[queue_idx] =
+      find_least_recent_node(hash_table->queue_arr[queue_idx]);
+  }
+  return freed;
+}
+
+/* Evicts from a table down to its low watermark whenever it goes over its
+ * high watermark, until the table is freed */
+static void* reclaim(void* arg) {
+  hash_t* hash_table = arg;
+  while (true) {
+    pthread_mutex_lock(&hash_table->reclaim_lock);
+    while (!hash_table->stopping && get_cache_size(hash_table) <=
+           watermark(hash_table, hash_table->high_watermark)) {
+      pthread_cond_wait(&hash_table->reclaim_wanted,
+                        &hash_table->reclaim_lock);
+    }
+    bool stopping = hash_table->stopping;
+    pthread_mutex_unlock(&hash_table->reclaim_lock);
+    if (stopping) {
+      return NULL;
+    }
+
+    // One batch per hold of the write lock, so that readers get in between
+    size_t freed;
+    do {
+      size_t low = watermark(hash_table, hash_table->low_watermark);
+      freed = 0;
+      write_lock(hash_table);
+      if (hash_table->cache_size > low) {
+        freed = evict_batch_locked(hash_table, hash_table->cache_size - low);
+      }
+      pthread_rwlock_unlock(&hash_table->table_lock);
+    } while (freed > 0);
+  }
+}
+
+void hash_start_reclaimer(hash_t* hash_table, unsigned low_watermark,
+                          unsigned high_watermark) {
+  hash_table->low_watermark = low_watermark;
+  hash_table->high_watermark = high_watermark;
+  if (pthread_create(&hash_table->reclaimer, NULL, reclaim,
+                     hash_table) == 0) {
+    hash_table->reclaiming = true;
+  }
+}
+
+/* This function removes a LRU node from the hash_table by first finding
+ * the correct queue to remove from, calling queue_remove on that queue,
+ * and decrementing the cache size by the removed element size. The search
+ * and the removal happen in one critical section, so the node found cannot
+ * be freed by another thread in between.
+ */
+void hash_remove(hash_t* hash_table) {
+  // Critical section
+  write_lock(hash_table);
+  evict_locked(hash_table);
   pthread_rwlock_unlock(&hash_table->table_lock);
 }
 
@@ -182,16 +449,66 @@ void hash_remove(hash_t* hash_table) {
  * to insert.
  */
 void insert(hash_t* hash_table, char* key, buffer_t* value) {
+  freshness_t meta;
+  memset(&meta, 0, sizeof(meta));
+  insert_with_meta(hash_table, key, value, &meta);
+}
+
+/* Inserts a node along with the freshness metadata of its response. An
+ * existing entry with the same key is replaced. The body of a large enough
+ * response is shared with any entry that has the same body already, and is
+ * only charged against the capacity if there is none.
+ */
+void insert_with_meta(hash_t* hash_table, char* key, buffer_t* value,
+                      freshness_t* meta) {
+  // A value that could never fit would evict everything and still not fit
+  if (buffer_length(value) > get_cache_capacity(hash_table)) {
+    buffer_free(value);
+    return;
+  }
+  // Split off the body, and fingerprint it before taking the lock
+  uint8_t* data = buffer_data(value);
+  size_t head_length = http_header_end(data, buffer_length(value));
+  size_t body_length = buffer_length(value) - head_length;
+  buffer_t* response = NULL;
+  uint64_t fingerprint = 0;
+  if (head_length > 0 && body_length >= BODY_MIN_SHARED) {
+    fingerprint = body_fingerprint(data + head_length, body_length);
+    response = value;
+    value = buffer_create(head_length);
+    buffer_append_bytes(value, data, head_length);
+  }
   node_t* new_node = node_init(key, value);
+  *get_meta(new_node) = *meta;
   size_t node_id = get_hash_id(hash_table, key);
+  // Critical section
+  write_lock(hash_table);
+  // Look the body up before dropping the entry being replaced, which often
+  // holds the same body, so that it is not freed only to be stored again
+  size_t charge = buffer_length(value);
+  if (response != NULL) {
+    bool added;
+    set_body(new_node, body_intern(hash_table->bodies, fingerprint,
+                                   data + head_length, body_length, &added));
+    if (added) {
+      charge += body_length;
+    }
+    else {
+      metrics_add(METRIC_DEDUP_HITS, 1);
+    }
+  }
+  // Drop the entry being replaced first, so its space counts as free and no
+  // other entry is evicted to make room for it
+  hash_table->cache_size -= queue_delete(hash_table->queue_arr[node_id], key);
   // If the added buffer size cause the cache size to overflow, then remove
   // until there's enough space
-  while (hash_table->cache_size + buffer_length(value) > MAX_CACHE_SIZE) {
-    hash_remove(hash_table);
+  while (hash_table->cache_size + charge > get_cache_capacity(hash_table) &&
+         evict_locked(hash_table)) {
+    metrics_add(METRIC_INLINE_EVICTIONS, 1);
   }
-  // Critical section
-  pthread_rwlock_wrlock(&hash_table->table_lock);
   enqueue(hash_table->queue_arr[node_id], new_node);
-  hash_table->cache_size += buffer_length(value);
+  hash_table->cache_size += charge;
   pthread_rwlock_unlock(&hash_table->table_lock);
+  buffer_free(response);
+  wake_reclaimer(hash_table);
 }
@@ -0,0 +1,172 @@
+/*
+ * http.c - Small helpers for picking apart raw HTTP/1.x responses.
+ *
+ * The proxy stores whole responses (status line, headers and body) as a single
+ * buffer_t, so these helpers work directly on a byte array and its length
+ * instead of building a parsed representation. Header lookups scan the header
+ * block line by line and compare names case insensitively, as required by
+ * RFC 7230.
+ *
+ * Range requests (RFC 7233) are resolved against the stored body, so the
+ * proxy can answer them from a complete cached response. Only single byte
+ * ranges are supported; multiple ranges are ignored, which the RFC allows.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+
+int http_status_code(uint8_t* data, size_t length) {
+  // The status line looks like "HTTP/1.x NNN Reason"
+  if (length < strlen("HTTP/1.x NNN") || strncmp((char*) data, "HTTP/", 5)) {
+    return -1;
+  }
+  uint8_t* space = memchr(data, ' ', length);
+  if (!space || (size_t) (space - data) + 4 > length) {
+    return -1;
+  }
+  int code = 0;
+  for (int i = 1; i <= 3; i++) {
+    if (!isdigit(space[i])) {
+      return -1;
+    }
+    code = code * 10 + (space[i] - '0');
+  }
+  return code;
+}
+
+size_t http_header_end(uint8_t* data, size_t length) {
+  for (size_t i = 3; i < length; i++) {
+    if (data[i - 3] == '\r' && data[i - 2] == '\n' &&
+        data[i - 1] == '\r' && data[i] == '\n') {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+bool http_get_header(uint8_t* data, size_t length, char* name, char* value,
+                     size_t value_size) {
+  size_t end = http_header_end(data, length);
+  if (end == 0) {
+    end = length;
+  }
+  size_t name_length = strlen(name);
+  char* line = memchr(data, '\n', end);
+  // Skip the status line, then look at one header line at a time
+  while (line != NULL && (uint8_t*) ++line < data + end) {
+    char* next = memchr(line, '\n', (char*) data + end - line);
+    char* line_end = next ? next : (char*) data + end;
+    if (line_end - line > (ptrdiff_t) name_length &&
+        strncasecmp(line, name, name_length) == 0 &&
+        line[name_length] == ':') {
+      char* start = line + name_length + 1;
+      while (start < line_end && isspace(*start)) {
+        start++;
+      }
+      while (line_end > start && isspace(line_end[-1])) {
+        line_end--;
+      }
+      size_t copied = line_end - start;
+      if (copied >= value_size) {
+        copied = value_size - 1;
+      }
+      memcpy(value, start, copied);
+      value[copied] = '\0';
+      return true;
+    }
+    line = next;
+  }
+  return false;
+}
+
+time_t http_parse_date(char* str) {
+  static const char* formats[] = {
+    "%a, %d %b %Y %H:%M:%S GMT",  // IMF-fixdate
+    "%A, %d-%b-%y %H:%M:%S GMT",  // obsolete RFC 850 format
+    "%a %b %e %H:%M:%S %Y",       // ANSI C asctime() format
+  };
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char* end = strptime(str, formats[i], &tm);
+    if (end != NULL && *end == '\0') {
+      return timegm(&tm);
+    }
+  }
+  return -1;
+}
+
+void http_format_date(time_t time, char* out) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  strftime(out, HTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* Parses the digits at *str into *value, advancing *str past them. Returns
+ * whether there were any digits. */
+static bool parse_offset(char** str, size_t* value) {
+  if (!isdigit(**str)) {
+    return false;
+  }
+  *value = 0;
+  while (isdigit(**str)) {
+    *value = *value * 10 + (**str - '0');
+    (*str)++;
+  }
+  return true;
+}
+
+http_range_t http_parse_range(char* value, size_t length, size_t* first,
+                              size_t* last) {
+  if (strncasecmp(value, "bytes=", strlen("bytes=")) != 0 ||
+      strchr(value, ',') != NULL) {
+    return HTTP_RANGE_IGNORED;
+  }
+  char* spec = value + strlen("bytes=");
+  bool has_first = parse_offset(&spec, first);
+  if (*spec++ != '-') {
+    return HTTP_RANGE_IGNORED;
+  }
+  bool has_last = parse_offset(&spec, last);
+  if (*spec != '\0' || (!has_first && !has_last) ||
+      (has_first && has_last && *last < *first)) {
+    return HTTP_RANGE_IGNORED;
+  }
+
+  if (!has_first) {
+    // "-n" asks for the last n bytes
+    if (*last == 0 || length == 0) {
+      return HTTP_RANGE_UNSATISFIABLE;
+    }
+    *first = *last < length ? length - *last : 0;
+    *last = length - 1;
+    return HTTP_RANGE_SATISFIABLE;
+  }
+  if (*first >= length) {
+    return HTTP_RANGE_UNSATISFIABLE;
+  }
+  if (!has_last || *last >= length) {
+    *last = length - 1;
+  }
+  return HTTP_RANGE_SATISFIABLE;
+}
+
+bool http_if_range_matches(uint8_t* data, size_t length, char* if_range) {
+  char value[HTTP_DATE_SIZE + 128];
+  if (if_range[0] == '"') {
+    // Only strong entity tags match; weak ones start with W/ instead
+    return http_get_header(data, length, "ETag", value, sizeof(value)) &&
+      strcmp(value, if_range) == 0;
+  }
+  time_t date = http_parse_date(if_range);
+  return date > 0 &&
+    http_get_header(data, length, "Last-Modified", value, sizeof(value)) &&
+    http_parse_date(value) == date;
+}
@@ -0,0 +1,105 @@
+/*
+ * log-decode.c - Prints the records of binary access logs as text.
+ *
+ * The proxy writes its access log (see access_log.c) as fixed-size binary
+ * records, so that logging a request is a copy rather than formatting. This
+ * reads one or more of those files, for example a rotated file followed by
+ * the current one, and prints a line per request: either aligned columns or,
+ * with -c, CSV for other tools.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+
+static void usage(char* program) {
+  printf("Usage: %s [options] <log>...\n"
+         "Options:\n"
+         "  -c          print CSV instead of columns\n",
+         program);
+  exit(1);
+}
+
+/* Prints one record */
+static void print_record(access_record_t* record, bool csv) {
+  time_t seconds = record->time / 1000000000;
+  struct tm tm;
+  gmtime_r(&seconds, &tm);
+  char date[32];
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+  unsigned millis = record->time / 1000000 % 1000;
+  int key_length = strnlen(record->key, ACCESS_LOG_KEY_SIZE);
+  const char* outcome = access_log_outcome_name(record->outcome);
+  if (csv) {
+    printf("%s.%03uZ,%s,%u,%lu,%u,%u,%u,%u,\"%.*s\"\n", date, millis,
+           outcome, record->status, (unsigned long) record->bytes,
+           record->total_us, record->lookup_us, record->connect_us,
+           record->ttfb_us, key_length, record->key);
+  }
+  else {
+    printf("%s.%03uZ %-12s %3u %10lu %9uus (lookup %uus, connect %uus, "
+           "ttfb %uus) %.*s\n", date, millis, outcome, record->status,
+           (unsigned long) record->bytes, record->total_us, record->lookup_us,
+           record->connect_us, record->ttfb_us, key_length, record->key);
+  }
+}
+
+/* Prints every record of the log at path. Returns whether it is a log this
+ * tool can read. */
+static bool decode(char* path, bool csv) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+  uint8_t header[16];
+  uint32_t record_size;
+  if (fread(header, sizeof(header), 1, file) != 1 ||
+      memcmp(header, ACCESS_LOG_MAGIC, strlen(ACCESS_LOG_MAGIC)) != 0) {
+    fprintf(stderr, "%s: not an access log\n", path);
+    fclose(file);
+    return false;
+  }
+  memcpy(&record_size, header + strlen(ACCESS_LOG_MAGIC), sizeof(record_size));
+  if (record_size != sizeof(access_record_t)) {
+    fprintf(stderr, "%s: records of %u bytes, expected %zu\n", path,
+            record_size, sizeof(access_record_t));
+    fclose(file);
+    return false;
+  }
+  access_record_t record;
+  while (fread(&record, sizeof(record), 1, file) == 1) {
+    print_record(&record, csv);
+  }
+  fclose(file);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  bool csv = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "c")) != -1) {
+    switch (opt) {
+      case 'c': csv = true; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind == argc) {
+    usage(argv[0]);
+  }
+  if (csv) {
+    printf("time,outcome,status,bytes,total_us,lookup_us,connect_us,"
+           "ttfb_us,key\n");
+  }
+  bool success = true;
+  for (int i = optind; i < argc; i++) {
+    success = decode(argv[i], csv) && success;
+  }
+  return success ? 0 : 1;
+}
@@ -0,0 +1,278 @@
+/*
+ * metrics.c - Cheap counters and latency histograms for the proxy.
+ *
+ * Recording has to be cheap enough to sit on the hot path, so nothing here
+ * takes a lock. Every thread is assigned one of METRIC_SHARDS shards the first
+ * time it records something, and only ever adds to that shard with relaxed
+ * atomics. Shards are cache line aligned so threads on different shards never
+ * share a line. Threads pinned to a CPU (in per-core mode) use the shard of
+ * that CPU instead, so cores do not bounce each other's lines around. Reading
+ * a metric sums it over every shard on demand, which is only done when
+ * someone asks for the metrics page.
+ *
+ * Histograms use HDR-style log-linear buckets: every power of two is split
+ * into SUB_BUCKETS equal buckets, which keeps the relative error of every
+ * reported percentile under 1 / SUB_BUCKETS with a small, fixed number of
+ * buckets.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+/* Number of shards the threads are spread over */
+#define METRIC_SHARDS 32
+
+/* log2 of the number of buckets every power of two is split into */
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+
+/* Samples of 2^MAX_EXPONENT ns (about 68 seconds) or more go in the last bucket */
+#define MAX_EXPONENT 36
+#define HISTOGRAM_BUCKETS ((MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS)
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct histogram_t {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+typedef struct shard_t {
+  uint64_t counters[METRIC_COUNTERS];
+  histogram_t histograms[METRIC_HISTOGRAMS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) shard_t;
+
+static shard_t shards[METRIC_SHARDS];
+static uint64_t gauges[METRIC_GAUGES];
+
+/* The next shard to hand out, and the shard of the current thread */
+static unsigned next_shard = 0;
+static __thread shard_t* thread_shard = NULL;
+
+static const char* counter_names[METRIC_COUNTERS] = {
+  [METRIC_REQUESTS] = "requests",
+  [METRIC_HITS] = "cache_hits",
+  [METRIC_FRONT_HITS] = "cache_front_hits",
+  [METRIC_STALE_HITS] = "cache_stale_hits",
+  [METRIC_MISSES] = "cache_misses",
+  [METRIC_REVALIDATIONS] = "cache_revalidations",
+  [METRIC_NOT_MODIFIED] = "cache_not_modified",
+  [METRIC_PARTIAL_RESPONSES] = "partial_responses",
+  [METRIC_NEGATIVE_HITS] = "negative_hits",
+  [METRIC_PREFETCHES] = "prefetches",
+  [METRIC_EVICTIONS] = "cache_evictions",
+  [METRIC_INLINE_EVICTIONS] = "cache_inline_evictions",
+  [METRIC_DEDUP_HITS] = "cache_dedup_hits",
+  [METRIC_BYTES_SERVED] = "bytes_served",
+  [METRIC_BYTES_FETCHED] = "bytes_fetched",
+  [METRIC_UPSTREAM_ERRORS] = "upstream_errors",
+  [METRIC_UPSTREAM_TIMEOUTS] = "upstream_timeouts",
+  [METRIC_ORIGIN_REJECTED] = "origin_rejected",
+  [METRIC_SHED_MISSES] = "shed_misses",
+  [METRIC_ACCESS_LOG_DROPPED] = "access_log_dropped",
+};
+
+static const char* histogram_names[METRIC_HISTOGRAMS] = {
+  [METRIC_REQUEST_LATENCY] = "request_latency",
+  [METRIC_UPSTREAM_DNS] = "upstream_dns",
+  [METRIC_UPSTREAM_CONNECT] = "upstream_connect",
+  [METRIC_UPSTREAM_TTFB] = "upstream_ttfb",
+  [METRIC_LOCK_WAIT] = "table_lock_wait",
+  [METRIC_ADMISSION_WAIT] = "admission_wait",
+};
+
+static const char* gauge_names[METRIC_GAUGES] = {
+  [METRIC_CACHE_BYTES] = "cache_bytes",
+  [METRIC_CACHE_BUDGET] = "cache_budget",
+  [METRIC_DEDUP_BYTES] = "cache_dedup_bytes",
+};
+
+/* Returns the shard of the calling thread, assigning one if needed */
+static shard_t* get_shard(void) {
+  if (thread_shard == NULL) {
+    unsigned index = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED);
+    thread_shard = &shards[index % METRIC_SHARDS];
+  }
+  return thread_shard;
+}
+
+void metrics_bind_cpu(int cpu) {
+  thread_shard = &shards[cpu % METRIC_SHARDS];
+}
+
+/* Returns the bucket a sample falls in */
+static size_t bucket_index(uint64_t value) {
+  if (value < SUB_BUCKETS) {
+    return value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  if (exponent > MAX_EXPONENT) {
+    return HISTOGRAM_BUCKETS - 1;
+  }
+  int shift = exponent - SUB_BUCKET_BITS;
+  return (size_t) (shift + 1) * SUB_BUCKETS +
+         ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+/* Returns the largest value that falls in a bucket */
+static uint64_t bucket_upper_bound(size_t index) {
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  int shift = index / SUB_BUCKETS - 1;
+  uint64_t sub = SUB_BUCKETS + index % SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+uint64_t metrics_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void metrics_add(metric_counter_t counter, uint64_t amount) {
+  __atomic_fetch_add(&get_shard()->counters[counter], amount,
+                     __ATOMIC_RELAXED);
+}
+
+void metrics_record(metric_histogram_t histogram, uint64_t nanoseconds) {
+  histogram_t* h = &get_shard()->histograms[histogram];
+  __atomic_fetch_add(&h->buckets[bucket_index(nanoseconds)], 1,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, nanoseconds, __ATOMIC_RELAXED);
+  // The max only grows, so a racy check is enough to skip most updates
+  uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while (nanoseconds > max &&
+         !__atomic_compare_exchange_n(&h->max, &max, nanoseconds, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void metrics_record_since(metric_histogram_t histogram, uint64_t start) {
+  metrics_record(histogram, metrics_now() - start);
+}
+
+void metrics_set(metric_gauge_t gauge, uint64_t value) {
+  __atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_total(metric_counter_t counter) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < METRIC_SHARDS; i++) {
+    total += __atomic_load_n(&shards[i].counters[counter], __ATOMIC_RELAXED);
+  }
+  return total;
+}
+
+/* Sums a histogram over every shard into merged */
+static void merge_histogram(metric_histogram_t histogram, histogram_t* merged) {
+  memset(merged, 0, sizeof(*merged));
+  for (size_t i = 0; i < METRIC_SHARDS; i++) {
+    histogram_t* h = &shards[i].histograms[histogram];
+    merged->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    merged->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    if (max > merged->max) {
+      merged->max = max;
+    }
+    for (size_t j = 0; j < HISTOGRAM_BUCKETS; j++) {
+      merged->buckets[j] += __atomic_load_n(&h->buckets[j], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Returns the value at a quantile of a merged histogram */
+static uint64_t histogram_quantile(histogram_t* h, double quantile) {
+  uint64_t rank = (uint64_t) (quantile * h->count);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen > rank) {
+      uint64_t bound = bucket_upper_bound(i);
+      return bound < h->max ? bound : h->max;
+    }
+  }
+  return h->max;
+}
+
+/* Appends a printf-formatted string to out */
+__attribute__((format(printf, 2, 3)))
+static void append_format(buffer_t* out, const char* format, ...) {
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length > (int) sizeof(line) - 1) {
+    length = sizeof(line) - 1;
+  }
+  buffer_append_bytes(out, (uint8_t*) line, length);
+}
+
+/* Appends a histogram as a Prometheus histogram, in seconds. Only the bucket
+ * boundaries at powers of two are exposed to keep the output small. */
+static void render_prometheus_histogram(buffer_t* out, const char* name,
+                                        histogram_t* h) {
+  append_format(out, "# TYPE proxy_%s_seconds histogram\n", name);
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    cumulative += h->buckets[i];
+    if (i >= SUB_BUCKETS && i % SUB_BUCKETS == SUB_BUCKETS - 1) {
+      append_format(out, "proxy_%s_seconds_bucket{le=\"%.9f\"} %lu\n", name,
+                    (bucket_upper_bound(i) + 1) / 1e9, cumulative);
+    }
+  }
+  append_format(out, "proxy_%s_seconds_bucket{le=\"+Inf\"} %lu\n", name,
+                h->count);
+  append_format(out, "proxy_%s_seconds_sum %.9f\n", name, h->sum / 1e9);
+  append_format(out, "proxy_%s_seconds_count %lu\n", name, h->count);
+}
+
+void metrics_render(buffer_t* out, bool prometheus) {
+  for (size_t i = 0; i < METRIC_COUNTERS; i++) {
+    if (prometheus) {
+      append_format(out, "# TYPE proxy_%s_total counter\n", counter_names[i]);
+      append_format(out, "proxy_%s_total %lu\n", counter_names[i],
+                    metrics_total(i));
+    }
+    else {
+      append_format(out, "%-24s %lu\n", counter_names[i], metrics_total(i));
+    }
+  }
+  for (size_t i = 0; i < METRIC_GAUGES; i++) {
+    uint64_t value = __atomic_load_n(&gauges[i], __ATOMIC_RELAXED);
+    if (prometheus) {
+      append_format(out, "# TYPE proxy_%s gauge\n", gauge_names[i]);
+      append_format(out, "proxy_%s %lu\n", gauge_names[i], value);
+    }
+    else {
+      append_format(out, "%-24s %lu\n", gauge_names[i], value);
+    }
+  }
+
+  histogram_t merged;
+  for (size_t i = 0; i < METRIC_HISTOGRAMS; i++) {
+    merge_histogram(i, &merged);
+    if (prometheus) {
+      render_prometheus_histogram(out, histogram_names[i], &merged);
+      continue;
+    }
+    // Plain text reports the usual percentiles in microseconds
+    append_format(out,
+                  "%-24s count=%lu mean=%.1fus p50=%.1fus p99=%.1fus "
+                  "p999=%.1fus max=%.1fus\n",
+                  histogram_names[i], merged.count,
+                  merged.count ? merged.sum / 1e3 / merged.count : 0.0,
+                  histogram_quantile(&merged, 0.5) / 1e3,
+                  histogram_quantile(&merged, 0.99) / 1e3,
+                  histogram_quantile(&merged, 0.999) / 1e3,
+                  merged.max / 1e3);
+  }
+}
@@ -0,0 +1,98 @@
+/*
+ * origin.c - Per-origin accounting of requests in flight.
+ *
+ * Every request that goes to an origin server holds one of its slots for as
+ * long as it talks to it, so a single slow or hanging origin can only tie up
+ * a bounded number of threads and connections, leaving the rest of the proxy
+ * free to serve other origins.
+ *
+ * Origins are kept in a small chained hash table that only contains origins
+ * with requests in flight: an origin is added by its first request and
+ * removed again when its last request finishes. A single mutex protects the
+ * table, since it is only touched twice per upstream request.
+ *
+ * The proxy normally has one table. In per-core mode every core has its own
+ * (see client_thread.c), so cores never contend for the same mutex and each
+ * enforces its share of the limit.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "origin.h"
+
+#define ORIGIN_BUCKETS 61
+
+struct origin_t {
+  // "hostname[:port]" of the origin, as requested
+  char* host;
+  // Number of requests in flight
+  size_t active;
+  // The table the origin is in
+  struct origin_table_t* table;
+  struct origin_t* next;
+};
+
+struct origin_table_t {
+  origin_t* buckets[ORIGIN_BUCKETS];
+  pthread_mutex_t lock;
+};
+
+origin_table_t* origin_table_init(void) {
+  origin_table_t* table = calloc(1, sizeof(origin_table_t));
+  assert(table != NULL);
+  pthread_mutex_init(&table->lock, NULL);
+  return table;
+}
+
+origin_t* origin_acquire(origin_table_t* table, char* host,
+                         size_t max_active) {
+  size_t bucket = get_hash_code(host) % ORIGIN_BUCKETS;
+  pthread_mutex_lock(&table->lock);
+  origin_t* origin = table->buckets[bucket];
+  while (origin != NULL && strcmp(origin->host, host) != 0) {
+    origin = origin->next;
+  }
+  if (origin == NULL) {
+    origin = malloc(sizeof(origin_t));
+    assert(origin != NULL);
+    origin->host = strdup(host);
+    assert(origin->host != NULL);
+    origin->active = 0;
+    origin->table = table;
+    origin->next = table->buckets[bucket];
+    table->buckets[bucket] = origin;
+  }
+  else if (max_active > 0 && origin->active >= max_active) {
+    pthread_mutex_unlock(&table->lock);
+    return NULL;
+  }
+  origin->active++;
+  pthread_mutex_unlock(&table->lock);
+  return origin;
+}
+
+void origin_release(origin_t* origin) {
+  if (!origin) {
+    return;
+  }
+  origin_table_t* table = origin->table;
+  size_t bucket = get_hash_code(origin->host) % ORIGIN_BUCKETS;
+  pthread_mutex_lock(&table->lock);
+  if (--origin->active > 0) {
+    pthread_mutex_unlock(&table->lock);
+    return;
+  }
+  // Last request in flight, so the origin leaves the table
+  origin_t** curr = &table->buckets[bucket];
+  while (*curr != origin) {
+    curr = &(*curr)->next;
+  }
+  *curr = origin->next;
+  pthread_mutex_unlock(&table->lock);
+  free(origin->host);
+  free(origin);
+}
@@ -0,0 +1,172 @@
+/*
+ * prefetch.c - Finding the resources an HTML page embeds.
+ *
+ * A browser that receives a page asks for its stylesheets, scripts and
+ * images right away, so the proxy can fetch them into the cache while the
+ * page is still being sent. This is a deliberately small scanner rather
+ * than an HTML parser: it walks the tags of the page, takes the src
+ * attribute of every element and the href attribute of link elements (not
+ * of anchors, which are only followed when the user clicks them), and keeps
+ * the URLs that point to the page's own origin. Anything it does not
+ * understand is skipped, since a missed prefetch only costs a miss later.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "prefetch.h"
+
+/* Returns whether a tag or attribute name of length bytes at name is word */
+static bool is_name(uint8_t* name, size_t length, char* word) {
+  return length == strlen(word) && strncasecmp((char*) name, word, length) == 0;
+}
+
+/* Resolves a URL found on the page against the page's host and path. Returns
+ * the malloced path of the URL if it is on the same origin, or NULL. */
+static char* resolve_link(char* url, char* host, char* path) {
+  // Drop the fragment, which never reaches the server
+  char* fragment = strchr(url, '#');
+  if (fragment != NULL) {
+    *fragment = '\0';
+  }
+  if (url[0] == '\0') {
+    return NULL;
+  }
+
+  if (strncasecmp(url, "http://", strlen("http://")) == 0 ||
+      strncmp(url, "//", strlen("//")) == 0) {
+    // An absolute URL (or one relative to the scheme) on the same host
+    char* url_host = strstr(url, "//") + strlen("//");
+    char* url_path = strchr(url_host, '/');
+    size_t host_length = url_path != NULL ?
+      (size_t) (url_path - url_host) : strlen(url_host);
+    if (host_length != strlen(host) ||
+        strncasecmp(url_host, host, host_length) != 0) {
+      return NULL;
+    }
+    return strdup(url_path != NULL ? url_path : "/");
+  }
+  if (url[0] == '/') {
+    return strdup(url);
+  }
+  // Any other scheme (https:, data:, javascript:, ...) is not ours to fetch
+  char* colon = strchr(url, ':');
+  char* slash = strchr(url, '/');
+  if (colon != NULL && (slash == NULL || colon < slash)) {
+    return NULL;
+  }
+
+  // A path relative to the directory of the page
+  char* query = strchr(path, '?');
+  size_t path_length = query != NULL ? (size_t) (query - path) : strlen(path);
+  while (path_length > 0 && path[path_length - 1] != '/') {
+    path_length--;
+  }
+  char* resolved = malloc(path_length + strlen(url) + 1);
+  if (resolved == NULL) {
+    return NULL;
+  }
+  memcpy(resolved, path, path_length);
+  strcpy(resolved + path_length, url);
+  return resolved;
+}
+
+/* Stores the path of a link in paths unless it is already there. Returns
+ * whether it was stored. */
+static bool add_link(char** paths, size_t count, char* link) {
+  for (size_t i = 0; i < count; i++) {
+    if (strcmp(paths[i], link) == 0) {
+      return false;
+    }
+  }
+  paths[count] = link;
+  return true;
+}
+
+size_t prefetch_find_links(uint8_t* html, size_t length, char* host,
+                           char* path, char** paths, size_t max) {
+  uint8_t* end = html + length;
+  uint8_t* curr = html;
+  size_t count = 0;
+  while (count < max &&
+         (curr = memchr(curr, '<', end - curr)) != NULL) {
+    // The tag name
+    uint8_t* tag = ++curr;
+    while (curr < end && isalnum(*curr)) {
+      curr++;
+    }
+    size_t tag_length = curr - tag;
+    if (tag_length == 0) {
+      // A closing tag, a comment or a doctype
+      continue;
+    }
+    bool is_link = is_name(tag, tag_length, "link");
+
+    // The attributes, up to the end of the tag
+    while (curr < end && *curr != '>') {
+      if (!isalpha(*curr)) {
+        curr++;
+        continue;
+      }
+      uint8_t* name = curr;
+      while (curr < end && (isalnum(*curr) || *curr == '-')) {
+        curr++;
+      }
+      size_t name_length = curr - name;
+      while (curr < end && isspace(*curr)) {
+        curr++;
+      }
+      if (curr == end || *curr != '=') {
+        continue;
+      }
+      curr++;
+      while (curr < end && isspace(*curr)) {
+        curr++;
+      }
+
+      // The value, quoted or not
+      uint8_t* value = curr;
+      uint8_t* value_end;
+      if (curr < end && (*curr == '"' || *curr == '\'')) {
+        value++;
+        value_end = memchr(value, *curr, end - value);
+        if (value_end == NULL) {
+          return count;
+        }
+        curr = value_end + 1;
+      }
+      else {
+        while (curr < end && !isspace(*curr) && *curr != '>') {
+          curr++;
+        }
+        value_end = curr;
+      }
+
+      bool wanted = is_name(name, name_length, "src") ||
+        (is_link && is_name(name, name_length, "href"));
+      size_t value_length = value_end - value;
+      if (!wanted || value_length == 0 || value_length >= MAX_PREFETCH_PATH) {
+        continue;
+      }
+      char url[MAX_PREFETCH_PATH];
+      memcpy(url, value, value_length);
+      url[value_length] = '\0';
+      char* link = resolve_link(url, host, path);
+      if (link != NULL) {
+        if (add_link(paths, count, link)) {
+          count++;
+        }
+        else {
+          free(link);
+        }
+      }
+      if (count == max) {
+        break;
+      }
+    }
+  }
+  return count;
+}
@@ -1,6 +1,10 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <getopt.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -10,15 +14,66 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "access_log.h"
+#include "budget.h"
 #include "client_thread.h"
+#include "config.h"
 #include "hash.h"
+#include "uring.h"
 
 /* Maximum number of connections to queue up */
 #define LISTENQ 1024
 
-hash_t* cache = NULL;
+/* The least a per-core cache shard holds, however many cores share the cache
+ * budget, so that every shard can still keep a handful of the largest
+ * objects we cache */
+#define MIN_SHARD_CAPACITY (8 * MAX_OBJECT_SIZE)
+
+/* Milliseconds between two adaptations of the cache budget */
+#define BUDGET_INTERVAL 1000
+
+/* A listening socket, the shard serving the connections it accepts and the
+ * CPU its threads are pinned to (or -1) */
+typedef struct listener_t {
+    int listen_fd;
+    proxy_shard_t *shard;
+    int cpu;
+} listener_t;
+
+proxy_config_t config = {
+    .stale_while_revalidate = DEFAULT_STALE_WHILE_REVALIDATE,
+    .stale_if_error = DEFAULT_STALE_IF_ERROR,
+    .connect_timeout = DEFAULT_CONNECT_TIMEOUT,
+    .first_byte_timeout = DEFAULT_FIRST_BYTE_TIMEOUT,
+    .idle_timeout = DEFAULT_IDLE_TIMEOUT,
+    .origin_concurrency = DEFAULT_ORIGIN_CONCURRENCY,
+    .miss_concurrency = DEFAULT_MISS_CONCURRENCY,
+    .miss_queue_delay = DEFAULT_MISS_QUEUE_DELAY,
+    .cache_size = MAX_CACHE_SIZE,
+    .high_watermark = DEFAULT_HIGH_WATERMARK,
+    .low_watermark = DEFAULT_LOW_WATERMARK,
+    .dns_threads = DEFAULT_DNS_THREADS,
+    .dns_server = NULL,
+    .per_core = false,
+    .uring_accept = false,
+    .negative_ttl = DEFAULT_NEGATIVE_TTL,
+    .negative_cache_size = DEFAULT_NEGATIVE_CACHE_SIZE,
+    .negative_statuses = DEFAULT_NEGATIVE_STATUSES,
+    .prefetch_concurrency = 0,
+    .prefetch_budget = DEFAULT_PREFETCH_BUDGET,
+    .sort_query = false,
+    .strip_query_params = NULL,
+    .access_log = NULL,
+    .access_log_size = DEFAULT_ACCESS_LOG_SIZE,
+    .adaptive_cache = false,
+    .cgroup = NULL,
+    .warm_up = NULL,
+    .warm_up_concurrency = DEFAULT_WARM_UP_CONCURRENCY,
+    .warm_up_budget = 0,
+    .warm_up_ready = DEFAULT_WARM_UP_READY,
+};
 
-static int open_listen_fd(int port) {
+static int open_listen_fd(int port, bool reuse_port) {
     /* Create a socket descriptor */
     int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_fd < 0) {
@@ -31,6 +86,13 @@ static int open_listen_fd(int port) {
         return -1;
     }
 
+    /* Lets several sockets listen on the same port, with the kernel
+     * spreading incoming connections over them */
+    if (reuse_port &&
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) < 0) {
+        return -1;
+    }
+
     /* listen_fd will be an endpoint for all requests to port
        on any IP address for this host */
     struct sockaddr_in server_addr;
@@ -51,6 +113,7 @@ static int open_listen_fd(int port) {
 }
 
 static void cleanup(void) {
+    access_log_flush();
 }
 
 static void sigint_handler(int sig) {
@@ -59,29 +122,416 @@ static void sigint_handler(int sig) {
 }
 
 static void usage(char *program) {
-    printf("Usage: %s <port>\n", program);
+    printf("Usage: %s [options] <port>\n"
+           "Options:\n"
+           "  --stale-while-revalidate <seconds>\n"
+           "      serve stale responses while refreshing them (default %d)\n"
+           "  --stale-if-error <seconds>\n"
+           "      serve stale responses when the origin fails (default %d)\n"
+           "  --connect-timeout <ms>\n"
+           "      time allowed to connect to an origin (default %d)\n"
+           "  --first-byte-timeout <ms>\n"
+           "      time allowed until the origin starts answering (default %d)\n"
+           "  --idle-timeout <ms>\n"
+           "      time allowed between reads from the origin (default %d)\n"
+           "  --origin-concurrency <requests>\n"
+           "      requests in flight to a single origin, 0 for no limit "
+           "(default %d)\n"
+           "  --miss-concurrency <requests>\n"
+           "      requests fetching from any origin at once, 0 for no limit "
+           "(default %d)\n"
+           "  --miss-queue-delay <ms>\n"
+           "      time a miss may wait to fetch before it is shed (default "
+           "%d)\n"
+           "  --cache-size <bytes>\n"
+           "      bytes cached in total (default %d)\n"
+           "  --high-watermark <percent>\n"
+           "      evict in the background once the cache is this full, 0 to "
+           "only\n"
+           "      evict when inserting into a full cache (default %d)\n"
+           "  --low-watermark <percent>\n"
+           "      stop evicting in the background at this (default %d)\n"
+           "  --dns-threads <threads>\n"
+           "      threads resolving origin host names (default %d)\n"
+           "  --dns-server <address[:port]|system>\n"
+           "      query this DNS server directly instead of using "
+           "getaddrinfo;\n"
+           "      system is the first nameserver in /etc/resolv.conf\n"
+           "  --per-core\n"
+           "      run one listener, accept loop and cache shard per CPU, "
+           "splitting\n"
+           "      the cache size and origin concurrency between them\n"
+           "  --uring-accept\n"
+           "      accept connections through an io_uring multishot accept "
+           "when the\n"
+           "      kernel supports it; requests are still read and answered "
+           "with\n"
+           "      plain system calls\n"
+           "  --negative-ttl <seconds>\n"
+           "      remember origin failures and error responses this long, 0 "
+           "to\n"
+           "      always try again (default %d)\n"
+           "  --negative-cache-size <bytes>\n"
+           "      bytes of remembered failures and error responses "
+           "(default %d)\n"
+           "  --negative-statuses <status,...>\n"
+           "      response statuses to remember (default %s)\n"
+           "  --prefetch-concurrency <threads>\n"
+           "      prefetch the resources of cached HTML pages on this many "
+           "threads,\n"
+           "      0 not to prefetch (default 0)\n"
+           "  --prefetch-budget <bytes>\n"
+           "      bytes prefetched for one page (default %d)\n"
+           "  --sort-query\n"
+           "      sort the query parameters of URLs in cache keys\n"
+           "  --strip-query-params <name,...>\n"
+           "      leave these query parameters out of cache keys, where "
+           "name* stands\n"
+           "      for every name starting with name (e.g. utm_*,fbclid,gclid)\n"
+           "  --access-log <file>\n"
+           "      log every request to this file in binary, to be read with "
+           "log-decode\n"
+           "  --access-log-size <bytes>\n"
+           "      move the access log to <file>.1 when it grows past this "
+           "(default %d)\n"
+           "  --adaptive-cache\n"
+           "      shrink the cache when the cgroup is under memory pressure "
+           "and grow\n"
+           "      it back up to the cache size when the pressure clears\n"
+           "  --cgroup <dir>\n"
+           "      adapt the cache to the memory of this cgroup v2 directory "
+           "instead\n"
+           "      of the proxy's own\n"
+           "  --warm-up <file>\n"
+           "      fetch the URLs listed in file (host[:port]/path per line) "
+           "into the\n"
+           "      cache at startup, each once, copied into every shard with "
+           "--per-core\n"
+           "  --warm-up-concurrency <threads>\n"
+           "      threads fetching them (default %d)\n"
+           "  --warm-up-budget <bytes>\n"
+           "      bytes fetched at most across all shards, 0 for the cache "
+           "size\n"
+           "      (default 0)\n"
+           "  --warm-up-ready <percent>\n"
+           "      share of the URLs done before /ready answers 200 (default "
+           "%d)\n",
+           program, DEFAULT_STALE_WHILE_REVALIDATE, DEFAULT_STALE_IF_ERROR,
+           DEFAULT_CONNECT_TIMEOUT, DEFAULT_FIRST_BYTE_TIMEOUT,
+           DEFAULT_IDLE_TIMEOUT, DEFAULT_ORIGIN_CONCURRENCY,
+           DEFAULT_MISS_CONCURRENCY, DEFAULT_MISS_QUEUE_DELAY, MAX_CACHE_SIZE,
+           DEFAULT_HIGH_WATERMARK, DEFAULT_LOW_WATERMARK,
+           DEFAULT_DNS_THREADS, DEFAULT_NEGATIVE_TTL,
+           DEFAULT_NEGATIVE_CACHE_SIZE, DEFAULT_NEGATIVE_STATUSES,
+           DEFAULT_PREFETCH_BUDGET, DEFAULT_ACCESS_LOG_SIZE,
+           DEFAULT_WARM_UP_CONCURRENCY, DEFAULT_WARM_UP_READY);
     exit(1);
 }
 
+/* Parses the non-negative number given to an option, or exits */
+static long parse_number(char *program, char *arg) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*end != '\0' || value < 0) {
+        usage(program);
+    }
+    return value;
+}
+
+/* Checks that a list of statuses is numbers from 100 to 599 separated by
+ * commas, or exits */
+static char *parse_statuses(char *program, char *arg) {
+    char *curr = arg;
+    do {
+        char *end;
+        long status = strtol(curr, &end, 10);
+        if (end == curr || status < 100 || status > 599 ||
+            (*end != ',' && *end != '\0')) {
+            usage(program);
+        }
+        curr = end + 1;
+    } while (curr[-1] == ',');
+    return arg;
+}
+
+/* Fills in the global config from the command line options and returns the
+ * index of the first non-option argument */
+static int parse_options(int argc, char *argv[]) {
+    enum {
+        STALE_WHILE_REVALIDATE = 256, STALE_IF_ERROR, CONNECT_TIMEOUT,
+        FIRST_BYTE_TIMEOUT, IDLE_TIMEOUT, ORIGIN_CONCURRENCY, MISS_CONCURRENCY,
+        MISS_QUEUE_DELAY, CACHE_SIZE, DNS_THREADS, DNS_SERVER, PER_CORE,
+        URING_ACCEPT, NEGATIVE_TTL, NEGATIVE_CACHE_SIZE, NEGATIVE_STATUSES,
+        PREFETCH_CONCURRENCY, PREFETCH_BUDGET, SORT_QUERY, STRIP_QUERY_PARAMS,
+        ACCESS_LOG, ACCESS_LOG_SIZE, ADAPTIVE_CACHE, CGROUP, HIGH_WATERMARK,
+        LOW_WATERMARK, WARM_UP, WARM_UP_CONCURRENCY, WARM_UP_BUDGET,
+        WARM_UP_READY
+    };
+    static struct option options[] = {
+        { "stale-while-revalidate", required_argument, NULL,
+          STALE_WHILE_REVALIDATE },
+        { "stale-if-error", required_argument, NULL, STALE_IF_ERROR },
+        { "connect-timeout", required_argument, NULL, CONNECT_TIMEOUT },
+        { "first-byte-timeout", required_argument, NULL, FIRST_BYTE_TIMEOUT },
+        { "idle-timeout", required_argument, NULL, IDLE_TIMEOUT },
+        { "origin-concurrency", required_argument, NULL, ORIGIN_CONCURRENCY },
+        { "miss-concurrency", required_argument, NULL, MISS_CONCURRENCY },
+        { "miss-queue-delay", required_argument, NULL, MISS_QUEUE_DELAY },
+        { "cache-size", required_argument, NULL, CACHE_SIZE },
+        { "high-watermark", required_argument, NULL, HIGH_WATERMARK },
+        { "low-watermark", required_argument, NULL, LOW_WATERMARK },
+        { "dns-threads", required_argument, NULL, DNS_THREADS },
+        { "dns-server", required_argument, NULL, DNS_SERVER },
+        { "per-core", no_argument, NULL, PER_CORE },
+        { "uring-accept", no_argument, NULL, URING_ACCEPT },
+        { "negative-ttl", required_argument, NULL, NEGATIVE_TTL },
+        { "negative-cache-size", required_argument, NULL,
+          NEGATIVE_CACHE_SIZE },
+        { "negative-statuses", required_argument, NULL, NEGATIVE_STATUSES },
+        { "prefetch-concurrency", required_argument, NULL,
+          PREFETCH_CONCURRENCY },
+        { "prefetch-budget", required_argument, NULL, PREFETCH_BUDGET },
+        { "sort-query", no_argument, NULL, SORT_QUERY },
+        { "strip-query-params", required_argument, NULL,
+          STRIP_QUERY_PARAMS },
+        { "access-log", required_argument, NULL, ACCESS_LOG },
+        { "access-log-size", required_argument, NULL, ACCESS_LOG_SIZE },
+        { "adaptive-cache", no_argument, NULL, ADAPTIVE_CACHE },
+        { "cgroup", required_argument, NULL, CGROUP },
+        { "warm-up", required_argument, NULL, WARM_UP },
+        { "warm-up-concurrency", required_argument, NULL,
+          WARM_UP_CONCURRENCY },
+        { "warm-up-budget", required_argument, NULL, WARM_UP_BUDGET },
+        { "warm-up-ready", required_argument, NULL, WARM_UP_READY },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case STALE_WHILE_REVALIDATE:
+                config.stale_while_revalidate = parse_number(argv[0], optarg);
+                break;
+            case STALE_IF_ERROR:
+                config.stale_if_error = parse_number(argv[0], optarg);
+                break;
+            case CONNECT_TIMEOUT:
+                config.connect_timeout = parse_number(argv[0], optarg);
+                break;
+            case FIRST_BYTE_TIMEOUT:
+                config.first_byte_timeout = parse_number(argv[0], optarg);
+                break;
+            case IDLE_TIMEOUT:
+                config.idle_timeout = parse_number(argv[0], optarg);
+                break;
+            case ORIGIN_CONCURRENCY:
+                config.origin_concurrency = parse_number(argv[0], optarg);
+                break;
+            case MISS_CONCURRENCY:
+                config.miss_concurrency = parse_number(argv[0], optarg);
+                break;
+            case MISS_QUEUE_DELAY:
+                config.miss_queue_delay = parse_number(argv[0], optarg);
+                break;
+            case CACHE_SIZE:
+                config.cache_size = parse_number(argv[0], optarg);
+                break;
+            case HIGH_WATERMARK:
+                config.high_watermark = parse_number(argv[0], optarg);
+                break;
+            case LOW_WATERMARK:
+                config.low_watermark = parse_number(argv[0], optarg);
+                break;
+            case DNS_THREADS:
+                config.dns_threads = parse_number(argv[0], optarg);
+                break;
+            case DNS_SERVER:
+                config.dns_server = optarg;
+                break;
+            case PER_CORE:
+                config.per_core = true;
+                break;
+            case URING_ACCEPT:
+                config.uring_accept = true;
+                break;
+            case NEGATIVE_TTL:
+                config.negative_ttl = parse_number(argv[0], optarg);
+                break;
+            case NEGATIVE_CACHE_SIZE:
+                config.negative_cache_size = parse_number(argv[0], optarg);
+                break;
+            case NEGATIVE_STATUSES:
+                config.negative_statuses = parse_statuses(argv[0], optarg);
+                break;
+            case PREFETCH_CONCURRENCY:
+                config.prefetch_concurrency = parse_number(argv[0], optarg);
+                break;
+            case PREFETCH_BUDGET:
+                config.prefetch_budget = parse_number(argv[0], optarg);
+                break;
+            case SORT_QUERY:
+                config.sort_query = true;
+                break;
+            case STRIP_QUERY_PARAMS:
+                config.strip_query_params = optarg;
+                break;
+            case ACCESS_LOG:
+                config.access_log = optarg;
+                break;
+            case ACCESS_LOG_SIZE:
+                config.access_log_size = parse_number(argv[0], optarg);
+                break;
+            case ADAPTIVE_CACHE:
+                config.adaptive_cache = true;
+                break;
+            case CGROUP:
+                config.cgroup = optarg;
+                break;
+            case WARM_UP:
+                config.warm_up = optarg;
+                break;
+            case WARM_UP_CONCURRENCY:
+                config.warm_up_concurrency = parse_number(argv[0], optarg);
+                break;
+            case WARM_UP_BUDGET:
+                config.warm_up_budget = parse_number(argv[0], optarg);
+                break;
+            case WARM_UP_READY:
+                config.warm_up_ready = parse_number(argv[0], optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (config.high_watermark > 100 ||
+        (config.high_watermark > 0 &&
+         config.low_watermark > config.high_watermark) ||
+        config.warm_up_ready > 100) {
+        usage(argv[0]);
+    }
+    return optind;
+}
+
+/* Accepts connections on a listener forever, handling each one on a new
+ * thread. When the listener has a CPU, this thread and (by inheritance) the
+ * threads it creates only run on that CPU. With --uring-accept, connections
+ * are reaped from an io_uring multishot accept, if the kernel has io_uring. */
+static void *accept_loop(void *arg) {
+    listener_t *listener = arg;
+    if (listener->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(listener->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+    uring_acceptor_t *acceptor =
+        config.uring_accept ? uring_acceptor_init(listener->listen_fd) : NULL;
+
+    while (true) {
+        connection_t *connection = malloc(sizeof(connection_t));
+        assert(connection != NULL);
+        connection->client_fd = acceptor != NULL ?
+            uring_accept(acceptor) : accept(listener->listen_fd, NULL, NULL);
+        if (connection->client_fd == -1) {
+            perror("Accept error");
+            free(connection);
+            continue;
+        }
+        connection->shard = listener->shard;
+        // Creates a thread to handle connection request
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, handle_request, connection) != 0) {
+            close(connection->client_fd);
+            free(connection);
+        }
+    }
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
     /* Ignore broken pipes */
     signal(SIGPIPE, SIG_IGN);
     /* Stop process when CTRL+C is pressed */
     signal(SIGINT, sigint_handler);
 
-    if (argc != 2) {
+    int arg = parse_options(argc, argv);
+    if (argc - arg != 1) {
         usage(argv[0]);
     }
 
-    int port = atoi(argv[1]);
+    int port = atoi(argv[arg]);
     if (port <= 0 || port > 65535) {
         usage(argv[0]);
     }
 
-    /* Open listen socket */
-    int listen_fd = open_listen_fd(port);
-    if (listen_fd < 0) {
-        perror("Listen error");
+    if (config.access_log != NULL &&
+        !access_log_open(config.access_log, config.access_log_size)) {
+        perror("Access log");
+        return 1;
+    }
+
+    /* In per-core mode, every CPU we may run on gets its own listener and
+     * shard with a private share of the cache, of the origin and miss
+     * concurrency and of the resolver threads, so connections never share state across cores
+     * on the hot path.
+     * Otherwise a single listener and shard serve everything. */
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (config.per_core &&
+        sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+        perror("sched_getaffinity");
+        return 1;
+    }
+    int count = config.per_core ? CPU_COUNT(&cpus) : 1;
+    listener_t *listeners = malloc(count * sizeof(listener_t));
+    assert(listeners != NULL);
+    hash_t **caches = malloc(count * sizeof(hash_t *));
+    assert(caches != NULL);
+    size_t shard_capacity = config.cache_size / count;
+    if (config.per_core && shard_capacity < MIN_SHARD_CAPACITY) {
+        shard_capacity = MIN_SHARD_CAPACITY;
+    }
+    size_t negative_capacity = config.negative_cache_size / count;
+    size_t origin_concurrency = (config.origin_concurrency + count - 1) / count;
+    size_t miss_concurrency = (config.miss_concurrency + count - 1) / count;
+    size_t dns_threads = (config.dns_threads + count - 1) / count;
+    for (int i = 0, cpu = 0; i < count; i++, cpu++) {
+        while (config.per_core && !CPU_ISSET(cpu, &cpus)) {
+            cpu++;
+        }
+        listeners[i].cpu = config.per_core ? cpu : -1;
+        listeners[i].listen_fd = open_listen_fd(port, config.per_core);
+        if (listeners[i].listen_fd < 0) {
+            perror("Listen error");
+            return 1;
+        }
+        resolver_t *resolver = resolver_init(dns_threads, config.dns_server);
+        if (resolver == NULL) {
+            fprintf(stderr, "Invalid DNS server: %s\n", config.dns_server);
+            return 1;
+        }
+        caches[i] = hash_init_with_capacity(shard_capacity);
+        if (config.high_watermark > 0) {
+            hash_start_reclaimer(caches[i], config.low_watermark,
+                                 config.high_watermark);
+        }
+        listeners[i].shard =
+            shard_init(caches[i],
+                       hash_init_with_capacity(negative_capacity),
+                       listeners[i].cpu, origin_concurrency,
+                       admission_init(miss_concurrency,
+                                      config.miss_queue_delay),
+                       resolver);
+    }
+
+    if (config.adaptive_cache &&
+        budget_start(config.cgroup, caches, count, BUDGET_INTERVAL) == NULL) {
+        fprintf(stderr, "Cannot read the memory pressure of the cgroup\n");
+        return 1;
+    }
+
+    if (config.warm_up != NULL && !start_warm_up(config.warm_up)) {
+        perror("Warm-up list");
         return 1;
     }
 
@@ -91,26 +541,15 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Initializes an array of pthread_t of size LISTENQ
-    pthread_t tid[LISTENQ];
-
-    // Initializing the cache
-    if (!cache) {
-      cache = hash_init();
+    if (config.per_core) {
+        printf("Proxy listening on port %d with %d cores\n", port, count);
     }
-
-    printf("Proxy listening on port %d\n", port);
-    while (true) {
-        int *cfd = malloc(sizeof(int));
-        assert(cfd != NULL);
-        *cfd = accept(listen_fd, NULL, NULL);
-        if (*cfd == -1) {
-            perror("Accept error");
-            free(cfd);
-            continue;
-        }
-        // Creates a thread to handle connection request
-        pthread_create(&tid[listen_fd], NULL, handle_request, cfd);
+    else {
+        printf("Proxy listening on port %d\n", port);
+    }
+    for (int i = 1; i < count; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, accept_loop, &listeners[i]);
     }
-    hash_free(cache);
+    accept_loop(&listeners[0]);
 }
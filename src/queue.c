@@ -12,7 +12,18 @@
  * the head, tail and all the next and previous pointers accordingly. Each
  * time remove is called, the queue is looped over to find the least recent node
  * based on the its timestamp, and this least recent node is removed and freed
- * accordingly.
+ * accordingly. A node can also be removed by key, which is used when a cached
+ * response is replaced by a newer copy.
+ *
+ * Every node keeps its own copy of the key, so callers remain responsible for
+ * the key string they pass in. A node may hand the body of its response off
+ * to a body_t shared with other nodes (see body.c), in which case its value
+ * only holds the headers, and it releases the body when it is freed.
+ *
+ * A node whose response was copied into the front caches is marked hot, and
+ * freeing or changing a hot node advances a global epoch that tells the front
+ * caches their copies may be out of date. Cold nodes never touch the epoch,
+ * so the front caches stay valid while the rest of the cache churns.
  *
  * This implementation is correct and effective.
  */
@@ -30,23 +41,48 @@ struct node_t {
   char* key;
   // A byte array storing the byte values
   buffer_t* value;
+  // The body following the bytes of value, if it is shared, or NULL
+  body_t* body;
+  // HTTP freshness metadata of the stored response
+  freshness_t meta;
   // Timestamp to keep track of the last time accessed
-  clock_t timestamp;
+  uint64_t timestamp;
+  // Whether a front cache holds a copy of the node
+  bool hot;
   // Pointer to previous node
   struct node_t *prev;
   // Pointer to next node
   struct node_t *next;
 };
 
+/* A logical clock used for the node timestamps. clock() only has a resolution
+ * of a few milliseconds of CPU time, so accesses close together used to get
+ * the same timestamp and the LRU order between them was lost.
+ */
+static uint64_t access_clock = 0;
+
+/* Returns the next timestamp of the logical clock */
+static uint64_t tick(void) {
+  return __atomic_add_fetch(&access_clock, 1, __ATOMIC_RELAXED);
+}
+
+/* Advanced whenever a hot node is freed or changed. Kept on a cache line of
+ * its own, since every front cache hit reads it. */
+static uint64_t hot_epoch __attribute__((aligned(64))) = 0;
+
 // Construct for a node_t
 node_t* node_init(char* key, buffer_t* value) {
   node_t *node = malloc(sizeof(node_t));
   assert (node != NULL);
-  node->key = key;
+  node->key = strdup(key);
+  assert (node->key != NULL);
   node->value = value;
+  node->body = NULL;
+  memset(&node->meta, 0, sizeof(node->meta));
   node->prev = NULL;
   node->next = NULL;
   node->timestamp = 0;
+  node->hot = false;
   return node;
 }
 
@@ -55,7 +91,10 @@ void node_free(node_t* node) {
   if (!node) {
     return;
   }
+  node_changed(node);
+  body_release(node->body);
   buffer_free(node->value);
+  free(node->key);
   free(node);
 }
 
@@ -91,11 +130,47 @@ buffer_t* get_value(node_t* node) {
   return node->value;
 }
 
+/* Returns the shared body of a node, or NULL */
+body_t* get_body(node_t* node) {
+  return node->body;
+}
+
+void set_body(node_t* node, body_t* body) {
+  node->body = body;
+}
+
+/* Returns the length of the whole response of a node */
+size_t get_length(node_t* node) {
+  return buffer_length(node->value) +
+    (node->body != NULL ? body_length(node->body) : 0);
+}
+
+/* Returns the freshness metadata of a node */
+freshness_t* get_meta(node_t* node) {
+  return &node->meta;
+}
+
 /* Returns the timestamp of a node */
-clock_t get_timestamp(node_t* node) {
+uint64_t get_timestamp(node_t* node) {
   return node->timestamp;
 }
 
+/* Nodes are marked under the read lock of their table, so the flag is stored
+ * atomically */
+void mark_hot(node_t* node) {
+  __atomic_store_n(&node->hot, true, __ATOMIC_RELAXED);
+}
+
+void node_changed(node_t* node) {
+  if (__atomic_load_n(&node->hot, __ATOMIC_RELAXED)) {
+    __atomic_add_fetch(&hot_epoch, 1, __ATOMIC_RELEASE);
+  }
+}
+
+uint64_t get_hot_epoch(void) {
+  return __atomic_load_n(&hot_epoch, __ATOMIC_ACQUIRE);
+}
+
 /* Returns whether or not the queue contains a node with the given key */
 bool queue_contains(queue_t* queue, char* key) {
   return queue_get(queue, key) != NULL;
@@ -103,23 +178,14 @@ bool queue_contains(queue_t* queue, char* key) {
 
 /* Returns the node from the queue given a key */
 node_t* queue_get(queue_t* queue, char* key) {
-  // If queue is empty, then returns NULL
-  if (!queue->head) {
-    return NULL;
-  }
-  node_t* curr = queue->head;
-  curr->timestamp = clock();
-  // If the head's key matches the given key, then return current node
-  if (strcmp(curr->key, key) == 0) {
-    return curr;
-  }
-  /* Else, loop through the queue and checks if any of the node's key matches
-   * the given key
+  /* Loop through the queue and checks if any of the node's key matches the
+   * given key. Only the matching node counts as accessed; the nodes we walk
+   * past on the way are not used, so their timestamps are left alone.
+   * Lookups run under the read lock, so the timestamp is stored atomically.
    */
-  while (curr->next != NULL) {
-    curr = curr->next;
-    curr->timestamp = clock();
+  for (node_t* curr = queue->head; curr != NULL; curr = curr->next) {
     if (strcmp(curr->key, key) == 0) {
+      __atomic_store_n(&curr->timestamp, tick(), __ATOMIC_RELAXED);
       return curr;
     }
   }
@@ -134,14 +200,14 @@ void enqueue(queue_t* queue, node_t* node) {
   if(!queue->head) {
     queue->head = node;
     queue->tail = node;
-    node->timestamp = clock();
+    node->timestamp = tick();
   }
   /* Else, updates the queue accordingly and updates the timestamp. */
   else {
     node->prev = tail;
     tail->next = node;
     queue->tail = node;
-    node->timestamp = clock();
+    node->timestamp = tick();
   }
 }
 
@@ -156,7 +222,7 @@ node_t* find_least_recent_node(queue_t* queue) {
   else {
     // Loops over queue and check minimum timestamp
     node_t* curr = queue->head;
-    clock_t min_time = curr->timestamp;
+    uint64_t min_time = curr->timestamp;
     min_node = curr;
     while (curr->next != NULL) {
       curr = curr->next;
@@ -169,64 +235,53 @@ node_t* find_least_recent_node(queue_t* queue) {
   return min_node;
 }
 
+/* Unlinks a node from the queue, frees it and returns the number of bytes
+ * freed: the buffer size of its value, plus the length of its body if no
+ * other node shares it.
+ */
+static size_t unlink_node(queue_t* queue, node_t* node) {
+  size_t buf_length = buffer_length(node->value) + body_release(node->body);
+  node->body = NULL;
+  // Points the neighbours (or the head and tail) past the node
+  if (node->prev != NULL) {
+    node->prev->next = node->next;
+  }
+  else {
+    queue->head = node->next;
+  }
+  if (node->next != NULL) {
+    node->next->prev = node->prev;
+  }
+  else {
+    queue->tail = node->prev;
+  }
+  // Resets the next and prev pointers of the node
+  node->next = NULL;
+  node->prev = NULL;
+  node_free(node);
+  return buf_length;
+}
+
 /* Randomly evicts a LRU element from the queue. */
 size_t queue_remove(queue_t* queue) {
-  node_t* head = queue->head;
-  node_t* tail = queue->tail;
   node_t* min_node = find_least_recent_node(queue);
   // If queue is empty, then return 0.
   if (!min_node) {
     return 0;
   }
-  size_t buf_length;
-  // If min_node is the only element in the queue, then free it
-  if (min_node == head && !head->next) {
-    buf_length = buffer_length(head->value);
-    queue->head = NULL;
-    node_free(head);
-  }
-  // If min_node is an element in the queue and there is a next pointer
-  else if (min_node == head && head->next != NULL) {
-    buf_length = buffer_length(head->value);
-    // Retrieves the next element
-    node_t* next = head->next;
-    // Sets next pointer of current head to NULL
-    head->next = NULL;
-    // Sets prev pointer of next to NULL
-    next->prev = NULL;
-    // Sets new head to next element
-    queue->head = next;
-    // Frees the head
-    node_free(head);
-  }
-  // If min_node is the tail (or last element)
-  else if (min_node == tail) {
-    buf_length = buffer_length(tail->value);
-    // Retrieves previous element
-    node_t* prev = tail->prev;
-    // Sets the next pointer of previous element to NULL
-    prev->next = NULL;
-    // Sets prev pointer of the tail to NULL
-    tail->prev = NULL;
-    // Sets new tail to previous element
-    queue->tail = prev;
-    // Frees the tail
-    node_free(tail);
-  }
-  // If min_node has both a next and prev pointer
-  else {
-    buf_length = buffer_length(min_node->value);
-    // Retrieves both next and prev element
-    node_t* next = min_node->next;
-    node_t* prev = min_node->prev;
-    prev->next = next;
-    next->prev = prev;
-    // Resets the next and prev pointers of the min_node
-    min_node->next = NULL;
-    min_node->prev = NULL;
-    node_free(min_node);
+  return unlink_node(queue, min_node);
+}
+
+/* Removes the node with the given key, if there is one, and returns the buffer
+ * size of the value removed.
+ */
+size_t queue_delete(queue_t* queue, char* key) {
+  for (node_t* curr = queue->head; curr != NULL; curr = curr->next) {
+    if (strcmp(curr->key, key) == 0) {
+      return unlink_node(queue, curr);
+    }
   }
-  return buf_length;
+  return 0;
 }
 
 /* Functions used to test the node and queue implementation */
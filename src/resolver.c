@@ -0,0 +1,503 @@
+/*
+ * resolver.c - Host name resolution off the request threads.
+ *
+ * getaddrinfo blocks the calling thread for as long as the DNS takes to
+ * answer, so every resolver runs a small pool of threads that do the actual
+ * resolving. A request thread starts a lookup, can do something else (or
+ * poll the lookup's eventfd along with other file descriptors) and then waits
+ * for the result. Lookups of a name that is already being resolved join the
+ * lookup in flight instead of asking again, so a burst of misses to one
+ * origin costs a single resolution.
+ *
+ * Instead of getaddrinfo, a resolver can also query a DNS server directly
+ * with a minimal stub resolver: it sends A and AAAA queries over UDP, retries
+ * them once on timeout and reads the addresses out of the answers, relying on
+ * the server to do the recursion (and to include the targets of CNAMEs).
+ * This bypasses /etc/hosts and nsswitch, which makes it possible to point
+ * the proxy at a local stand-in DNS server in tests.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "resolver.h"
+
+#define DNS_PORT 53
+
+/* Large enough for any query we send and any answer we accept over UDP */
+#define DNS_PACKET_SIZE 1232
+
+#define DNS_HEADER_SIZE 12
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+
+struct lookup_t {
+  struct resolver_t* resolver;
+  char* hostname;
+  // Callers that still have to call resolver_finish, plus one while the
+  // lookup is queued or being resolved
+  size_t references;
+  bool done;
+  // 0 or the EAI_* error of the lookup, once done
+  int error;
+  // The addresses found, with a port of 0
+  resolved_t result;
+  // Becomes readable once the lookup is done
+  int event_fd;
+  // Next lookup in flight, and next lookup waiting for a thread
+  struct lookup_t* next_in_flight;
+  struct lookup_t* next_queued;
+};
+
+struct resolver_t {
+  pthread_mutex_t lock;
+  // Signaled when a lookup is queued, broadcast when one finishes
+  pthread_cond_t queued;
+  pthread_cond_t finished;
+  // Lookups that are not done yet, which new lookups of the same name join
+  lookup_t* in_flight;
+  // Lookups waiting for a thread, oldest first
+  lookup_t* queue_head;
+  lookup_t* queue_tail;
+  // The DNS server queried directly, or an AF_UNSPEC address to use
+  // getaddrinfo instead
+  struct sockaddr_storage server;
+  socklen_t server_length;
+};
+
+/* Drops a reference to a lookup, freeing it with the last one. The resolver
+ * lock must be held. */
+static void release_lookup(lookup_t* lookup) {
+  if (--lookup->references > 0) {
+    return;
+  }
+  close(lookup->event_fd);
+  free(lookup->hostname);
+  free(lookup);
+}
+
+/* Adds an address to result, unless it is full */
+static void add_address(resolved_t* result, void* address, socklen_t length) {
+  if (result->count < MAX_RESOLVED_ADDRESSES) {
+    memcpy(&result->addresses[result->count], address, length);
+    result->lengths[result->count++] = length;
+  }
+}
+
+/* Resolves hostname with getaddrinfo. Returns 0 or the EAI_* error. */
+static int resolve_system(char* hostname, resolved_t* result) {
+  struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_flags = AI_ADDRCONFIG,
+  };
+  struct addrinfo* addresses;
+  int error = getaddrinfo(hostname, NULL, &hints, &addresses);
+  if (error != 0) {
+    return error;
+  }
+  for (struct addrinfo* curr = addresses; curr != NULL; curr = curr->ai_next) {
+    add_address(result, curr->ai_addr, curr->ai_addrlen);
+  }
+  freeaddrinfo(addresses);
+  return 0;
+}
+
+/* Adds hostname to result if it is an IPv4 or IPv6 address literal. Returns
+ * whether it was one. */
+static bool resolve_literal(char* hostname, resolved_t* result) {
+  struct sockaddr_in ipv4 = { .sin_family = AF_INET };
+  struct sockaddr_in6 ipv6 = { .sin6_family = AF_INET6 };
+  if (inet_pton(AF_INET, hostname, &ipv4.sin_addr) == 1) {
+    add_address(result, &ipv4, sizeof(ipv4));
+    return true;
+  }
+  if (inet_pton(AF_INET6, hostname, &ipv6.sin6_addr) == 1) {
+    add_address(result, &ipv6, sizeof(ipv6));
+    return true;
+  }
+  return false;
+}
+
+/* Writes a recursive query for the given record type of hostname into
+ * packet. Returns its length, or 0 if hostname is not a valid DNS name. */
+static size_t build_query(uint8_t* packet, uint16_t id, char* hostname,
+                          uint16_t type) {
+  memset(packet, 0, DNS_HEADER_SIZE);
+  packet[0] = id >> 8;
+  packet[1] = id & 0xff;
+  // Recursion desired, one question
+  packet[2] = 0x01;
+  packet[5] = 1;
+
+  size_t length = DNS_HEADER_SIZE;
+  char* label = hostname;
+  while (*label != '\0') {
+    char* dot = strchr(label, '.');
+    size_t label_length = dot != NULL ? (size_t) (dot - label) : strlen(label);
+    if (label_length == 0 || label_length > 63 ||
+        length + label_length + 1 > DNS_HEADER_SIZE + 255) {
+      return 0;
+    }
+    packet[length++] = label_length;
+    memcpy(&packet[length], label, label_length);
+    length += label_length;
+    label += label_length + (dot != NULL ? 1 : 0);
+  }
+  packet[length++] = 0;
+  packet[length++] = type >> 8;
+  packet[length++] = type & 0xff;
+  packet[length++] = 0;
+  packet[length++] = DNS_CLASS_IN;
+  return length;
+}
+
+/* Returns the offset just past the (possibly compressed) name at offset, or
+ * 0 if the packet ends first */
+static size_t skip_name(uint8_t* packet, size_t length, size_t offset) {
+  while (offset < length) {
+    uint8_t label_length = packet[offset];
+    if (label_length == 0) {
+      return offset + 1;
+    }
+    if ((label_length & 0xc0) == 0xc0) {
+      return offset + 2 <= length ? offset + 2 : 0;
+    }
+    offset += label_length + 1;
+  }
+  return 0;
+}
+
+/* Reads the A and AAAA records of an answer into result. Returns the
+ * response code of the answer, or -1 if it is malformed. */
+static int parse_answer(uint8_t* packet, size_t length, resolved_t* result) {
+  if (length < DNS_HEADER_SIZE) {
+    return -1;
+  }
+  int rcode = packet[3] & 0x0f;
+  size_t questions = packet[4] << 8 | packet[5];
+  size_t answers = packet[6] << 8 | packet[7];
+
+  size_t offset = DNS_HEADER_SIZE;
+  for (size_t i = 0; i < questions; i++) {
+    offset = skip_name(packet, length, offset);
+    if (offset == 0 || offset + 4 > length) {
+      return -1;
+    }
+    offset += 4;
+  }
+  for (size_t i = 0; i < answers; i++) {
+    offset = skip_name(packet, length, offset);
+    if (offset == 0 || offset + 10 > length) {
+      return -1;
+    }
+    uint16_t type = packet[offset] << 8 | packet[offset + 1];
+    uint16_t class = packet[offset + 2] << 8 | packet[offset + 3];
+    size_t data_length = packet[offset + 8] << 8 | packet[offset + 9];
+    offset += 10;
+    if (offset + data_length > length) {
+      return -1;
+    }
+    if (class == DNS_CLASS_IN && type == DNS_TYPE_A && data_length == 4) {
+      struct sockaddr_in address = { .sin_family = AF_INET };
+      memcpy(&address.sin_addr, &packet[offset], 4);
+      add_address(result, &address, sizeof(address));
+    }
+    else if (class == DNS_CLASS_IN && type == DNS_TYPE_AAAA &&
+             data_length == 16) {
+      struct sockaddr_in6 address = { .sin6_family = AF_INET6 };
+      memcpy(&address.sin6_addr, &packet[offset], 16);
+      add_address(result, &address, sizeof(address));
+    }
+    offset += data_length;
+  }
+  return rcode;
+}
+
+/* Resolves hostname by asking the resolver's DNS server for its AAAA and A
+ * records. Returns 0 or the EAI_* error getaddrinfo would have returned. */
+static int resolve_stub(resolver_t* resolver, char* hostname,
+                        resolved_t* result) {
+  if (resolve_literal(hostname, result)) {
+    return 0;
+  }
+
+  // IPv6 first, as RFC 8305 prefers it when both families are available
+  uint16_t types[2] = { DNS_TYPE_AAAA, DNS_TYPE_A };
+  uint8_t queries[2][DNS_PACKET_SIZE];
+  size_t query_lengths[2];
+  uint16_t ids[2];
+  if (getrandom(ids, sizeof(ids), 0) != sizeof(ids)) {
+    return EAI_SYSTEM;
+  }
+  for (size_t i = 0; i < 2; i++) {
+    query_lengths[i] = build_query(queries[i], ids[i], hostname, types[i]);
+    if (query_lengths[i] == 0) {
+      return EAI_NONAME;
+    }
+  }
+
+  int fd = socket(resolver->server.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*) &resolver->server,
+                        resolver->server_length) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return EAI_SYSTEM;
+  }
+
+  // The answers are kept apart so the addresses end up in query order
+  resolved_t answers[2] = { { .count = 0 }, { .count = 0 } };
+  int rcodes[2] = { -1, -1 };
+  for (int attempt = 0; attempt < DNS_QUERY_ATTEMPTS &&
+                        (rcodes[0] < 0 || rcodes[1] < 0); attempt++) {
+    for (size_t i = 0; i < 2; i++) {
+      if (rcodes[i] < 0) {
+        send(fd, queries[i], query_lengths[i], 0);
+      }
+    }
+    struct pollfd pending = { .fd = fd, .events = POLLIN };
+    while ((rcodes[0] < 0 || rcodes[1] < 0) &&
+           poll(&pending, 1, DNS_QUERY_TIMEOUT) > 0) {
+      uint8_t packet[DNS_PACKET_SIZE];
+      ssize_t length = recv(fd, packet, sizeof(packet), 0);
+      if (length < DNS_HEADER_SIZE || !(packet[2] & 0x80)) {
+        continue;
+      }
+      uint16_t id = packet[0] << 8 | packet[1];
+      for (size_t i = 0; i < 2; i++) {
+        if (id == ids[i] && rcodes[i] < 0) {
+          rcodes[i] = parse_answer(packet, length, &answers[i]);
+        }
+      }
+    }
+  }
+  close(fd);
+
+  for (size_t i = 0; i < 2; i++) {
+    for (size_t j = 0; j < answers[i].count; j++) {
+      add_address(result, &answers[i].addresses[j], answers[i].lengths[j]);
+    }
+  }
+  if (result->count > 0) {
+    return 0;
+  }
+  if (rcodes[0] == DNS_RCODE_NXDOMAIN || rcodes[1] == DNS_RCODE_NXDOMAIN) {
+    return EAI_NONAME;
+  }
+  if (rcodes[0] == 0 && rcodes[1] == 0) {
+    return EAI_NODATA;
+  }
+  if (rcodes[0] < 0 || rcodes[1] < 0 ||
+      rcodes[0] == DNS_RCODE_SERVFAIL || rcodes[1] == DNS_RCODE_SERVFAIL) {
+    return EAI_AGAIN;
+  }
+  return EAI_FAIL;
+}
+
+/* Takes queued lookups and resolves them, forever */
+static void* resolve_loop(void* arg) {
+  resolver_t* resolver = arg;
+  pthread_mutex_lock(&resolver->lock);
+  while (true) {
+    while (resolver->queue_head == NULL) {
+      pthread_cond_wait(&resolver->queued, &resolver->lock);
+    }
+    lookup_t* lookup = resolver->queue_head;
+    resolver->queue_head = lookup->next_queued;
+    if (resolver->queue_head == NULL) {
+      resolver->queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&resolver->lock);
+
+    int error = resolver->server.ss_family != AF_UNSPEC ?
+      resolve_stub(resolver, lookup->hostname, &lookup->result) :
+      resolve_system(lookup->hostname, &lookup->result);
+
+    pthread_mutex_lock(&resolver->lock);
+    lookup->error = error;
+    lookup->done = true;
+    lookup_t** curr = &resolver->in_flight;
+    while (*curr != lookup) {
+      curr = &(*curr)->next_in_flight;
+    }
+    *curr = lookup->next_in_flight;
+    uint64_t one = 1;
+    // A single write cannot overflow the eventfd, so this cannot fail
+    ssize_t written = write(lookup->event_fd, &one, sizeof(one));
+    (void) written;
+    pthread_cond_broadcast(&resolver->finished);
+    release_lookup(lookup);
+  }
+  return NULL;
+}
+
+/* Parses the address of a DNS server ("address[:port]", "[ipv6]:port" or
+ * "system") into resolver. Returns whether successful. */
+static bool parse_server(resolver_t* resolver, char* dns_server) {
+  char host[INET6_ADDRSTRLEN + 1] = "";
+  int port = DNS_PORT;
+  if (strcmp(dns_server, "system") == 0) {
+    // The first nameserver of /etc/resolv.conf
+    FILE* file = fopen("/etc/resolv.conf", "r");
+    if (file == NULL) {
+      return false;
+    }
+    char line[256];
+    while (host[0] == '\0' && fgets(line, sizeof(line), file) != NULL) {
+      if (sscanf(line, " nameserver %46s", host) != 1) {
+        host[0] = '\0';
+      }
+    }
+    fclose(file);
+  }
+  else {
+    char* colon = strrchr(dns_server, ':');
+    size_t host_length = strlen(dns_server);
+    if (dns_server[0] == '[') {
+      char* bracket = strchr(dns_server, ']');
+      if (bracket == NULL || (bracket[1] != '\0' && bracket[1] != ':')) {
+        return false;
+      }
+      dns_server++;
+      host_length = bracket - dns_server;
+      colon = bracket[1] == ':' ? bracket + 1 : NULL;
+    }
+    else if (colon != NULL && strchr(dns_server, ':') == colon) {
+      host_length = colon - dns_server;
+    }
+    else {
+      // Either no port or a bare IPv6 address
+      colon = NULL;
+    }
+    if (colon != NULL) {
+      port = atoi(colon + 1);
+    }
+    if (host_length >= sizeof(host) || port <= 0 || port > 65535) {
+      return false;
+    }
+    memcpy(host, dns_server, host_length);
+    host[host_length] = '\0';
+  }
+
+  resolved_t parsed = { .count = 0 };
+  if (!resolve_literal(host, &parsed)) {
+    return false;
+  }
+  memcpy(&resolver->server, &parsed.addresses[0], parsed.lengths[0]);
+  resolver->server_length = parsed.lengths[0];
+  if (resolver->server.ss_family == AF_INET) {
+    ((struct sockaddr_in*) &resolver->server)->sin_port = htons(port);
+  }
+  else {
+    ((struct sockaddr_in6*) &resolver->server)->sin6_port = htons(port);
+  }
+  return true;
+}
+
+resolver_t* resolver_init(size_t threads, char* dns_server) {
+  resolver_t* resolver = calloc(1, sizeof(resolver_t));
+  assert(resolver != NULL);
+  resolver->server.ss_family = AF_UNSPEC;
+  if (dns_server != NULL && !parse_server(resolver, dns_server)) {
+    free(resolver);
+    return NULL;
+  }
+  pthread_mutex_init(&resolver->lock, NULL);
+  pthread_cond_init(&resolver->queued, NULL);
+  pthread_cond_init(&resolver->finished, NULL);
+
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  for (size_t i = 0; i < (threads > 0 ? threads : 1); i++) {
+    pthread_t tid;
+    int error = pthread_create(&tid, &attributes, resolve_loop, resolver);
+    assert(error == 0);
+  }
+  pthread_attr_destroy(&attributes);
+  return resolver;
+}
+
+lookup_t* resolver_start(resolver_t* resolver, char* hostname) {
+  pthread_mutex_lock(&resolver->lock);
+  lookup_t* lookup = resolver->in_flight;
+  while (lookup != NULL && strcmp(lookup->hostname, hostname) != 0) {
+    lookup = lookup->next_in_flight;
+  }
+  if (lookup != NULL) {
+    lookup->references++;
+    pthread_mutex_unlock(&resolver->lock);
+    return lookup;
+  }
+
+  lookup = calloc(1, sizeof(lookup_t));
+  assert(lookup != NULL);
+  lookup->resolver = resolver;
+  lookup->hostname = strdup(hostname);
+  lookup->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  assert(lookup->hostname != NULL && lookup->event_fd >= 0);
+  // One reference for the caller and one for the resolver thread
+  lookup->references = 2;
+  lookup->next_in_flight = resolver->in_flight;
+  resolver->in_flight = lookup;
+  if (resolver->queue_tail != NULL) {
+    resolver->queue_tail->next_queued = lookup;
+  }
+  else {
+    resolver->queue_head = lookup;
+  }
+  resolver->queue_tail = lookup;
+  pthread_cond_signal(&resolver->queued);
+  pthread_mutex_unlock(&resolver->lock);
+  return lookup;
+}
+
+int resolver_fd(lookup_t* lookup) {
+  return lookup->event_fd;
+}
+
+int resolver_finish(lookup_t* lookup, int port, resolved_t* result) {
+  resolver_t* resolver = lookup->resolver;
+  pthread_mutex_lock(&resolver->lock);
+  while (!lookup->done) {
+    pthread_cond_wait(&resolver->finished, &resolver->lock);
+  }
+  int error = lookup->error;
+  *result = lookup->result;
+  release_lookup(lookup);
+  pthread_mutex_unlock(&resolver->lock);
+
+  for (size_t i = 0; i < result->count; i++) {
+    if (result->addresses[i].ss_family == AF_INET) {
+      ((struct sockaddr_in*) &result->addresses[i])->sin_port = htons(port);
+    }
+    else {
+      ((struct sockaddr_in6*) &result->addresses[i])->sin6_port = htons(port);
+    }
+  }
+  return error;
+}
+
+int resolver_lookup(resolver_t* resolver, char* hostname, int port,
+                    resolved_t* result) {
+  return resolver_finish(resolver_start(resolver, hostname), port, result);
+}
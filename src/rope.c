@@ -0,0 +1,147 @@
+/*
+ * rope.c - A byte sequence built from a chain of fixed-size chunks.
+ *
+ * A response read from an origin grows a few kilobytes at a time until the
+ * origin closes the connection. Growing one array for it means copying the
+ * whole response every time the array doubles, and leaves up to half of the
+ * array unused. A rope instead adds a chunk whenever the last one is full,
+ * and reads can go straight into the free space of the last chunk, so no
+ * byte is ever copied while the response grows.
+ *
+ * Chunks are taken from and given back to a pool shared by all threads, so
+ * the proxy does not go to malloc for every chunk of every response. The pool
+ * keeps at most ROPE_POOL_CHUNKS chunks; chunks beyond that are freed.
+ */
+
+#include "rope.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Most free chunks kept in the pool */
+#define ROPE_POOL_CHUNKS 512
+
+typedef struct chunk_t {
+    struct chunk_t *next;
+    size_t length;
+    uint8_t data[ROPE_CHUNK_SIZE];
+} chunk_t;
+
+struct rope_t {
+    chunk_t *first;
+    chunk_t *last;
+    size_t length;
+};
+
+/* Free chunks, linked through their next pointers */
+static chunk_t *pool = NULL;
+static size_t pool_size = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Takes an empty chunk from the pool, or allocates one if it is empty */
+static chunk_t *chunk_take(void) {
+    pthread_mutex_lock(&pool_lock);
+    chunk_t *chunk = pool;
+    if (chunk != NULL) {
+        pool = chunk->next;
+        pool_size--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (chunk == NULL) {
+        chunk = malloc(sizeof(chunk_t));
+        assert(chunk != NULL);
+    }
+    chunk->next = NULL;
+    chunk->length = 0;
+    return chunk;
+}
+
+/* Gives a chain of chunks back to the pool, freeing what does not fit */
+static void chunk_give(chunk_t *chunk) {
+    while (chunk != NULL) {
+        chunk_t *next = chunk->next;
+        pthread_mutex_lock(&pool_lock);
+        bool kept = pool_size < ROPE_POOL_CHUNKS;
+        if (kept) {
+            chunk->next = pool;
+            pool = chunk;
+            pool_size++;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        if (!kept) {
+            free(chunk);
+        }
+        chunk = next;
+    }
+}
+
+rope_t *rope_create(void) {
+    rope_t *rope = malloc(sizeof(*rope));
+    assert(rope != NULL);
+
+    rope->first = chunk_take();
+    rope->last = rope->first;
+    rope->length = 0;
+    return rope;
+}
+
+void rope_free(rope_t *rope) {
+    if (rope == NULL) {
+        return;
+    }
+
+    chunk_give(rope->first);
+    free(rope);
+}
+
+size_t rope_length(rope_t *rope) {
+    assert(rope != NULL);
+
+    return rope->length;
+}
+
+uint8_t *rope_reserve(rope_t *rope, size_t *available) {
+    if (rope->last->length == ROPE_CHUNK_SIZE) {
+        rope->last->next = chunk_take();
+        rope->last = rope->last->next;
+    }
+    *available = ROPE_CHUNK_SIZE - rope->last->length;
+    return rope->last->data + rope->last->length;
+}
+
+void rope_commit(rope_t *rope, size_t length) {
+    assert(rope->last->length + length <= ROPE_CHUNK_SIZE);
+
+    rope->last->length += length;
+    rope->length += length;
+}
+
+void rope_append_bytes(rope_t *rope, uint8_t *bytes, size_t length) {
+    while (length > 0) {
+        size_t available;
+        uint8_t *space = rope_reserve(rope, &available);
+        size_t copied = length < available ? length : available;
+        memcpy(space, bytes, copied);
+        rope_commit(rope, copied);
+        bytes += copied;
+        length -= copied;
+    }
+}
+
+void rope_clear(rope_t *rope) {
+    chunk_give(rope->first->next);
+    rope->first->next = NULL;
+    rope->first->length = 0;
+    rope->last = rope->first;
+    rope->length = 0;
+}
+
+buffer_t *rope_flatten(rope_t *rope) {
+    buffer_t *buf = buffer_create(rope->length);
+    for (chunk_t *chunk = rope->first; chunk != NULL; chunk = chunk->next) {
+        buffer_append_bytes(buf, chunk->data, chunk->length);
+    }
+    return buf;
+}
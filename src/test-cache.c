@@ -1,14 +1,24 @@
 #include <assert.h>
+#include <stdalign.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "arena.h"
+#include "budget.h"
 #include "buffer.h"
+#include "cache_key.h"
 #include "queue.h"
 #include "hash.h"
+#include "freshness.h"
+#include "front.h"
+#include "http.h"
+#include "prefetch.h"
+#include "rope.h"
 
 #define DEFAULT_CAPACITY 8
 
@@ -33,7 +43,299 @@ int main() {
 
 
   // Test that get returns the correct buffer string
-  assert(strcmp(buffer_string(get(cache, key1)), "de") == 0);
+  buffer_t *value = get(cache, key1);
+  assert(strcmp(buffer_string(value), "de") == 0);
+  buffer_free(value);
+
+  // Test that inserting the same key again replaces the old entry
+  buffer_t *buf2 = buffer_create(DEFAULT_CAPACITY);
+  buffer_append_char(buf2, 'f');
+  insert(cache, key1, buf2);
+  assert(get_cache_size(cache) == 1);
+  value = get(cache, key1);
+  assert(strcmp(buffer_string(value), "f") == 0);
+  buffer_free(value);
+
+  // Test that replacing a key in a full cache evicts nothing else
+  hash_t *full = hash_init_with_capacity(2);
+  buffer_t *first = buffer_create(DEFAULT_CAPACITY);
+  buffer_append_char(first, 'x');
+  insert(full, "x", first);
+  buffer_t *second = buffer_create(DEFAULT_CAPACITY);
+  buffer_append_char(second, 'y');
+  insert(full, "y", second);
+  buffer_t *replacement = buffer_create(DEFAULT_CAPACITY);
+  buffer_append_char(replacement, 'z');
+  insert(full, "y", replacement);
+  value = get(full, "x");
+  assert(value != NULL && get_cache_size(full) == 2);
+  buffer_free(value);
+  hash_free(full);
+
+  /* Freshness Test */
+  char *response =
+    "HTTP/1.0 200 OK\r\n"
+    "Cache-Control: public, max-age=60\r\n"
+    "ETag: \"v1\"\r\n"
+    "Last-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+    "\r\n"
+    "body";
+  freshness_t meta;
+  assert(freshness_parse((uint8_t *) response, strlen(response), 1000, &meta));
+  assert(meta.expires_at == 1060);
+  assert(strcmp(meta.etag, "\"v1\"") == 0);
+  assert(meta.last_modified == 784111777);
+  assert(freshness_is_fresh(&meta, 1059) && !freshness_is_fresh(&meta, 1060));
+
+  // Test that hash_refresh only replaces the metadata of the entry
+  buf1 = buffer_create(DEFAULT_CAPACITY);
+  buffer_append_char(buf1, 'g');
+  insert_with_meta(cache, key1, buf1, &meta);
+  assert(get_cache_size(cache) == 1);
+  char *not_modified = "HTTP/1.0 304 Not Modified\r\nExpires: 0\r\n\r\n";
+  freshness_update(&meta, (uint8_t *) not_modified, strlen(not_modified), 2000);
+  assert(meta.expires_at == 2000 && strcmp(meta.etag, "\"v1\"") == 0);
+  assert(hash_refresh(cache, key1, &meta));
+  freshness_t stored;
+  value = get_with_meta(cache, key1, &stored);
+  assert(strcmp(buffer_string(value), "g") == 0);
+  assert(stored.expires_at == 2000);
+  buffer_free(value);
+
+  // Test that a 304 without Cache-Control keeps the stored directives
+  char *no_cache =
+    "HTTP/1.0 200 OK\r\n"
+    "Cache-Control: no-cache, stale-if-error=60\r\n"
+    "ETag: \"v2\"\r\n"
+    "\r\n";
+  assert(freshness_parse((uint8_t *) no_cache, strlen(no_cache), 1000, &meta));
+  char *bare = "HTTP/1.0 304 Not Modified\r\nETag: \"v2\"\r\n\r\n";
+  freshness_update(&meta, (uint8_t *) bare, strlen(bare), 2000);
+  assert(!freshness_is_fresh(&meta, 2000) && meta.must_revalidate);
+  assert(meta.stale_if_error == 60);
+  assert(freshness_parse((uint8_t *) response, strlen(response), 1000, &meta));
+  freshness_update(&meta, (uint8_t *) bare, strlen(bare), 2000);
+  assert(meta.expires_at == 2060 && strcmp(meta.etag, "\"v2\"") == 0);
+
+  // Test that no-store responses are not cacheable
+  char *no_store = "HTTP/1.1 200 OK\r\nCache-Control: no-store\r\n\r\n";
+  assert(!freshness_parse((uint8_t *) no_store, strlen(no_store), 1000, &meta));
+
+  /* Range Test */
+  size_t range_first, range_last;
+  assert(http_parse_range("bytes=2-5", 10, &range_first, &range_last) ==
+         HTTP_RANGE_SATISFIABLE && range_first == 2 && range_last == 5);
+  assert(http_parse_range("bytes=8-", 10, &range_first, &range_last) ==
+         HTTP_RANGE_SATISFIABLE && range_first == 8 && range_last == 9);
+  assert(http_parse_range("bytes=-3", 10, &range_first, &range_last) ==
+         HTTP_RANGE_SATISFIABLE && range_first == 7 && range_last == 9);
+  assert(http_parse_range("bytes=5-100", 10, &range_first, &range_last) ==
+         HTTP_RANGE_SATISFIABLE && range_last == 9);
+  assert(http_parse_range("bytes=10-", 10, &range_first, &range_last) ==
+         HTTP_RANGE_UNSATISFIABLE);
+  assert(http_parse_range("bytes=0-1,4-5", 10, &range_first, &range_last) ==
+         HTTP_RANGE_IGNORED);
+  assert(http_parse_range("bytes=5-2", 10, &range_first, &range_last) ==
+         HTTP_RANGE_IGNORED);
+
+  // Test that If-Range only matches the strong validators of the response
+  size_t length = strlen(response);
+  assert(http_if_range_matches((uint8_t *) response, length, "\"v1\""));
+  assert(!http_if_range_matches((uint8_t *) response, length, "\"v2\""));
+  assert(!http_if_range_matches((uint8_t *) response, length, "W/\"v1\""));
+  assert(http_if_range_matches((uint8_t *) response, length,
+                               "Sun, 06 Nov 1994 08:49:37 GMT"));
+
+  /* Prefetch Test */
+  char *page =
+    "<html><head><link rel=stylesheet href=\"/a.css\">"
+    "<script src='app.js'></script></head>"
+    "<body><img src=\"http://example.com/b.png#top\">"
+    "<img src=\"//other.com/c.png\"><a href=\"/d.html\">d</a>"
+    "<img src=\"data:image/png;base64,xx\"><img src=/a.css></body></html>";
+  char *links[MAX_PREFETCH_LINKS];
+  size_t found = prefetch_find_links((uint8_t *) page, strlen(page),
+                                     "example.com", "/dir/index.html?x=1",
+                                     links, MAX_PREFETCH_LINKS);
+  assert(found == 3);
+  assert(strcmp(links[0], "/a.css") == 0);
+  assert(strcmp(links[1], "/dir/app.js") == 0);
+  assert(strcmp(links[2], "/b.png") == 0);
+  for (size_t i = 0; i < found; i++) {
+    free(links[i]);
+  }
+
+  // Test that Vary is normalized and Vary: * is not cacheable
+  char *varying =
+    "HTTP/1.1 200 OK\r\nVary: Accept-Encoding, User-Agent\r\n\r\n";
+  assert(freshness_parse((uint8_t *) varying, strlen(varying), 1000, &meta));
+  assert(strcmp(meta.vary, "accept-encoding,user-agent") == 0);
+  char *vary_all = "HTTP/1.1 200 OK\r\nVary: *\r\n\r\n";
+  assert(!freshness_parse((uint8_t *) vary_all, strlen(vary_all), 1000, &meta));
+
+  /* Arena Test */
+  arena_t *arena = arena_create();
+  char *small = arena_strdup(arena, "small");
+  uint8_t *large = arena_alloc(arena, ARENA_BLOCK_SIZE * 2);
+  memset(large, 'l', ARENA_BLOCK_SIZE * 2);
+  assert(strcmp(small, "small") == 0);
+  // Test that allocations are aligned and the arena can be used again
+  assert((uintptr_t) arena_alloc(arena, 3) % alignof(max_align_t) == 0);
+  arena_reset(arena);
+  assert(strcmp(arena_strndup(arena, "abc", 2), "ab") == 0);
+
+  /* Cache Key Test */
+  char *key = cache_key_make(arena, "Example.COM:80",
+                             "/a?b=2&utm_source=x&a=1", true, "utm_*,fbclid");
+  assert(strcmp(key, "example.com/a?a=1&b=2") == 0);
+  key = cache_key_make(arena, "example.com:8080", "/a?utm_source=x", false,
+                       "utm_*");
+  assert(strcmp(key, "example.com:8080/a") == 0);
+  key = cache_key_make(arena, "example.com", "/a?b=2&a=1", false, NULL);
+  assert(strcmp(key, "example.com/a?b=2&a=1") == 0);
+
+  // Test that a variant key names the headers that select it, and that it
+  // selects the same variant again without the request
+  char *request =
+    "GET /a HTTP/1.1\r\nAccept-Encoding: gzip\r\nHost: example.com\r\n\r\n";
+  char *variant = cache_key_variant(arena, key, "accept-encoding,user-agent",
+                                    request);
+  assert(strcmp(variant,
+                "example.com/a?b=2&a=1\r\naccept-encoding: gzip\r\n") == 0);
+  assert(cache_key_is_variant(variant) && !cache_key_is_variant(key));
+  assert(cache_key_url_length(variant) == strlen(key));
+  char *again = cache_key_variant(arena, variant, "accept-encoding,user-agent",
+                                  NULL);
+  assert(strcmp(again, variant) == 0);
+  arena_free(arena);
+
+  /* Rope Test */
+  rope_t *rope = rope_create();
+  uint8_t block[ROPE_CHUNK_SIZE / 3 + 1];
+  for (size_t i = 0; i < 7; i++) {
+    memset(block, 'a' + i, sizeof(block));
+    rope_append_bytes(rope, block, sizeof(block));
+  }
+  // Test that bytes read into the reserved space are added in place
+  size_t available;
+  uint8_t *space = rope_reserve(rope, &available);
+  assert(available > 0);
+  space[0] = 'z';
+  rope_commit(rope, 1);
+  assert(rope_length(rope) == 7 * sizeof(block) + 1);
+  buffer_t *flat = rope_flatten(rope);
+  assert(buffer_length(flat) == rope_length(rope));
+  for (size_t i = 0; i < 7; i++) {
+    assert(buffer_data(flat)[i * sizeof(block)] == 'a' + i);
+    assert(buffer_data(flat)[(i + 1) * sizeof(block) - 1] == 'a' + i);
+  }
+  assert(buffer_data(flat)[7 * sizeof(block)] == 'z');
+  buffer_free(flat);
+  rope_clear(rope);
+  assert(rope_length(rope) == 0);
+  rope_free(rope);
+
+  /* Front Cache Test */
+  buf1 = buffer_create(DEFAULT_CAPACITY);
+  buffer_append_char(buf1, 'h');
+  assert(freshness_parse((uint8_t *) response, strlen(response), 1000, &meta));
+  insert_with_meta(cache, "hot", buf1, &meta);
+  // Test that a key that keeps being hit is copied into the front cache (the
+  // thread may move between CPUs, so it is hit until it is)
+  value = NULL;
+  for (int i = 0; i < 10000 && value == NULL; i++) {
+    front_note_hit(cache, "hot");
+    value = front_get(cache, "hot", &stored);
+  }
+  assert(value != NULL && strcmp(buffer_string(value), "h") == 0);
+  assert(stored.expires_at == 1060);
+  buffer_free(value);
+  // Test that replacing the shared entry invalidates the copy
+  buf1 = buffer_create(DEFAULT_CAPACITY);
+  buffer_append_char(buf1, 'i');
+  insert_with_meta(cache, "hot", buf1, &meta);
+  assert(front_get(cache, "hot", &stored) == NULL);
+
+  /* Reclaimer Test */
+  hash_t *reclaimed = hash_init_with_capacity(100);
+  hash_start_reclaimer(reclaimed, 50, 80);
+  char entry_key[] = "k0";
+  for (char i = '0'; i <= '8'; i++) {
+    entry_key[1] = i;
+    buffer_t *entry = buffer_create(DEFAULT_CAPACITY);
+    buffer_append_bytes(entry, (uint8_t *) "0123456789", 10);
+    insert(reclaimed, entry_key, entry);
+  }
+  // Test that going over the high watermark evicts the least recently used
+  // entries down to the low watermark in the background
+  for (int i = 0; i < 1000 && get_cache_size(reclaimed) > 50; i++) {
+    usleep(1000);
+  }
+  assert(get_cache_size(reclaimed) == 50);
+  assert(!contains(reclaimed, "k0") && contains(reclaimed, "k8"));
+  hash_free(reclaimed);
+
+  /* Budget Test */
+  double pressure;
+  char *psi = "some avg10=12.50 avg60=3.00 avg300=1.00 total=100\n"
+              "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n";
+  assert(budget_parse_pressure(psi, &pressure) && pressure == 12.5);
+  assert(!budget_parse_pressure("full avg10=1.00\n", &pressure));
+  // Test that the budget is cut under pressure and grows back without it,
+  // within its bounds
+  assert(budget_next(1000, 100, 1000, 50, 12.5) == 750);
+  assert(budget_next(120, 100, 1000, 50, 50) == 100);
+  assert(budget_next(750, 100, 1000, 50, 5) == 750);
+  assert(budget_next(750, 100, 1000, 50, 0) == 800);
+  assert(budget_next(980, 100, 1000, 50, 0) == 1000);
+  assert(budget_next(800, 100, 500, 50, 0) == 500);
+
+  // Test that lowering the capacity limits later inserts
+  hash_t *shrinking = hash_init_with_capacity(4);
+  hash_set_capacity(shrinking, 1);
+  buffer_t *big = buffer_create(DEFAULT_CAPACITY);
+  buffer_append_bytes(big, (uint8_t *) "ab", 2);
+  insert(shrinking, "big", big);
+  assert(!contains(shrinking, "big") && get_cache_capacity(shrinking) == 1);
+  hash_free(shrinking);
+
+  /* Dedup Test */
+  hash_t *deduped = hash_init_with_capacity(4096);
+  uint8_t shared[BODY_MIN_SHARED];
+  memset(shared, 'x', sizeof(shared));
+  char *heads[] = {"HTTP/1.1 200 OK\r\nETag: \"a\"\r\n\r\n",
+                   "HTTP/1.1 200 OK\r\nETag: \"bb\"\r\n\r\n"};
+  char *dedup_keys[] = {"/a.js", "/a.js?v=2"};
+  for (int i = 0; i < 2; i++) {
+    buffer_t *response = buffer_create(DEFAULT_CAPACITY);
+    buffer_append_bytes(response, (uint8_t *) heads[i], strlen(heads[i]));
+    buffer_append_bytes(response, shared, sizeof(shared));
+    insert(deduped, dedup_keys[i], response);
+  }
+  // Test that the body of both entries is only counted once
+  assert(get_cache_size(deduped) ==
+         strlen(heads[0]) + strlen(heads[1]) + sizeof(shared));
+  assert(get_dedup_bytes(deduped) == sizeof(shared));
+  // Test that each entry still returns its own headers with the body
+  for (int i = 0; i < 2; i++) {
+    buffer_t *response = get(deduped, dedup_keys[i]);
+    size_t head_length = strlen(heads[i]);
+    assert(buffer_length(response) == head_length + sizeof(shared));
+    assert(memcmp(buffer_data(response), heads[i], head_length) == 0);
+    assert(memcmp(buffer_data(response) + head_length, shared,
+                  sizeof(shared)) == 0);
+    buffer_free(response);
+  }
+  // Test that removing one entry keeps the body of the other
+  hash_remove(deduped);
+  assert(!contains(deduped, dedup_keys[0]));
+  assert(get_cache_size(deduped) == strlen(heads[1]) + sizeof(shared));
+  assert(get_dedup_bytes(deduped) == 0);
+  value = get(deduped, dedup_keys[1]);
+  assert(memcmp(buffer_data(value) + strlen(heads[1]), shared,
+                sizeof(shared)) == 0);
+  buffer_free(value);
+  hash_free(deduped);
 
   // Test hash_free, should pass and give no leaks or errors
   hash_free(cache);
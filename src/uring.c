@@ -0,0 +1,185 @@
+/*
+ * uring.c - Accepting connections through io_uring.
+ *
+ * A plain accept loop makes one system call per connection. With io_uring,
+ * a single multishot accept request keeps producing a completion for every
+ * connection the kernel accepts, and a burst of connections is reaped from
+ * the completion ring with one io_uring_enter (or none at all, when the
+ * completions are already there). The listening socket is registered with
+ * the ring, so the kernel does not look it up again for every connection.
+ *
+ * The ring is driven with the raw system calls instead of liburing, which is
+ * not available everywhere we build. Kernels without io_uring make
+ * uring_acceptor_init fail, and kernels without multishot accept (before
+ * 5.19) fail the first accept request, after which uring_accept quietly
+ * falls back to accept.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/* Completions the ring can hold before the kernel has to wait for us */
+#define RING_ENTRIES 64
+
+struct uring_acceptor_t {
+  int listen_fd;
+  int ring_fd;
+  // Whether the kernel rejected the multishot accept, so accept is used
+  bool fallback;
+  // Whether the accept request has to be queued (again)
+  bool arm;
+  // Queued requests the kernel has not picked up yet
+  unsigned pending;
+  // The submission queue
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  // The completion queue
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit,
+                          unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+static int io_uring_register(int ring_fd, unsigned opcode, void* arg,
+                             unsigned count) {
+  return syscall(__NR_io_uring_register, ring_fd, opcode, arg, count);
+}
+
+/* Queues the multishot accept on the registered listening socket */
+static void queue_accept(uring_acceptor_t* acceptor) {
+  unsigned tail = *acceptor->sq_tail;
+  unsigned index = tail & *acceptor->sq_mask;
+  struct io_uring_sqe* sqe = &acceptor->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_ACCEPT;
+  // Index 0 of the registered files
+  sqe->fd = 0;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  acceptor->sq_array[index] = index;
+  __atomic_store_n(acceptor->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+uring_acceptor_t* uring_acceptor_init(int listen_fd) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ring_fd = io_uring_setup(RING_ENTRIES, &params);
+  if (ring_fd < 0) {
+    return NULL;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes +
+                   params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && cq_size > sq_size) {
+    sq_size = cq_size;
+  }
+  uint8_t* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  uint8_t* cq = single_mmap ? sq :
+    mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+         ring_fd, IORING_OFF_CQ_RING);
+  struct io_uring_sqe* sqes =
+    mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+         IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED ||
+      io_uring_register(ring_fd, IORING_REGISTER_FILES, &listen_fd, 1) < 0) {
+    // Every listener sets up its own ring, so unmap whatever was mapped
+    if (sqes != MAP_FAILED) {
+      munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (cq != MAP_FAILED && !single_mmap) {
+      munmap(cq, cq_size);
+    }
+    if (sq != MAP_FAILED) {
+      munmap(sq, sq_size);
+    }
+    close(ring_fd);
+    return NULL;
+  }
+
+  uring_acceptor_t* acceptor = malloc(sizeof(uring_acceptor_t));
+  assert(acceptor != NULL);
+  acceptor->listen_fd = listen_fd;
+  acceptor->ring_fd = ring_fd;
+  acceptor->fallback = false;
+  acceptor->arm = true;
+  acceptor->pending = 0;
+  acceptor->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+  acceptor->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+  acceptor->sq_array = (unsigned*) (sq + params.sq_off.array);
+  acceptor->sqes = sqes;
+  acceptor->cq_head = (unsigned*) (cq + params.cq_off.head);
+  acceptor->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+  acceptor->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+  acceptor->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+  return acceptor;
+}
+
+int uring_accept(uring_acceptor_t* acceptor) {
+  while (!acceptor->fallback) {
+    // Reap a completion if there is one
+    unsigned head = *acceptor->cq_head;
+    if (head != __atomic_load_n(acceptor->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe* cqe = &acceptor->cqes[head & *acceptor->cq_mask];
+      int result = cqe->res;
+      // Without IORING_CQE_F_MORE, the accept request is finished
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        acceptor->arm = true;
+      }
+      __atomic_store_n(acceptor->cq_head, head + 1, __ATOMIC_RELEASE);
+      if (result >= 0) {
+        return result;
+      }
+      if (result == -EINVAL || result == -EOPNOTSUPP) {
+        acceptor->fallback = true;
+        break;
+      }
+      errno = -result;
+      return -1;
+    }
+
+    // Otherwise (re)submit the accept if needed and wait for a completion
+    if (acceptor->arm) {
+      queue_accept(acceptor);
+      acceptor->arm = false;
+      acceptor->pending++;
+    }
+    int submitted = io_uring_enter(acceptor->ring_fd, acceptor->pending, 1,
+                                   IORING_ENTER_GETEVENTS);
+    if (submitted < 0 && errno != EINTR) {
+      acceptor->fallback = true;
+      break;
+    }
+    if (submitted > 0) {
+      acceptor->pending -= submitted;
+    }
+  }
+  return accept(acceptor->listen_fd, NULL, NULL);
+}
@@ -0,0 +1,40 @@
+# Benchmarks the proxy against a local bench-origin, without touching the
+# Internet. Any arguments are passed on to bench-load, e.g.
+#   make bench BENCH_ARGS="-c 64 -r 2000 -d 10 -s fixed:4096"
+# PROXY_ARGS and ORIGIN_ARGS in the environment replace the options of the
+# proxy and of bench-origin; ORIGIN_ARGS=-D gives every object of a size the
+# same body, to measure what storing identical bodies once gains.
+
+PROXY_PORT=${PROXY_PORT:-15080}
+ORIGIN_PORT=${ORIGIN_PORT:-15081}
+# Every request goes to the same origin, so the per-origin cap would turn
+# most of a heavy load away with 503s instead of measuring the proxy
+PROXY_ARGS=${PROXY_ARGS:---origin-concurrency 0}
+ORIGIN_ARGS=${ORIGIN_ARGS:-}
+
+# Waits until something accepts connections on a local port, for at most 5s
+wait_for_port() {
+    for i in $(seq 50); do
+        if (exec 3<> /dev/tcp/127.0.0.1/$1) 2> /dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "Nothing is listening on port $1" >&2
+    return 1
+}
+
+./bin/bench-origin $ORIGIN_ARGS $ORIGIN_PORT > /dev/null &
+ORIGIN_PID=$!
+./bin/proxy $PROXY_ARGS $PROXY_PORT > /dev/null &
+PROXY_PID=$!
+
+# Don't leave the servers bound to their ports if we are interrupted
+trap 'kill $LOAD_PID $PROXY_PID $ORIGIN_PID 2> /dev/null' EXIT
+
+wait_for_port $ORIGIN_PORT && wait_for_port $PROXY_PORT || exit 1
+
+# Runs in the background so that a signal interrupts the wait right away
+./bin/bench-load "$@" $PROXY_PORT $ORIGIN_PORT &
+LOAD_PID=$!
+wait $LOAD_PID
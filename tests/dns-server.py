@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+# A stand-in DNS server for testing the proxy's stub resolver. Answers A
+# queries for the names given on the command line, NXDOMAIN for any other
+# name and an empty answer for every other record type. Prints one line per
+# query received, so tests can count how many queries a lookup cost.
+#
+#   dns-server.py [-d delay-ms] <port> name=address...
+
+import socket
+import struct
+import sys
+import threading
+import time
+from optparse import OptionParser
+
+
+def parse_question(packet):
+    """Returns the name and record type of the question of a query."""
+    labels = []
+    offset = 12
+    while packet[offset] != 0:
+        length = packet[offset]
+        labels.append(packet[offset + 1:offset + 1 + length].decode())
+        offset += length + 1
+    qtype, = struct.unpack("!H", packet[offset + 1:offset + 3])
+    return ".".join(labels).lower(), qtype, offset + 5
+
+
+def answer(packet, records):
+    name, qtype, end = parse_question(packet)
+    query_id, = struct.unpack("!H", packet[:2])
+    address = records.get(name)
+    rcode = 0 if address is not None else 3
+    answers = b""
+    if address is not None and qtype == 1:
+        # A pointer to the name in the question, then the A record
+        answers = struct.pack("!HHHIH", 0xc00c, 1, 1, 60, 4) + \
+            socket.inet_aton(address)
+    header = struct.pack("!HHHHHH", query_id, 0x8180 | rcode, 1,
+                         1 if answers else 0, 0, 0)
+    return name, qtype, header + packet[12:end] + answers
+
+
+def main():
+    parser = OptionParser(usage="%prog [-d delay-ms] <port> name=address...")
+    parser.add_option("-d", type="int", dest="delay", default=0,
+                      help="delay every answer by this many milliseconds")
+    options, args = parser.parse_args()
+    if len(args) < 1:
+        parser.error("missing port")
+    records = dict(arg.lower().split("=", 1) for arg in args[1:])
+
+    server = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    server.bind(("127.0.0.1", int(args[0])))
+    lock = threading.Lock()
+
+    def reply(packet, client):
+        time.sleep(options.delay / 1000)
+        name, qtype, response = answer(packet, records)
+        with lock:
+            print("query %s %d" % (name, qtype), flush=True)
+        server.sendto(response, client)
+
+    while True:
+        packet, client = server.recvfrom(512)
+        threading.Thread(target=reply, args=(packet, client), daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,59 @@
+# Tests the proxy's stub resolver against tests/dns-server.py, a local
+# stand-in DNS server: known names must resolve, unknown ones must fail with
+# 502 Bad Gateway, and concurrent misses to one name must share one lookup.
+
+PROXY_PORT=${PROXY_PORT:-15090}
+ORIGIN_PORT=${ORIGIN_PORT:-15091}
+DNS_PORT=${DNS_PORT:-15053}
+QUERIES=$(mktemp)
+
+# Waits until something accepts connections on a local port, for at most 5s
+wait_for_port() {
+    for i in $(seq 50); do
+        if (exec 3<> /dev/tcp/127.0.0.1/$1) 2> /dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "Nothing is listening on port $1" >&2
+    return 1
+}
+
+fail() {
+    echo -e "\u001b[31mFailed: $1.\u001b[0m"
+    exit 1
+}
+
+# Answers are delayed so that concurrent lookups overlap
+./tests/dns-server.py -d 300 $DNS_PORT origin.test=127.0.0.1 > $QUERIES &
+DNS_PID=$!
+./bin/bench-origin $ORIGIN_PORT > /dev/null &
+ORIGIN_PID=$!
+./bin/proxy --dns-server 127.0.0.1:$DNS_PORT $PROXY_PORT > /dev/null &
+PROXY_PID=$!
+trap 'kill $PROXY_PID $ORIGIN_PID $DNS_PID 2> /dev/null; rm -f $QUERIES' EXIT
+
+wait_for_port $ORIGIN_PORT && wait_for_port $PROXY_PORT || exit 1
+
+get() {
+    curl --proxy localhost:$PROXY_PORT --silent --output /dev/null \
+        --write-out "%{http_code}" http://$1:$ORIGIN_PORT$2
+}
+
+pids=""
+for i in $(seq 8); do
+    (test "$(get origin.test "/obj/$i?size=100")" = 200) &
+    pids="$pids $!"
+done
+for pid in $pids; do
+    wait $pid || fail "origin.test did not resolve"
+done
+
+# One A and one AAAA query for all eight misses
+count=$(grep -c "query origin.test" $QUERIES)
+test "$count" = 2 || fail "8 concurrent misses sent $count queries"
+
+test "$(get missing.test "/obj/1?size=100")" = 502 ||
+    fail "missing.test did not fail"
+
+echo -e "\u001b[32;1mSuccess.\u001b[0m"